@@ -3,6 +3,8 @@
 #include "imnodes.h"
 #include "value.h"
 #include "edit_operation.h"
+#include "execution_plan.h"
+#include "counter_random.h"
 
 #include <imgui.h>
 #include <imgui_internal.h>
@@ -22,14 +24,30 @@
 
 #define BACKGROUND_IMAGE_RESOLUTION 64
 #define NUM_IMAGES 3
+// A function's body parsed once from its json. Nodes are indexed by their local (json)
+// index, so instantiating is a copy of m_nodes plus an offset. Holes have m_index NULL_INDEX.
+class FunctionTemplate {
+public:
+	vector<Value>			 m_nodes;
+	vector<std::string>		 m_names;
+	vector<ImVec2>			 m_offsets;
+	ImVec2					 m_average_offset;
+	vector<Socket>			 m_input_nodes;
+	vector<Socket>			 m_output_nodes;
+	vector<FunctionNodeData> m_function_node_data;
+
+	void from_json(const json& j);
+};
+
 class Function {
 public:
-	char		m_name[128]{ "" };
-	unsigned	m_id{ 0 };
-	json		m_json;
-	int			m_num_inputs;
-	int			m_num_outputs;
-	bool		m_is_open{ false };
+	char			 m_name[128]{ "" };
+	unsigned		 m_id{ 0 };
+	json			 m_json;
+	FunctionTemplate m_template;	// has to be rebuilt whenever m_json changes
+	int				 m_num_inputs;
+	int				 m_num_outputs;
+	bool			 m_is_open{ false };
 };
 
 // Define a structure to hold the data
@@ -76,17 +94,24 @@ public:
 
 	bool load(const char* filename);
 
+	// Loading is split so the file can be read off the main thread, set_data touches bgfx
+	static bool read_csv(const char* filename, vector<DataPoint>& data);
+
+	void set_data(vector<DataPoint> new_data);
+
 	void update_image(ComputationGraph* graph = nullptr);
 	void show_body(int attribute_index, float size);
 };
 
 class ComputationGraph {
 public:
-	bool				   used[MAX_NODES];
-	Value				   values[MAX_NODES];
-	float				   gradient_acc[MAX_NODES];
-	Index				   parent[MAX_NODES];
-	FunctionNodeData	   function_node_data[MAX_NODES];
+	// Node storage grows with get_new_value, so a graph only pays for the nodes it
+	// actually holds. MAX_NODES is the upper bound, not the allocation size.
+	vector<bool>			   used;
+	vector<Value>			   values;
+	vector<Index>			   parent;
+	vector<FunctionNodeData>   function_node_data;
+	vector<float>			   gradient_acc;	// indexed like plan.parameters
 	Index				   current_backwards_node = NULL_INDEX;
 	Index				   current_result_node = NULL_INDEX;
 	Index				   next_free_index = 0;
@@ -95,16 +120,29 @@ public:
 	double				   time_right_mouse_pressed = 0.;
 	ImVec2				   right_mouse_pressed_pos = ImVec2();
 	int					   last_node_hovered = -1;
+	// While a parameter is hovered every node shows its derivative with respect to it
+	Index				   sensitivity_parameter = NULL_INDEX;
+	vector<float>		   sensitivities;	// by node
 	ImNodesMiniMapLocation minimap_location;
 	DataSource			   data_source;
 	vector<Index>		   nodes_to_select;
+	std::string			   name_before_edit;	// of the text being typed in a node, until it's committed
+
+	// Compiled evaluation order, rebuilt lazily whenever the structure of the graph changes
+	ExecutionPlan		   plan;
+	bool				   plan_dirty = true;
+	unsigned			   plan_version = 0;	// bumped every time the plan gets recompiled
+	uint64_t			   parameter_seed = 0;	// stream randomize_parameters draws from next
 
-	std::map<Index, std::vector<Index>> cached_topological_sorted_descendants;
-	unordered_set <Index> cached_no_parent;
-	vector<Index> cached_sorted_descendants;
+	// Function graphs record every applied, undone and redone edit so they can be
+	// replayed on the function's instances
+	bool				   record_edits = false;
+	vector<EditOperation>  recorded_edits;
 
 	void clear();
 
+	void reserve(size_t num_nodes);
+
 	ComputationGraph() {
 		printf("Computation Graph constructor\n");
 
@@ -117,17 +155,30 @@ public:
 
 	Index collapse_to_function(Index* indices, size_t num_indices, ImVec2 pos, int function_id);
 
+	// Copies the function's nodes into the graph under a new Function node. Each instance
+	// keeps its own copy here, that's what gets drawn, saved and has edits propagated to it.
+	// Only the plan shares one compiled body between instances.
 	Index instantiate_function(int function_id, const ImVec2& pos, const vector<Function>& functions);
 
 	Index get_new_value();
 
+	// Grows the storage by a contiguous block of unused nodes and returns its first index
+	Index allocate_values(Index count);
+
 	void delete_value_and_return_removed_connections(Index index, vector<Connection>& removed_connections);
 
 	void randomize_parameters();
+
+	// Appends nodes computing the gradient of output with respect to each of the wrt nodes, as
+	// one undoable edit. They're ordinary nodes, so they compile like the rest of the graph and
+	// can be differentiated again. Returns a display node per wrt node.
+	vector<Index> emit_gradient_graph(Index output, const vector<Index>& wrt);
 	
 	void do_stochastic_gradient_descent_step(float learning_rate);
 	void do_stochastic_gradient_descent(float learning_rate, int batch_size, int& current_point, vector<int>& shuffled_points);
 
+	void compile_plan();
+
 	void forwards(float* data_values);
 	void backwards(float* data_values);
 
@@ -159,6 +210,19 @@ public:
 
 	void redo();
 
+	// Replays an edit made in a function's own graph on one instance of it in this graph,
+	// input_feeds are the sockets feeding each of the instance's input pins. The nodes and
+	// links change through apply_operation, none of them final. data is a copy of the
+	// instance's function data that gets its frame and pins updated, set it with
+	// EditOperation::set_function_data once the instance is done.
+	void apply_function_edit(Index instance, FunctionNodeData& data, const EditOperation& edit, const ComputationGraph& function_graph, const vector<Socket>& input_feeds);
+
+	// Points an instance's pins in data at its nodes for the function's current template
+	void rebind_function_pins(Index instance, FunctionNodeData& data, const FunctionTemplate& function_template, const vector<Socket>& input_feeds);
+
+	// Json for a function edited in its own graph, with the graph's indices as local indices
+	json to_function_json() const;
+
 	void copy_selected_nodes(const ImVec2& origin);
 
 	void paste(const ImVec2& origin);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "computation_graph.h"
+#include "trainer.h"
 
 class Context {
 public:
@@ -8,6 +9,7 @@ public:
 	ComputationGraph		   main_graph;
 	float					   learning_rate = 0.01f;
 	int						   batch_size = 50;
+	int						   sequence_window = 16;
 	int						   training_steps = 0;
 	int						   training_steps_this_interval = 0;
 	float					   current_average_error = 0;
@@ -17,9 +19,18 @@ public:
 
 	double					   tps_last_time;
 
-	vector<int>				   m_shuffled_data_points;	
-	int						   m_current_shuffled_data_point;	
 	bool					   m_training = false;	
+	Trainer					   trainer;
+	TrainingSnapshot		   training_snapshot;	// the one last shown in the editor
+	unsigned				   trained_plan_version = 0;
+	TrainingMode			   training_mode = TrainingMode::Synchronous;
+	int						   training_workers = 4;
+	OptimizerType			   optimizer_type = OptimizerType::SGD;
+	bool					   gradient_checkpointing = false;
+	Precision				   gradient_precision = Precision::Float;
+	int						   target_fps = 60;
+	float					   frame_time = 0.f;	// smoothed
+	float					   training_duty_cycle = 1.f;
 
 	Context() {
 	}
@@ -34,11 +45,20 @@ public:
 
 	void show_function_list(bool* open);
 
+	void propagate_function_edits(int function_id);
+
 	void create_function_graph(int function_index);
 
 	void show(bool* open);
 
+	// Backs the trainer off while frames take longer than the target and lets it
+	// creep back up while there's headroom
+	void pace_training();
+
 	void save(const char* filename);
 
+	// Reads the file in the background and swaps the graph out on the main thread next frame
 	void load(const char* filename);
+
+	void apply_loaded(const json& content);
 };
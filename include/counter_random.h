@@ -0,0 +1,28 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+// Counter based random numbers. The nth number of a stream is a hash of the seed and n, so
+// any thread can produce any part of a stream without sharing generator state, and the
+// numbers don't depend on which thread asked for them or in what order.
+inline uint64_t counter_random(uint64_t seed, uint64_t counter) {
+	// splitmix64 finalizer
+	uint64_t z = seed * 0x9E3779B97F4A7C15ull + counter + 0x9E3779B97F4A7C15ull;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// Uniform in [min, max)
+inline float counter_random_range(uint64_t seed, uint64_t counter, float min, float max) {
+	float unit = (float)(counter_random(seed, counter) >> 40) / (float)(1ull << 24);
+	return min + (max - min) * unit;
+}
+
+// Standard normal, Box-Muller over two numbers of the stream
+inline float counter_random_normal(uint64_t seed, uint64_t counter) {
+	float u = ((float)(counter_random(seed, counter * 2) >> 40) + 1.f) / (float)((1ull << 24) + 1);
+	float v = (float)(counter_random(seed, counter * 2 + 1) >> 40) / (float)(1ull << 24);
+	return sqrtf(-2.f * logf(u)) * cosf(6.28318530718f * v);
+}
@@ -1,32 +1,46 @@
 #pragma once
 #include "value.h"
+#include <string>
 
 class ComputationGraph;
 class Context;
 
 enum class EditOperationType {
 	AddNode,
+	AddNodes,
 	RemoveNode,
 	AddLink,
 	RemoveLink,
 	MoveNodes,
+	SetFunctionData,
+	SetName,
 };
 
 class EditOperation {
 public:
 	EditOperationType m_type		  = EditOperationType::AddNode;
 	Value			  m_value		  = Value();
+	vector<Value>	  m_values;		  // AddNodes, each value carries its preallocated index
+	vector<std::string> m_names;	  // AddNodes, the values' names. The graph gets copies of its own. SetName, the new name then the old.
+	vector<FunctionNodeData> m_function_node_data;	// AddNodes, for the Function values. SetFunctionData, the new data then the old.
 	Index			  m_index		  = NULL_INDEX;
 	Index			  m_previousIndex = NULL_INDEX;
 	Connection		  m_connection	  = Connection();
+	Socket			  m_previous_start = Socket();	// AddLink, what the input was connected to before
 	ImVec2			  m_pos_delta	  = ImVec2();
 	bool			  m_final		  = false;
 
 	void EditOperation::apply(ComputationGraph* context);
 	void EditOperation::undo(ComputationGraph* context);
+	EditOperation inverse() const;
 	static EditOperation add_node(const Value& value, const bool _final = true);
+	// names and function_node_data are per value, function_node_data can be left empty
+	static EditOperation add_nodes(const vector<Value>& values, const vector<std::string>& names,
+		const vector<FunctionNodeData>& function_node_data = {}, const bool _final = true);
 	static EditOperation remove_node(const Index index, const bool _final = true);
 	static EditOperation add_connection(const Connection& connection, const bool _final = true);
 	static EditOperation remove_link(const Connection& connection, const Index index, const bool _final = true);
 	static EditOperation move_node(const Index index, const ImVec2& delta, const bool _final = true);
+	static EditOperation set_function_data(const Index index, const FunctionNodeData& data, const bool _final = true);
+	static EditOperation set_name(const Index index, const char* name, const bool _final = true);
 };
@@ -0,0 +1,320 @@
+#pragma once
+
+#include "value.h"
+#include "task_pool.h"
+#include "plugin_ops.h"
+#include "expression.h"
+
+#include <vector>
+
+class ComputationGraph;
+class GradientSum;
+
+// A register is a single float slot in the plan's value and gradient arrays. Every
+// node output gets one, data source nodes get one per column (x, y, label).
+typedef unsigned Register;
+
+// Body operands with this bit set refer to a port of the call instead of a frame register.
+#define PORT_FLAG 0x80000000u
+
+struct Instruction {
+	Operation op{ Operation::Add };
+	Register  out{ NULL_INDEX };
+	// Unconnected inputs are NULL_INDEX. For Operation::Function instructions in[0]
+	// is the index of the call group to run, variadic ones have their operands at
+	// in[0] in the plan's operands and in[1] of them. Expressions have their program
+	// in in[1], and as many operands as it has inputs.
+	Register  in[2]{ NULL_INDEX, NULL_INDEX };
+
+	friend bool operator==(const Instruction& l, const Instruction& r) {
+		return l.op == r.op && l.out == r.out && l.in[0] == r.in[0] && l.in[1] == r.in[1];
+	}
+};
+
+// Compiled code for a function, shared by every instance with the same structure.
+// Registers are relative to the instance's frame, inputs coming from outside the
+// function are ports, bound per instance. The sharing stops at the plan: the graph still
+// has a copy of the body's nodes per instance, compiled from and trained back into.
+class FunctionBody {
+public:
+	short				m_function_id{ -1 };
+	unsigned			m_frame_size{ 0 };
+	unsigned			m_num_ports{ 0 };
+	vector<Instruction> m_code;
+};
+
+// One function instance: where its frame starts and where its port bindings live.
+struct Call {
+	Register frame;
+	unsigned first_port;
+};
+
+// Levels with at least this many instruction runs get split into chunks and run on the
+// task pool, each chunk being roughly this much work.
+#define PARALLEL_MIN_LEVEL_WORK 2048
+#define PARALLEL_CHUNK_WORK		256
+
+// A piece of a wide level run as one task: a run of plain instructions, or some of the calls
+// of a call group. In the backwards pass each chunk writes the gradients for its inputs to
+// its own scratch slots, those get summed into the input registers afterwards so chunks
+// sharing an input don't race.
+struct LevelChunk {
+	unsigned begin{ 0 };			// plain instructions, positions in code or backwards_code
+	unsigned end{ 0 };
+	unsigned group{ NULL_INDEX };	// call groups, calls are relative to the group
+	unsigned first_call{ 0 };
+	unsigned num_calls{ 0 };
+	unsigned scratch{ 0 };			// backwards only, first slot in gradients past the registers
+};
+
+// Instances of the same body on the same topological level. They don't depend on each
+// other so the body is run one instruction at a time across all of them.
+struct CallGroup {
+	unsigned body;
+	unsigned first_call;
+	unsigned num_calls;
+};
+
+class ExecutionPlan {
+public:
+	vector<Instruction>  code;
+	vector<unsigned>	 backwards_code;	// indices into code, in forward order
+	vector<FunctionBody> bodies;
+	vector<Call>		 calls;
+	vector<CallGroup>	 call_groups;
+	vector<Register>	 call_ports;
+	vector<Register>	 operands;		// of variadic instructions
+	vector<PluginOp>	 plugin_ops;	// the registry's when compiled, the trainer's copy can't see it change
+	vector<Expression>	 expressions;	// one per distinct formula
+
+	vector<Register>	 node_register;		// indexed by graph node, NULL_INDEX if it has none
+	vector<Index>		 parameters;
+	vector<Register>	 parameter_registers;
+	vector<Index>		 constants;
+	vector<Register>	 data_registers;
+	vector<Index>		 gradient_nodes;	// nodes the backwards pass writes a gradient for
+
+	vector<Register>	 backwards_registers;	// one per backwards node, seeded with its weight
+	vector<float>		 backwards_weights;
+	Register			 result_register = NULL_INDEX;
+
+	// Delay nodes hold the state of a recurrent graph, their registers are set from their
+	// inputs' registers between the points of a sequence
+	vector<Register>	 delay_registers;
+	vector<Register>	 delay_sources;		// NULL_INDEX if unconnected
+
+	// Instructions of a level don't depend on each other. Both have an extra end entry.
+	vector<unsigned>	 level_starts;		// into code
+	vector<unsigned>	 backwards_level_starts;	// into backwards_code
+
+	// Per level chunks, levels with no chunks run sequentially
+	vector<LevelChunk>	 forwards_chunks;
+	vector<unsigned>	 forwards_chunk_starts;
+	vector<LevelChunk>	 backwards_chunks;
+	vector<unsigned>	 backwards_chunk_starts;
+	// Per parallel backwards level, the registers its chunks wrote gradients for and the
+	// scratch slots to sum into each of them
+	vector<Register>	 reduce_targets;
+	vector<unsigned>	 reduce_target_starts;	// per level into reduce_targets
+	vector<unsigned>	 reduce_slot_starts;	// per target into reduce_slots
+	vector<unsigned>	 reduce_slots;
+
+	unsigned			 unplanned_registers = 0;	// before plan_memory, 0 if it hasn't run
+
+	// Set by plan_memory with checkpointing. The first level of every segment with an extra end
+	// entry, and the registers the segments share, empty if it's off.
+	vector<unsigned>	 checkpoint_levels;
+	Register			 local_registers_begin = 0;
+	Register			 local_registers_end = 0;
+
+	TaskPool*			 pool = nullptr;	// wide levels only run in parallel with a pool
+	TaskPriority		 priority = TaskPriority::Interactive;
+
+	vector<float>		 values;
+	vector<float>		 gradients;		// registers followed by the chunks' scratch slots
+	vector<float>		 tangents;		// forward mode derivatives, see forwards_tangents
+
+	void compile(const ComputationGraph& graph);
+
+	void load_parameters(const ComputationGraph& graph);
+
+	void forwards(const float* data_values);
+
+	void backwards();
+
+	bool has_loss() const { return !backwards_registers.empty(); }
+
+	// Weighted sum of the backwards nodes, after a forwards pass
+	float loss() const {
+		float sum = 0.f;
+		for (size_t i = 0; i < backwards_registers.size(); i++) {
+			sum += backwards_weights[i] * values[backwards_registers[i]];
+		}
+		return sum;
+	}
+
+	unsigned num_levels() const { return level_starts.empty() ? 0 : (unsigned)level_starts.size() - 1; }
+
+	// Instruction runs in a level, counting every call of a call group
+	unsigned level_work(unsigned level) const;
+
+	// The pieces forwards and backwards are made of, for running parts of the plan separately.
+	// backwards_levels goes from end_level - 1 down to first_level.
+	void load_data(const float* data_values);
+
+	void forwards_levels(unsigned first_level, unsigned end_level);
+
+	void clear_gradients();
+
+	void backwards_levels(unsigned first_level, unsigned end_level);
+
+	// Runs one data point forwards and backwards and adds the parameter gradients to gradient_acc
+	void accumulate_gradients(const float* data_values, vector<float>& gradient_acc);
+
+	void accumulate_gradients(const float* data_values, GradientSum& gradient_sum);
+
+	bool has_state() const { return !delay_registers.empty(); }
+
+	// Back to the start of a sequence, every delay outputs 0
+	void reset_state();
+
+	// Moves the delays on to the point after the last forwards pass
+	void advance_state();
+
+	// Truncated backpropagation through time over num_points consecutive points, which are
+	// run forwards from the current state and then backwards in reverse. Gradients don't go
+	// past the first point, the state is left where the last one takes it. Adds the parameter
+	// gradients to gradient_sum and returns the summed loss.
+	float accumulate_sequence_gradients(const float* data_values, unsigned num_points, GradientSum& gradient_sum);
+
+	// Steps the parameter registers against the accumulated gradients
+	void apply_gradients(const vector<float>& gradient_acc, float rate);
+
+	// Forward mode: the derivative of every register with respect to the seed register, in one
+	// pass in forward order. Needs the values from a forwards pass.
+	void forwards_tangents(Register seed);
+
+	// Renumbers the registers so activations whose last reader has run get reused by later
+	// levels. Parameters, constants, data, losses, results, call frames and whatever the
+	// backwards pass reads keep their own registers. Nodes whose register got shared lose
+	// it from node_register, so a planned plan can't be stored back into the graph. With
+	// forwards_only the backwards pass is dropped and only forward lifetimes count. With
+	// checkpoint the backwards pass recomputes activations segment by segment instead of
+	// keeping all of them, forwards_levels and backwards_levels can't be run on their own then.
+	void plan_memory(bool forwards_only = false, bool checkpoint = false);
+
+	unsigned num_registers() const { return (unsigned)values.size(); }
+
+	void store_values(ComputationGraph& graph) const;
+
+	void store_tangents(ComputationGraph& graph) const;
+
+	void store_gradients(ComputationGraph& graph) const;
+
+private:
+	// accumulate_sequence_gradients' buffers, kept between calls
+	vector<float>		 step_values;		// values after each point of the window
+	vector<float>		 step_state;
+	vector<float>		 delay_gradients;
+	// batched plugin kernels' arguments
+	vector<float>		 plugin_inputs;
+	vector<float>		 plugin_outputs;
+	vector<float>		 plugin_gradients;
+	vector<float>		 plugin_input_gradients;
+	// expression runs' slots, a row per slot
+	vector<float>		 expression_slots;
+	vector<float>		 expression_slot_gradients;
+	vector<float>		 expression_gradients;
+
+	float read(Register r) const {
+		return r == NULL_INDEX ? 0.f : values[r];
+	}
+
+	unsigned num_operands(const Instruction& instruction) const {
+		return instruction.op == Operation::Expression ? expressions[instruction.in[1]].num_inputs() : instruction.in[1];
+	}
+
+	Register resolve(const Call& call, Register operand) const {
+		if (operand == NULL_INDEX)
+			return NULL_INDEX;
+		if (operand & PORT_FLAG)
+			return call_ports[call.first_port + (operand & ~PORT_FLAG)];
+		return call.frame + operand;
+	}
+
+	void build_parallel_levels();
+
+	void forwards_instruction(const Instruction& instruction);
+
+	void forwards_calls(const CallGroup& group, unsigned first_call, unsigned num_calls);
+
+	void forwards_chunk(const LevelChunk& chunk);
+
+	void tangents_instruction(const Instruction& instruction);
+
+	// Softmax cross entropy, operands are the label then the logits
+	float forwards_variadic(const Instruction& instruction) const;
+
+	void backwards_variadic(const Instruction& instruction);
+
+	float tangents_variadic(const Instruction& instruction) const;
+
+	float forwards_expression(const Instruction& instruction) const;
+
+	void backwards_expression(const Instruction& instruction);
+
+	float tangents_expression(const Instruction& instruction) const;
+
+	// Like the plugin runs, for instructions with the same program
+	unsigned forwards_expression_run(unsigned begin, unsigned end);
+
+	unsigned backwards_expression_run(unsigned first, unsigned last);
+
+	float forwards_plugin(const Instruction& instruction) const;
+
+	void backwards_plugin(const Instruction& instruction);
+
+	float tangents_plugin(const Instruction& instruction) const;
+
+	// Runs the plugin instructions of a level from code[begin] that have the same op, in one
+	// call when the op has a batched kernel. Returns where the run ends.
+	unsigned forwards_plugin_run(unsigned begin, unsigned end);
+
+	// Same going backwards, from backwards_code[last] down to first at most. Returns where the
+	// run starts.
+	unsigned backwards_plugin_run(unsigned first, unsigned last);
+
+	void tangents_calls(const CallGroup& group, unsigned first_call, unsigned num_calls);
+
+	void tangents_chunk(const LevelChunk& chunk);
+
+	// The derivative of out from the tangents of a and b, the partials come from the backward kernel
+	float tangent_operation(Operation op, Register out, Register a, Register b) const {
+		float partial_a = 0.f;
+		float partial_b = 0.f;
+		backward_operation(op, read(a), read(b), values[out], 1.f, partial_a, partial_b);
+		// inputs that don't depend on the seed contribute nothing, even where their partial is infinite
+		float tangent = 0.f;
+		if (a != NULL_INDEX && tangents[a] != 0.f)
+			tangent += partial_a * tangents[a];
+		if (b != NULL_INDEX && tangents[b] != 0.f)
+			tangent += partial_b * tangents[b];
+		return tangent;
+	}
+
+	// The backwards pass after the gradients are seeded, segment by segment with checkpointing
+	void run_backwards();
+
+	void backwards_call_group(const CallGroup& group);
+
+	void backwards_chunk(const LevelChunk& chunk);
+
+	void reduce_gradients(unsigned first_target, unsigned end_target);
+
+	// Gradients for a and b get added to gradient_a and gradient_b, normally a and b themselves
+	void backwards_instruction(Operation op, Register out, Register a, Register b, Register gradient_a, Register gradient_b);
+
+	void backwards_instruction(Operation op, Register out, Register a, Register b) {
+		backwards_instruction(op, out, a, b, a, b);
+	}
+};
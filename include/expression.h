@@ -0,0 +1,59 @@
+#pragma once
+
+#include "value.h"
+
+#include <string>
+
+// Slots an expression can use, inputs and constants included. Plans evaluate expressions
+// in arrays this big on the stack.
+#define MAX_EXPRESSION_SLOTS 128
+
+#define NULL_SLOT 0xffff
+
+// One operation of a compiled expression, writing the slot after the ones before it.
+// Unary operations have b NULL_SLOT.
+struct ExpressionStep {
+	Operation	   op;
+	unsigned short a;
+	unsigned short b;
+};
+
+// A formula over named inputs like tanh(a*x + b), compiled to straight line code over the
+// same kernels as the nodes. Slots are the inputs in order of first appearance, then the
+// constants, then a slot per step. Input k is the node's input k.
+//
+// It has + - * / ^, unary minus, parentheses, numbers, and the functions tanh, relu, sin,
+// cos, sqrt, log, step and exp.
+class Expression {
+public:
+	std::string			   m_formula;
+	std::string			   m_error;		// empty if it compiled
+	vector<std::string>	   m_inputs;
+	vector<float>		   m_constants;
+	vector<ExpressionStep> m_code;
+	unsigned short		   m_result{ NULL_SLOT };	// NULL_SLOT when it didn't compile
+
+	bool compile(const char* formula);
+
+	unsigned num_inputs() const { return (unsigned)m_inputs.size(); }
+
+	unsigned num_slots() const { return num_inputs() + (unsigned)m_constants.size() + (unsigned)m_code.size(); }
+
+	// slots needs num_slots() entries
+	float forwards(const float* inputs, float* slots) const;
+
+	// Adds the gradient of every input to input_gradients. Runs the forwards pass again into
+	// slots first, slot_gradients is cleared.
+	void backwards(const float* inputs, float gradient, float* input_gradients, float* slots, float* slot_gradients) const;
+
+	// count evaluations at once, one step at a time across all of them. Row k of slots is
+	// slot k of every evaluation, the inputs' rows have to be filled in.
+	void forwards_batch(float* slots, unsigned count) const;
+
+	// Leaves each input's gradient in its row of slot_gradients, gradients has count entries
+	void backwards_batch(const float* gradients, float* slots, float* slot_gradients, unsigned count) const;
+
+	// Compiled once per formula and kept, only for the main thread. The reference is good
+	// until the next call.
+	static const Expression& cached(const char* formula);
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+// Multi producer, single consumer queue. Producers push with a single compare and swap,
+// the consumer takes everything pushed so far in one exchange and gets it back in push order.
+template <typename T>
+class MpscQueue {
+public:
+	MpscQueue() = default;
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+
+	~MpscQueue() {
+		drain([](T&) {});
+	}
+
+	void push(T value) {
+		Node* node = new Node{ std::move(value), m_head.load(std::memory_order_relaxed) };
+		while (!m_head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {
+		}
+	}
+
+	bool empty() const {
+		return m_head.load(std::memory_order_relaxed) == nullptr;
+	}
+
+	// Only ever called from the consumer thread
+	template <typename F>
+	void drain(F&& consume) {
+		Node* node = m_head.exchange(nullptr, std::memory_order_acquire);
+
+		// the list is newest first
+		Node* reversed = nullptr;
+		while (node) {
+			Node* next = node->next;
+			node->next = reversed;
+			reversed = node;
+			node = next;
+		}
+
+		while (reversed) {
+			Node* next = reversed->next;
+			consume(reversed->value);
+			delete reversed;
+			reversed = next;
+		}
+	}
+
+private:
+	struct Node {
+		T	  value;
+		Node* next;
+	};
+
+	std::atomic<Node*> m_head{ nullptr };
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "execution_plan.h"
+
+#include <functional>
+#include <vector>
+
+enum class OptimizerType {
+	SGD,
+	Momentum,
+	RMSProp,
+	Adam,
+	Count,
+};
+
+const char* optimizer_name(OptimizerType type);
+
+enum class Precision {
+	Float,
+	Compensated,	// float with Kahan summation
+	Double,
+	Count,
+};
+
+const char* precision_name(Precision precision);
+
+// Sums the parameter gradients of a batch's points. Once a float sum has grown the small
+// contributions lose their low bits, Compensated carries each addition's rounding error
+// over in a second float and Double keeps the whole sum in double.
+class GradientSum {
+public:
+	Precision m_precision = Precision::Float;
+
+	void reset(size_t num_parameters);
+
+	void clear();
+
+	// The plan's parameter gradients, after a backwards pass
+	void add(const ExecutionPlan& plan);
+
+	// The sums rounded to float, for the optimizers
+	const vector<float>& result();
+
+private:
+	vector<float>  m_sum;
+	vector<float>  m_compensation;
+	vector<double> m_wide;
+};
+
+// Turns accumulated gradients into parameter updates. Its state (velocities, moments) is kept
+// in flat arrays indexed like plan.parameters, next to the gradient accumulator, and each
+// step is a single pass over all of them.
+class Optimizer {
+public:
+	OptimizerType m_type = OptimizerType::SGD;
+	float		  m_momentum{ 0.9f };	// Momentum, Adam's first moment decay
+	float		  m_decay{ 0.999f };	// RMSProp and Adam's second moment decay
+	float		  m_epsilon{ 1e-8f };
+
+	// Clears the state for a plan with this many parameters
+	void reset(size_t num_parameters);
+
+	// Keeps the state of parameters that are in both plans, new ones start from zero
+	void remap(const vector<Index>& old_parameters, const vector<Index>& new_parameters);
+
+	// gradient_acc is summed over the batch, gradient_scale turns it into the batch's average
+	void step(ExecutionPlan& plan, const vector<float>& gradient_acc, float gradient_scale, float learning_rate);
+
+private:
+	vector<float> m_first_moment;
+	vector<float> m_second_moment;
+	unsigned	  m_steps{ 0 };		// for Adam's bias correction
+};
+
+// Full batch quasi-Newton. Keeps the last few parameter and gradient differences to
+// approximate the inverse Hessian and searches along the direction it gives with
+// backtracking, so it needs the exact loss and gradient over the whole data set.
+class LbfgsOptimizer {
+public:
+	// Sets gradient to the gradient of the loss at parameters and returns the loss
+	typedef std::function<float(const vector<float>& parameters, vector<float>& gradient)> Evaluate;
+
+	unsigned m_history_size{ 8 };
+
+	// Forgets the history, after the plan, parameters or data changed under it
+	void reset();
+
+	// One iteration, parameters are moved to the accepted point. Returns the loss there.
+	float step(vector<float>& parameters, const Evaluate& evaluate);
+
+private:
+	vector<vector<float>> m_s;		// parameter differences, oldest first
+	vector<vector<float>> m_y;		// gradient differences
+	vector<float>		  m_rho;
+	vector<float>		  m_alpha;
+	vector<float>		  m_gradient;
+	vector<float>		  m_direction;
+	vector<float>		  m_trial;
+	vector<float>		  m_trial_gradient;
+	float				  m_loss{ 0.f };
+	bool				  m_evaluated{ false };
+};
+
+// Separable CMA-ES. Candidates are drawn from a normal distribution around the mean with a
+// diagonal covariance, and only their losses are needed. The distribution moves towards the
+// better half of each generation. The noise for candidate k comes from counter based random
+// numbers, so any thread can make any candidate without sharing generator state.
+class EvolutionStrategy {
+public:
+	float	 m_initial_step_size{ 0.1f };
+	uint64_t m_seed{ 0 };
+
+	// Starts a new search around mean
+	void reset(const vector<float>& mean);
+
+	// Forget the search, it'll restart from wherever the parameters are
+	void clear() { m_mean.clear(); }
+
+	size_t size() const { return m_mean.size(); }
+
+	unsigned population_size() const { return m_population_size; }
+
+	// Parameter p of candidate k of the current generation
+	float candidate_parameter(unsigned k, size_t p) const {
+		return m_mean[p] + m_step_size * m_deviation[p] * noise(k, p);
+	}
+
+	// Moves the distribution towards the candidates with the lowest losses and starts the next generation
+	void update(const vector<float>& losses);
+
+	const vector<float>& mean() const { return m_mean; }
+
+private:
+	float noise(unsigned k, size_t p) const;
+
+	unsigned	  m_population_size{ 0 };
+	unsigned	  m_parents{ 0 };
+	vector<float> m_weights;
+	float		  m_mu_eff{ 0.f };
+	float		  m_c_sigma{ 0.f };
+	float		  m_d_sigma{ 0.f };
+	float		  m_c_c{ 0.f };
+	float		  m_c_1{ 0.f };
+	float		  m_c_mu{ 0.f };
+	float		  m_expected_norm{ 0.f };	// of a standard normal vector
+
+	vector<float> m_mean;
+	float		  m_step_size{ 0.f };
+	vector<float> m_variance;		// diagonal of the covariance
+	vector<float> m_deviation;		// its square root
+	vector<float> m_path_sigma;
+	vector<float> m_path_c;
+	uint64_t	  m_generation{ 0 };
+	vector<unsigned> m_order;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+// The interface op plugins are built against. A plugin is a shared library exporting
+// mlgarden_register_ops, which is called once when the library is loaded and registers
+// the plugin's ops through the callback it's handed. It's plain C so plugins don't have
+// to be built with the same compiler as the garden.
+
+#define MLGARDEN_PLUGIN_API_VERSION 1
+#define MLGARDEN_REGISTER_OPS_SYMBOL "mlgarden_register_ops"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// inputs has num_inputs entries, unconnected inputs are 0
+typedef float (*MlgardenForward)(const float* inputs, void* user_data);
+
+// Writes the gradient of every input, given the output and its gradient
+typedef void (*MlgardenBackward)(const float* inputs, float out, float gradient, float* input_gradients, void* user_data);
+
+// Every node of the op on a level at once, inputs and input_gradients are count rows of num_inputs
+typedef void (*MlgardenForwardBatch)(const float* inputs, float* outs, unsigned count, void* user_data);
+
+typedef void (*MlgardenBackwardBatch)(const float* inputs, const float* outs, const float* gradients,
+	float* input_gradients, unsigned count, void* user_data);
+
+typedef struct MlgardenOp {
+	const char*			  name;				// shown in the node menu, and how graphs refer to the op
+	unsigned			  num_inputs;
+	MlgardenForward		  forward;
+	MlgardenBackward	  backward;			// optional, without it no gradient goes through the op
+	MlgardenForwardBatch  forward_batch;	// optional
+	MlgardenBackwardBatch backward_batch;	// optional
+	void*				  user_data;
+} MlgardenOp;
+
+// The op is copied, name included
+typedef void (*MlgardenRegisterOp)(void* registry, const MlgardenOp* op);
+
+// What a plugin exports, returns 0 if it can't work with api_version
+typedef int (*MlgardenRegisterOps)(unsigned api_version, MlgardenRegisterOp register_op, void* registry);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "plugin_api.h"
+#include "value.h"
+
+#include <string>
+
+// An op registered by a plugin. Ops a graph refers to but no loaded plugin has are kept
+// as placeholders without kernels, so the graph still loads and saves, they output 0.
+struct PluginOp {
+	std::string			  name;
+	unsigned			  num_inputs{ 0 };
+	MlgardenForward		  forward{ nullptr };
+	MlgardenBackward	  backward{ nullptr };
+	MlgardenForwardBatch  forward_batch{ nullptr };
+	MlgardenBackwardBatch backward_batch{ nullptr };
+	void*				  user_data{ nullptr };
+};
+
+// Every plugin op there is, op n being Operation::Plugin + n. Only the main thread touches
+// it, plans take a copy of the ops when they're compiled.
+class PluginRegistry {
+public:
+	static PluginRegistry& shared();
+
+	// Loads every shared library in directory, returns how many loaded
+	int load_directory(const char* directory);
+
+	bool load_library(const char* path);
+
+	// NULL_INDEX if there's no op with that name
+	unsigned find(const std::string& name) const;
+
+	// Adds a placeholder if it's not there
+	unsigned find_or_add(const std::string& name);
+
+	const vector<PluginOp>& ops() const { return m_ops; }
+
+	const PluginOp& op(Operation operation) const { return m_ops[plugin_index(operation)]; }
+
+	// Ops that have kernels, for the node menu
+	bool is_loaded(unsigned index) const { return m_ops[index].forward != nullptr; }
+
+	// The callback libraries get handed, registry is the PluginRegistry. Ops built into the
+	// executable can be registered through it directly.
+	static void register_op(void* registry, const MlgardenOp* op);
+
+private:
+
+	vector<PluginOp> m_ops;
+	vector<void*>	 m_libraries;	// never unloaded, graphs can hold the ops' kernels
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Workers look for work in this order, so interactive work gets picked up ahead of
+// whatever training has queued up.
+enum class TaskPriority {
+	Interactive,	// the editor is waiting on it this frame
+	Normal,			// loading, saving
+	Background,		// training
+	Count,
+};
+
+class TaskState;
+
+// A submitted task, for waiting on it or making other tasks depend on it
+typedef std::shared_ptr<TaskState> TaskHandle;
+
+// Worker threads with a deque per priority each. Work handed to the pool is spread over the
+// deques, a worker takes from the back of its own and steals from the front of the others
+// once it runs dry. Threads waiting on a parallel_for or a task run tasks too instead of
+// blocking, as long as they're no less urgent than what's being waited on. Tasks can depend
+// on other tasks, and can be put on the main thread, which runs them from
+// run_main_thread_tasks.
+class TaskPool {
+public:
+	explicit TaskPool(unsigned num_workers);
+	~TaskPool();
+
+	// One worker per hardware thread, not counting the main thread. Everything shares this one
+	// so subsystems going parallel at the same time don't oversubscribe the cores.
+	static TaskPool& shared();
+
+	unsigned num_workers() const { return (unsigned)m_workers.size(); }
+
+	// For threads running next to the pool on cores of their own, like the trainer's. As many
+	// workers sleep until they're released, the first one always stays up.
+	void reserve_threads(unsigned count);
+	void release_threads(unsigned count);
+
+	// Runs task(i) for every i in [0, count) and returns once they've all finished
+	void parallel_for(unsigned count, const std::function<void(unsigned)>& task, TaskPriority priority = TaskPriority::Interactive);
+
+	// Runs work once all of dependencies are done
+	TaskHandle submit(std::function<void()> work, TaskPriority priority, const std::vector<TaskHandle>& dependencies = {});
+
+	// Same, but on the main thread, for anything touching the graph, bgfx or ImGui
+	TaskHandle submit_main_thread(std::function<void()> work, const std::vector<TaskHandle>& dependencies = {});
+
+	// Runs work after task, on a worker
+	TaskHandle then(const TaskHandle& task, std::function<void()> work, TaskPriority priority);
+
+	bool is_done(const TaskHandle& task) const;
+
+	// Helps out with work at the task's priority or higher until it's done. Not for main thread tasks.
+	void wait(const TaskHandle& task);
+
+	// Called once a frame by the main thread
+	void run_main_thread_tasks();
+
+private:
+	struct Task {
+		const std::function<void(unsigned)>* function{ nullptr };	// parallel_for items
+		unsigned							 index{ 0 };
+		std::atomic<unsigned>*				 remaining{ nullptr };
+		TaskHandle							 state;					// submitted tasks
+	};
+
+	struct Queue {
+		std::mutex		 mutex;
+		std::deque<Task> tasks[(int)TaskPriority::Count];
+	};
+
+	TaskHandle add_task(std::function<void()> work, TaskPriority priority, bool main_thread, const std::vector<TaskHandle>& dependencies);
+
+	void push(unsigned queue, TaskPriority priority, Task task);
+
+	bool pop(unsigned queue, Task& task);
+
+	// Takes tasks of priority lowest or more urgent
+	bool steal(unsigned thief, Task& task, TaskPriority lowest = TaskPriority::Background);
+
+	bool find_task(unsigned queue, Task& task);
+
+	void run(Task& task);
+
+	// Queues a submitted task whose dependencies are all done
+	void schedule(const TaskHandle& state);
+
+	void run_worker(unsigned worker);
+
+	bool is_awake(unsigned worker) const;
+
+	void wake_workers(bool all);
+
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::thread>			m_workers;
+	std::atomic<unsigned>				m_next_queue{ 0 };
+	std::atomic<unsigned>				m_queued{ 0 };
+	std::atomic<bool>					m_stop{ false };
+	std::mutex							m_sleep_mutex;
+	std::condition_variable				m_wake;
+	std::atomic<unsigned>				m_reserved_threads{ 0 };	// changed under m_sleep_mutex
+
+	std::mutex							m_main_thread_mutex;
+	std::vector<TaskHandle>				m_main_thread_tasks;
+
+	friend class TaskState;
+};
+
+class TaskState {
+public:
+	std::function<void()>	m_work;
+	TaskPriority			m_priority{ TaskPriority::Normal };
+	bool					m_main_thread{ false };
+	std::atomic<unsigned>	m_unfinished_dependencies{ 1 };	// the extra one is released once submitted
+	std::atomic<bool>		m_done{ false };
+	std::mutex				m_mutex;
+	std::vector<TaskHandle> m_dependents;
+};
@@ -0,0 +1,240 @@
+#pragma once
+
+#include "computation_graph.h"
+#include "mpsc_queue.h"
+#include "optimizer.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+
+// What the training thread publishes for the editor to display.
+struct TrainingSnapshot {
+	vector<float> m_parameters;		// indexed like plan.parameters
+	unsigned	  m_num_parameters{ 0 };
+	unsigned	  m_plan_version{ 0 };	// the plan m_parameters lines up with
+	float		  m_average_error{ 0.f };
+	int			  m_steps{ 0 };
+};
+
+enum class TrainerCommandType {
+	SetPlan,
+	SetParameters,
+	SetData,
+};
+
+enum class TrainingMode {
+	Synchronous,	// one thread, averaged mini batches
+	Hogwild,		// several threads updating shared parameters without locks, one point at a time
+	Deterministic,	// several threads, same parameters bit for bit whatever the number of threads
+	Pipeline,		// the plan's levels split into stages, one thread each, points streamed through them
+	LBFGS,			// full batch quasi-Newton, the whole data set's gradient summed like the deterministic mode
+	Evolution,		// CMA-ES, a population of parameter vectors tried with forward passes only
+};
+
+// Points per leaf of the deterministic mode's reduction tree. Leaves are the unit of work
+// handed to threads, so their size can't depend on how many threads there are.
+#define DETERMINISTIC_LEAF_SIZE 8
+
+// A point going forwards or backwards through one pipeline stage's levels
+struct PipelineStep {
+	unsigned m_point;
+	bool	 m_backwards;
+};
+
+// The order a stage runs a batch's points in. The stages after it need num_stages - stage - 1
+// points in flight before their first backwards, so it runs that many forwards first, then
+// one forwards one backwards (1F1B) and whatever's left backwards at the end.
+void pipeline_schedule(unsigned stage, unsigned num_stages, unsigned num_points, vector<PipelineStep>& steps);
+
+// Splits the plan's levels into num_stages runs with about the same amount of work each,
+// stage s gets levels [stage_levels[s], stage_levels[s + 1])
+void split_pipeline_stages(const ExecutionPlan& plan, unsigned num_stages, vector<unsigned>& stage_levels);
+
+// Edits made in the editor while training runs, picked up by the trainer between batches.
+struct TrainerCommand {
+	TrainerCommandType m_type = TrainerCommandType::SetPlan;
+	ExecutionPlan	   m_plan;			// SetPlan, compiled and loaded by the editor
+	unsigned		   m_plan_version{ 0 };
+	vector<Index>	   m_nodes;			// SetParameters
+	vector<float>	   m_values;
+	vector<DataPoint>  m_data;			// SetData
+};
+
+// A snapshot slot as the training thread writes it. Every field is atomic so the editor can
+// copy it while it's being rewritten, the slot's sequence counter tells it to throw that away.
+struct PublishedSnapshot {
+	std::unique_ptr<std::atomic<float>[]> m_parameters;
+	std::atomic<unsigned> m_num_parameters{ 0 };
+	std::atomic<unsigned> m_plan_version{ 0 };
+	std::atomic<float>	  m_average_error{ 0.f };
+	std::atomic<int>	  m_steps{ 0 };
+};
+
+// Trains a copy of a graph's execution plan on a worker thread, so training isn't tied to
+// the frame rate. After every batch the parameters are published into one of two snapshot
+// slots, each guarded by a sequence counter, the editor copies out the latest one.
+// Edits go the other way through a lock free queue that's drained between batches.
+class Trainer {
+public:
+	std::atomic<float> m_learning_rate{ 0.01f };
+	std::atomic<int>   m_batch_size{ 50 };
+	std::atomic<int>   m_sequence_window{ 16 };	// points backpropagated through at once in recurrent graphs
+	// Fraction of the time the thread spends training, it sleeps off the rest after each batch
+	std::atomic<float> m_duty_cycle{ 1.f };
+
+	// Only read when training starts
+	TrainingMode	   m_mode = TrainingMode::Synchronous;
+	OptimizerType	   m_optimizer_type = OptimizerType::SGD;	// hogwild always steps with plain SGD
+	Precision		   m_precision = Precision::Float;	// of the batch gradient sums, synchronous and pipeline
+	int				   m_num_workers = 4;
+	uint64_t		   m_seed = 0;		// which points the deterministic mode samples
+	bool			   m_checkpointing = false;	// recompute activations in the backwards pass, not in pipeline mode
+
+	// Register counts of the last plan handed to the thread, before and after memory planning
+	unsigned		   m_unplanned_registers = 0;
+	unsigned		   m_planned_registers = 0;
+
+	~Trainer();
+
+	// Stops any previous run and starts training from the graph's current plan and parameters
+	void start(ComputationGraph& graph, int steps, float average_error);
+
+	void stop();
+
+	// Swaps in the graph's recompiled plan, parameters the old plan also had keep their trained
+	// values. Returns false if the trainer has to be restarted for it instead.
+	bool submit_plan(ComputationGraph& graph);
+
+	void submit_parameters(const vector<Index>& nodes, const vector<float>& values);
+
+	void submit_data(const vector<DataPoint>& data);
+
+	bool is_running() const { return m_running.load(std::memory_order_relaxed); }
+
+	// Copies out the latest snapshot, false if nothing has been published yet
+	bool read_snapshot(TrainingSnapshot& snapshot) const;
+
+private:
+	void run();
+
+	void publish();
+
+	void apply_command(TrainerCommand& command);
+
+	void synchronous_batch(int batch_size, float learning_rate);
+
+	// Graphs with delays go through the data in order, a window at a time with truncated
+	// backpropagation through time, whatever the mode. Returns the mean loss.
+	float sequence_batch(int batch_size, float learning_rate);
+
+	// Each worker runs batch_size points, the threads sync up between rounds so commands
+	// and snapshots see settled parameters
+	void hogwild_round(int batch_size, float learning_rate);
+
+	void hogwild_points(ExecutionPlan& plan, std::minstd_rand& random, int batch_size, float learning_rate);
+
+	// Points are picked by counter based random numbers and summed per leaf, the leaves are
+	// then summed in a fixed tree so the additions happen in the same order on any number of threads
+	void deterministic_batch(int batch_size, float learning_rate);
+
+	void deterministic_leaves(unsigned worker, ExecutionPlan& plan);
+
+	// Runs num_samples points over the workers, leaving the summed gradient in m_leaf_gradients[0].
+	// False if the trainer got stopped first.
+	bool sum_leaves(int num_samples);
+
+	// Moves the parameters to the next L-BFGS iterate, returns the mean loss over the data there
+	float lbfgs_iteration();
+
+	// Every candidate of the population runs the same batch_size points, spread over the
+	// workers. Returns the mean loss of the best one.
+	float evolution_generation(int batch_size);
+
+	void evolution_candidates(unsigned worker, ExecutionPlan& plan);
+
+	// Each stage runs its levels for every point of the batch, one forwards one backwards
+	// once the pipeline's full (1F1B), so at most one point per stage is in flight
+	void pipeline_batch(int batch_size, float learning_rate);
+
+	void pipeline_stage(unsigned stage);
+
+	int next_point();
+
+	// Copies the trainer's plan over to the helpers if it changed, the helpers have to be parked
+	void sync_helper_plans();
+
+	// Runs one round of work on every worker, the trainer's own thread being worker 0. False
+	// without running anything once the trainer's been stopped, the helpers might be gone.
+	bool run_round();
+
+	void round_work(unsigned worker, ExecutionPlan& plan, std::minstd_rand& random);
+
+	void run_helper(unsigned helper);
+
+	ExecutionPlan	  m_plan;
+	unsigned		  m_plan_version{ 0 };	// only touched by the thread once it's running
+	vector<DataPoint> m_data;
+	vector<int>		  m_shuffled_points;
+	int				  m_current_point{ 0 };
+	int				  m_sequence_point{ 0 };	// where the delays' state is up to
+	GradientSum		  m_gradient_sum;
+	Optimizer		  m_optimizer;
+	LbfgsOptimizer	  m_lbfgs;
+	vector<float>	  m_lbfgs_parameters;
+	EvolutionStrategy m_evolution;
+	vector<float>	  m_candidate_losses;
+	float			  m_average_error{ 0.f };
+	int				  m_steps{ 0 };
+
+	MpscQueue<TrainerCommand> m_commands;
+	// The thread sleeps on this while it has no data, commands and stop wake it
+	std::mutex				  m_wake_mutex;
+	std::condition_variable	  m_wake;
+
+	void push_command(TrainerCommand command);
+
+	// Slots are allocated once per start so publishing never reallocates under a reader
+	unsigned			  m_snapshot_capacity{ 0 };
+	PublishedSnapshot	  m_snapshots[2];
+	std::atomic<unsigned> m_sequence[2];	// odd while the slot is being written
+	std::atomic<unsigned> m_latest{ 0 };
+
+	struct Helper {
+		ExecutionPlan	 m_plan;
+		std::minstd_rand m_random;
+		std::thread		 m_thread;
+	};
+
+	// Parameters shared by the hogwild workers, indexed like plan.parameters. Updates are
+	// relaxed loads and stores, colliding updates just lose one of them.
+	std::unique_ptr<std::atomic<float>[]> m_shared_parameters;
+	vector<Helper>		  m_helpers;
+	std::minstd_rand	  m_random;
+	bool				  m_helper_plans_dirty{ false };
+	int					  m_round_batch_size{ 0 };	// written before the round is bumped
+	float				  m_round_learning_rate{ 0.f };
+	uint64_t			  m_sample_counter{ 0 };
+	vector<vector<float>> m_leaf_gradients;
+	vector<float>		  m_leaf_errors;
+	// A plan per point in flight, stage s runs levels [m_stage_levels[s], m_stage_levels[s + 1])
+	vector<ExecutionPlan> m_pipeline_slots;
+	vector<unsigned>	  m_stage_levels;
+	std::unique_ptr<std::atomic<unsigned>[]> m_forwarded;	// per stage, points it has run forwards
+	std::unique_ptr<std::atomic<unsigned>[]> m_backwarded;
+	vector<int>			  m_pipeline_points;
+	vector<vector<PipelineStep>> m_pipeline_schedules;	// per stage, kept so batches don't allocate
+	std::atomic<unsigned> m_round{ 0 };
+	std::atomic<unsigned> m_finished{ 0 };
+	// Helpers sleep on this between rounds, so they give the cores back while the trainer does
+	std::mutex			  m_round_mutex;
+	std::condition_variable m_round_wake;
+
+	std::thread		  m_thread;
+	std::atomic<bool> m_running{ false };
+	unsigned		  m_reserved_threads{ 0 };	// the shared pool's cores the threads take while running
+};
@@ -6,6 +6,8 @@
 #include <vector>
 #include <unordered_set>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 #include "clip.h"
 #include "json.hpp"
 
@@ -36,10 +38,256 @@ enum class Operation {
 	Result,
 	Backwards,
 	DataSource,
+	Log,
+	Step,		// 1 for positive inputs, 0 otherwise
+	MeanSquaredError,		// (prediction - target)^2
+	Hinge,					// max(0, 1 - y * score), y is +1 for labels over 0.5 and -1 otherwise
+	Logistic,				// binary cross entropy on a logit
+	SoftmaxCrossEntropy,	// label then any number of logits
+	Delay,					// its input's value at the previous point of a sequence, 0 at the start
+	Expression,				// a formula over its inputs, kept in m_name
+	Plugin,					// and everything after it, Plugin + n is the plugin registry's op n
 };
 
 typedef unsigned Index;
 
+inline bool is_plugin_operation(Operation operation) {
+	return (int)operation >= (int)Operation::Plugin;
+}
+
+inline unsigned plugin_index(Operation operation) {
+	return (unsigned)((int)operation - (int)Operation::Plugin);
+}
+
+inline Operation plugin_operation(unsigned index) {
+	return (Operation)((int)Operation::Plugin + (int)index);
+}
+
+// Operations that compute their value from their inputs, as opposed to sources
+// (parameters, constants, data) and the structural function nodes.
+inline bool is_computed_operation(Operation operation) {
+	if (is_plugin_operation(operation))
+		return true;
+	switch (operation) {
+	case Operation::Add:
+	case Operation::Subtract:
+	case Operation::Multiply:
+	case Operation::Divide:
+	case Operation::Power:
+	case Operation::Tanh:
+	case Operation::ReLU:
+	case Operation::Sin:
+	case Operation::Cos:
+	case Operation::Sqrt:
+	case Operation::Log:
+	case Operation::Step:
+	case Operation::MeanSquaredError:
+	case Operation::Hinge:
+	case Operation::Logistic:
+	case Operation::SoftmaxCrossEntropy:
+	case Operation::Expression:
+	case Operation::Display:
+	case Operation::Result:
+	case Operation::Backwards:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Operations reading any number of inputs, compiled to an operand list instead of in[0] and in[1].
+inline bool is_variadic_operation(Operation operation) {
+	return operation == Operation::SoftmaxCrossEntropy || operation == Operation::Expression || is_plugin_operation(operation);
+}
+
+// Number of inputs the kernels below read for a computed operation, 0 for variadic ones.
+inline int num_operation_inputs(Operation operation) {
+	switch (operation) {
+	case Operation::Add:
+	case Operation::Subtract:
+	case Operation::Multiply:
+	case Operation::Divide:
+	case Operation::Power:
+	case Operation::MeanSquaredError:
+	case Operation::Hinge:
+	case Operation::Logistic:
+		return 2;
+	case Operation::Tanh:
+	case Operation::ReLU:
+	case Operation::Sin:
+	case Operation::Cos:
+	case Operation::Sqrt:
+	case Operation::Log:
+	case Operation::Step:
+	case Operation::Display:
+	case Operation::Result:
+	case Operation::Backwards:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// Forward kernel shared by Value and ExecutionPlan, unconnected inputs are passed as 0.
+inline float forward_operation(Operation operation, float a, float b) {
+	switch (operation) {
+	case Operation::Add:
+		return a + b;
+	case Operation::Subtract:
+		return a - b;
+	case Operation::Multiply:
+		return a * b;
+	case Operation::Divide:
+		return a / b;
+	case Operation::Power:
+		return std::pow(a, b);
+	case Operation::Tanh:
+		return std::tanh(a);
+	case Operation::ReLU:
+		return a > 0.f ? a : a * 0.1f;
+	case Operation::Sin:
+		return std::sin(a);
+	case Operation::Cos:
+		return std::cos(a);
+	case Operation::Sqrt:
+		return std::sqrt(a);
+	case Operation::Log:
+		return std::log(a);
+	case Operation::Step:
+		return a > 0.f ? 1.f : 0.f;
+	case Operation::MeanSquaredError:
+		return (a - b) * (a - b);
+	case Operation::Hinge:
+		return std::max(0.f, 1.f - (b > 0.5f ? a : -a));
+	case Operation::Logistic:
+		// log(1 + exp(a)) - a * b without overflowing for large |a|
+		return std::max(a, 0.f) - a * b + std::log1p(std::exp(-std::fabs(a)));
+	case Operation::Display:
+	case Operation::Result:
+	case Operation::Backwards:
+		return a;
+	default:
+		return 0.f;
+	}
+}
+
+// Backward kernel, takes the inputs, the forward output and the output's gradient and
+// writes the gradient contribution for each input.
+inline void backward_operation(Operation operation, float a, float b, float out, float gradient,
+	float& gradient_a, float& gradient_b) {
+	gradient_a = 0.f;
+	gradient_b = 0.f;
+	switch (operation) {
+	case Operation::Add:
+		gradient_a = gradient;
+		gradient_b = gradient;
+		break;
+	case Operation::Subtract:
+		gradient_a = gradient;
+		gradient_b = -gradient;
+		break;
+	case Operation::Multiply:
+		gradient_a = gradient * b;
+		gradient_b = gradient * a;
+		break;
+	case Operation::Divide:
+		if (b != 0.f) {
+			gradient_a = gradient / b;
+			gradient_b = -gradient * a / (b * b);
+		}
+		break;
+	case Operation::Power:
+		gradient_a = gradient * b * std::pow(a, b - 1.f);
+		gradient_b = gradient * std::pow(a, b) * std::log(a);
+		break;
+	case Operation::Tanh:
+		gradient_a = gradient * (1.0f - out * out);
+		break;
+	case Operation::ReLU:
+		gradient_a = gradient * (out > 0.f ? 1.0f : 0.1f);
+		break;
+	case Operation::Sin:
+		gradient_a = gradient * std::cos(a);
+		break;
+	case Operation::Cos:
+		gradient_a = -gradient * std::sin(a);
+		break;
+	case Operation::Sqrt:
+		gradient_a = gradient * (0.5f / out);
+		break;
+	case Operation::Log:
+		gradient_a = gradient / a;
+		break;
+	case Operation::MeanSquaredError:
+		gradient_a = gradient * 2.f * (a - b);
+		gradient_b = -gradient_a;
+		break;
+	case Operation::Hinge:
+		if (out > 0.f)
+			gradient_a = b > 0.5f ? -gradient : gradient;
+		break;
+	case Operation::Logistic:
+	{
+		float sigmoid = a >= 0.f ? 1.f / (1.f + std::exp(-a)) : std::exp(a) / (1.f + std::exp(a));
+		gradient_a = gradient * (sigmoid - b);
+		gradient_b = -gradient * a;
+	}
+	break;
+	case Operation::Display:
+	case Operation::Result:
+	case Operation::Backwards:
+		gradient_a = gradient;
+		break;
+	default:
+		break;
+	}
+}
+
+// The class a softmax label picks, labels in (i - 0.5, i + 0.5] pick logit i. Out of range
+// labels pick nothing and only the log sum term is left.
+inline int softmax_class(float label) {
+	return (int)std::ceil(label - 0.5f);
+}
+
+// -log(softmax(logits)[label]), shifted by the largest logit so exp can't overflow
+inline float softmax_cross_entropy(float label, const float* logits, unsigned num_logits) {
+	if (num_logits == 0)
+		return 0.f;
+	float largest = logits[0];
+	for (unsigned i = 1; i < num_logits; i++) {
+		largest = std::max(largest, logits[i]);
+	}
+	float sum = 0.f;
+	for (unsigned i = 0; i < num_logits; i++) {
+		sum += std::exp(logits[i] - largest);
+	}
+	float loss = largest + std::log(sum);
+	int target = softmax_class(label);
+	if (target >= 0 && target < (int)num_logits)
+		loss -= logits[target];
+	return loss;
+}
+
+// Gradient for each logit is softmax minus the one hot target, the label gets none
+inline void softmax_cross_entropy_backward(float label, const float* logits, unsigned num_logits, float gradient,
+	float* logit_gradients) {
+	if (num_logits == 0)
+		return;
+	float largest = logits[0];
+	for (unsigned i = 1; i < num_logits; i++) {
+		largest = std::max(largest, logits[i]);
+	}
+	float sum = 0.f;
+	for (unsigned i = 0; i < num_logits; i++) {
+		logit_gradients[i] = std::exp(logits[i] - largest);
+		sum += logit_gradients[i];
+	}
+	int target = softmax_class(label);
+	for (unsigned i = 0; i < num_logits; i++) {
+		logit_gradients[i] = gradient * (logit_gradients[i] / sum - (target == (int)i ? 1.f : 0.f));
+	}
+}
+
 struct Socket {
 	Socket(Index _node, unsigned short _slot) : node(_node), slot(_slot) {};
 	Socket() : node(NULL_INDEX), slot(0) {};
@@ -69,6 +317,7 @@ public:
 	short				   m_function_id;
 	vector<Socket>	   m_function_input_nodes;
 	vector<Socket>	   m_function_output_nodes;
+	vector<Index>	   m_frame;	// node for each of the function's local indices, NULL_INDEX for holes
 };
 
 #define MAX_INPUTS 16
@@ -86,6 +335,7 @@ public:
 	uint8_t	   m_variableNumConnections{ 0 };
 	Socket	   m_inputs[MAX_INPUTS];//todo there's redundant information in here...
 	Index	   m_parent{ NULL_INDEX };
+	float	   m_weight{ 1.f };	// Backwards nodes, scales their loss in the sum the backwards pass starts from
 
 	json to_json() const;
 
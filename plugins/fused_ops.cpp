@@ -0,0 +1,65 @@
+// Example op plugin: a fused multiply add and GELU, with batched kernels. Built into the
+// plugins directory next to the executable, where it's picked up on startup.
+
+#include "plugin_api.h"
+
+#include <cmath>
+
+#ifdef _WIN32
+#define PLUGIN_EXPORT extern "C" __declspec(dllexport)
+#else
+#define PLUGIN_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+static float fma_forward(const float* inputs, void*) {
+	return inputs[0] * inputs[1] + inputs[2];
+}
+
+static void fma_backward(const float* inputs, float, float gradient, float* input_gradients, void*) {
+	input_gradients[0] = gradient * inputs[1];
+	input_gradients[1] = gradient * inputs[0];
+	input_gradients[2] = gradient;
+}
+
+static void fma_forward_batch(const float* inputs, float* outs, unsigned count, void*) {
+	for (unsigned i = 0; i < count; i++) {
+		outs[i] = inputs[3 * i] * inputs[3 * i + 1] + inputs[3 * i + 2];
+	}
+}
+
+static void fma_backward_batch(const float* inputs, const float*, const float* gradients, float* input_gradients,
+	unsigned count, void*) {
+	for (unsigned i = 0; i < count; i++) {
+		input_gradients[3 * i] = gradients[i] * inputs[3 * i + 1];
+		input_gradients[3 * i + 1] = gradients[i] * inputs[3 * i];
+		input_gradients[3 * i + 2] = gradients[i];
+	}
+}
+
+// tanh approximation, x/2 (1 + tanh(sqrt(2/pi) (x + 0.044715 x^3)))
+static const float GELU_SCALE = 0.7978845608f;
+static const float GELU_CUBIC = 0.044715f;
+
+static float gelu_forward(const float* inputs, void*) {
+	float x = inputs[0];
+	return 0.5f * x * (1.f + std::tanh(GELU_SCALE * (x + GELU_CUBIC * x * x * x)));
+}
+
+static void gelu_backward(const float* inputs, float, float gradient, float* input_gradients, void*) {
+	float x = inputs[0];
+	float t = std::tanh(GELU_SCALE * (x + GELU_CUBIC * x * x * x));
+	float dt = (1.f - t * t) * GELU_SCALE * (1.f + 3.f * GELU_CUBIC * x * x);
+	input_gradients[0] = gradient * (0.5f * (1.f + t) + 0.5f * x * dt);
+}
+
+PLUGIN_EXPORT int mlgarden_register_ops(unsigned api_version, MlgardenRegisterOp register_op, void* registry) {
+	if (api_version != MLGARDEN_PLUGIN_API_VERSION)
+		return 0;
+
+	MlgardenOp fma = { "fma", 3, fma_forward, fma_backward, fma_forward_batch, fma_backward_batch, nullptr };
+	register_op(registry, &fma);
+
+	MlgardenOp gelu = { "gelu", 1, gelu_forward, gelu_backward, nullptr, nullptr, nullptr };
+	register_op(registry, &gelu);
+	return 1;
+}
@@ -1,25 +1,34 @@
 #include "computation_graph.h"
+#include "task_pool.h"
 #include "bimg/bimg.h"
 #include <set>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <random>
+#include <algorithm>
 
 using nlohmann::json;
 
 void ComputationGraph::clear() {
-	memset(used, 0, sizeof(used));
-	for (int i = 0; i < MAX_NODES; i++) {
-		values[i] = Value::make_value();
-		values[i].m_index = NULL_INDEX;
-		parent[i] = NULL_INDEX;
-	}
+	used.clear();
+	values.clear();
+	gradient_acc.clear();
+	parent.clear();
+	function_node_data.clear();
 	next_free_index = 0;
 	current_backwards_node = NULL_INDEX;
 	current_result_node = NULL_INDEX;
 	current_operation = 0;
 	edit_operations.clear();
+	plan_dirty = true;
+}
+
+void ComputationGraph::reserve(size_t num_nodes) {
+	used.reserve(num_nodes);
+	values.reserve(num_nodes);
+	parent.reserve(num_nodes);
+	function_node_data.reserve(num_nodes);
 }
 
 void ComputationGraph::collapse_selected_nodes_to_new_function(const ImVec2& origin, vector<Function>& functions) {
@@ -41,6 +50,7 @@ void ComputationGraph::collapse_to_new_function(Index* indices, size_t num_indic
 	strcpy(function.m_name, "New function");
 	function.m_id = functions.size();
 	function.m_json = json_data;
+	function.m_template.from_json(function.m_json);
 	function.m_num_inputs = function.m_json["unmatched_inputs"].size();
 
 	std::set<Socket> output_sockets;
@@ -61,6 +71,7 @@ void ComputationGraph::collapse_to_new_function(Index* indices, size_t num_indic
 	}
 
 	Index function_node_index = collapse_to_function(indices, num_indices, pos, function_id);
+	function_node_data[function_node_index].m_frame.assign(indices, indices + num_indices);
 
 	for (int i = 0; i < num_indices; i++) {
 		for (int j = 0; j < MAX_INPUTS; j++) {
@@ -76,7 +87,7 @@ void ComputationGraph::collapse_to_new_function(Index* indices, size_t num_indic
 		}
 	}
 
-	for (int i = 0; i < MAX_NODES; i++) {
+	for (int i = 0; i < next_free_index; i++) {
 		if (used[i]) {
 			if (indices_set.find(i) == indices_set.end()) {
 				for (int j = 0; j < MAX_INPUTS; j++) {
@@ -114,6 +125,7 @@ Index ComputationGraph::collapse_to_function(Index* indices, size_t num_indices,
 	for (int i = 0; i < num_indices; i++) {
 		values[indices[i]].m_parent = function_node_index;
 	}
+	plan_dirty = true;
 
 	function_node_data[function_node_index].m_function_id = function_id;
 
@@ -121,25 +133,104 @@ Index ComputationGraph::collapse_to_function(Index* indices, size_t num_indices,
 }
 
 Index ComputationGraph::instantiate_function(int function_id, const ImVec2& pos, const vector<Function>& functions) {
-	FromJsonAdditionalData additional_data;
-	from_json(functions[function_id].m_json, pos, &additional_data);
+	const FunctionTemplate& function_template = functions[function_id].m_template;
+	const Index num_local = function_template.m_nodes.size();
+	if (num_local == 0) {
+		return NULL_INDEX;
+	}
+
+	Index function_node_index = allocate_values(num_local + 1);
+	Index base = function_node_index + 1;
+
+	vector<Value> new_values;
+	vector<std::string> new_names;
+	vector<FunctionNodeData> new_function_node_data;
+	new_values.reserve(num_local + 1);
+	new_function_node_data.reserve(num_local + 1);
+
+	Value function_value = Value::make_value();
+	function_value.m_operation = Operation::Function;
+	function_value.m_index = function_node_index;
+	function_value.m_position = pos + function_template.m_average_offset;
+	new_values.push_back(function_value);
+	new_names.emplace_back();
+	new_function_node_data.emplace_back();
+
+	FunctionNodeData& data = new_function_node_data[0];
+	data.m_function_id = functions[function_id].m_id;
+	data.m_frame.assign(num_local, NULL_INDEX);
+
+	for (Index local = 0; local < num_local; local++) {
+		if (function_template.m_nodes[local].m_index == NULL_INDEX)
+			continue;
+		Value value = function_template.m_nodes[local];
+		value.m_index = base + local;
+		value.m_parent = value.m_parent == NULL_INDEX ? function_node_index : base + value.m_parent;
+		value.m_position = pos + function_template.m_offsets[local];
+		for (Socket& input : value.m_inputs) {
+			if (input.node != NULL_INDEX) {
+				input.node += base;
+			}
+		}
+		new_values.push_back(value);
+		new_names.push_back(function_template.m_names[local]);
+		new_function_node_data.emplace_back();
+		data.m_frame[local] = base + local;
+
+		if (value.m_operation == Operation::Function) {
+			FunctionNodeData& nested_data = new_function_node_data.back();
+			nested_data = function_template.m_function_node_data[local];
+			for (Socket& socket : nested_data.m_function_input_nodes) {
+				socket.node += base;
+			}
+			for (Socket& socket : nested_data.m_function_output_nodes) {
+				socket.node += base;
+			}
+		}
+	}
 
-	Index i = collapse_to_function(&(additional_data.indices[0]), additional_data.indices.size(), pos, functions[function_id].m_id);
+	for (const Socket& socket : function_template.m_input_nodes) {
+		data.m_function_input_nodes.push_back(socket.node == NULL_INDEX ? Socket() : Socket(base + socket.node, socket.slot));
+	}
+	for (const Socket& socket : function_template.m_output_nodes) {
+		data.m_function_output_nodes.push_back(socket.node == NULL_INDEX ? Socket() : Socket(base + socket.node, socket.slot));
+	}
 
-	function_node_data[i].m_function_input_nodes = additional_data.unmatched_inputs;
-	function_node_data[i].m_function_output_nodes = additional_data.unmatched_outputs;
-	return i;
+	EditOperation op = EditOperation::add_nodes(new_values, new_names, new_function_node_data);
+	apply_operation(op);
+
+	return function_node_index;
 }
 
+Index ComputationGraph::allocate_values(Index count) {
+	IM_ASSERT(next_free_index + count <= MAX_NODES && "Graph is full");
+	reserve(next_free_index + count);
+	Index base = next_free_index;
+	for (Index i = 0; i < count; i++) {
+		get_new_value();
+		used[base + i] = false;
+	}
+	return base;
+}
 
 Index ComputationGraph::get_new_value() {
+	IM_ASSERT(next_free_index < MAX_NODES && "Graph is full");
+	if (next_free_index >= values.size()) {
+		Value value = Value::make_value();
+		value.m_index = NULL_INDEX;
+		used.push_back(false);
+		values.push_back(value);
+		parent.push_back(NULL_INDEX);
+		function_node_data.push_back(FunctionNodeData());
+	}
 	used[next_free_index] = true;
 	values[next_free_index].m_index = next_free_index;
+	plan_dirty = true;
 	return next_free_index++;
 }
 
 void ComputationGraph::delete_value_and_return_removed_connections(Index index, vector<Connection>& removed_connections) {
-	for (int i = 0; i < MAX_NODES; i++) {
+	for (int i = 0; i < next_free_index; i++) {
 		for (int j = 0; j < MAX_INPUTS; j++) {
 			if (values[i].m_inputs[j].node == index) {
 				Connection connection;
@@ -153,6 +244,7 @@ void ComputationGraph::delete_value_and_return_removed_connections(Index index,
 	}
 
 	used[index] = false;
+	plan_dirty = true;
 
 	if (values[index].m_name != nullptr) {
 		free(values[index].m_name);
@@ -162,21 +254,237 @@ void ComputationGraph::delete_value_and_return_removed_connections(Index index,
 	return;
 }
 
-std::default_random_engine generator;
-std::uniform_real_distribution<double> distribution(-1.0, 1.0);
+vector<Index> ComputationGraph::emit_gradient_graph(Index output, const vector<Index>& wrt) {
+	if (output == NULL_INDEX || output >= next_free_index || !used[output])
+		return {};
+
+	auto is_input_used = [&](const Socket& socket) {
+		return socket.node != NULL_INDEX && socket.node < next_free_index && used[socket.node];
+	};
+
+	// Ancestors of output, inputs before the nodes reading them
+	vector<Index> order;
+	vector<char> state(next_free_index, 0);	// 1 on the stack, 2 done
+	vector<Index> stack = { output };
+	while (!stack.empty()) {
+		Index i = stack.back();
+		if (state[i] == 0) {
+			state[i] = 1;
+			// delays read the previous step, the emitted graph is for a single one
+			for (const Socket& input : values[i].m_inputs) {
+				if (is_input_used(input) && state[input.node] == 0 && values[i].m_operation != Operation::Delay)
+					stack.push_back(input.node);
+			}
+		}
+		else {
+			stack.pop_back();
+			if (state[i] == 1) {
+				state[i] = 2;
+				order.push_back(i);
+			}
+		}
+	}
+
+	// Only nodes on a path from a wrt node to output get an adjoint
+	vector<bool> depends(next_free_index, false);
+	for (Index i : wrt) {
+		if (i < next_free_index)
+			depends[i] = true;
+	}
+	for (Index i : order) {
+		if (!is_computed_operation(values[i].m_operation))
+			continue;
+		for (const Socket& input : values[i].m_inputs) {
+			depends[i] = depends[i] || (is_input_used(input) && depends[input.node]);
+		}
+	}
+
+	// New nodes are numbered from where allocate_values will put them
+	const Index base = next_free_index;
+	vector<Value> new_values;
+	const ImVec2 origin = values[output].m_position + ImVec2(250.f, 0.f);
+
+	auto emit = [&](Operation op, Socket a, Socket b) {
+		Value value = Value::make_value();
+		value.m_operation = op;
+		value.m_index = base + (Index)new_values.size();
+		value.m_inputs[0] = a;
+		value.m_inputs[1] = b;
+		value.m_position = origin + ImVec2(120.f * (new_values.size() / 12), 70.f * (new_values.size() % 12));
+		new_values.push_back(value);
+		return Socket(value.m_index, 0);
+	};
+
+	map<float, Socket> constants;
+	auto constant = [&](float number) {
+		auto it = constants.find(number);
+		if (it != constants.end())
+			return it->second;
+		Socket socket = emit(Operation::Constant, Socket(), Socket());
+		new_values.back().m_value = number;
+		constants[number] = socket;
+		return socket;
+	};
+
+	vector<Socket> adjoint(next_free_index);
+	auto accumulate = [&](const Socket& input, Socket gradient) {
+		if (!is_input_used(input) || !depends[input.node])
+			return;
+		Socket& sum = adjoint[input.node];
+		sum = sum.node == NULL_INDEX ? gradient : emit(Operation::Add, sum, gradient);
+	};
+
+	adjoint[output] = constant(1.f);
+	for (auto it = order.rbegin(); it != order.rend(); ++it) {
+		Index i = *it;
+		const Socket gradient = adjoint[i];
+		if (gradient.node == NULL_INDEX || !depends[i] || !is_computed_operation(values[i].m_operation))
+			continue;
+
+		// Same derivatives as backward_operation, written as nodes
+		const Socket a = values[i].m_inputs[0];
+		const Socket b = values[i].m_inputs[1];
+		const Socket out(i, 0);
+		switch (values[i].m_operation) {
+		case Operation::Add:
+			accumulate(a, gradient);
+			accumulate(b, gradient);
+			break;
+		case Operation::Subtract:
+			accumulate(a, gradient);
+			accumulate(b, emit(Operation::Subtract, Socket(), gradient));
+			break;
+		case Operation::Multiply:
+			accumulate(a, emit(Operation::Multiply, gradient, b));
+			accumulate(b, emit(Operation::Multiply, gradient, a));
+			break;
+		case Operation::Divide:
+			accumulate(a, emit(Operation::Divide, gradient, b));
+			accumulate(b, emit(Operation::Subtract, Socket(), emit(Operation::Divide, emit(Operation::Multiply, gradient, out), b)));
+			break;
+		case Operation::Power:
+			if (is_input_used(a) && depends[a.node]) {
+				Socket exponent = emit(Operation::Subtract, b, constant(1.f));
+				accumulate(a, emit(Operation::Multiply, gradient, emit(Operation::Multiply, b, emit(Operation::Power, a, exponent))));
+			}
+			if (is_input_used(b) && depends[b.node]) {
+				accumulate(b, emit(Operation::Multiply, gradient, emit(Operation::Multiply, out, emit(Operation::Log, a, Socket()))));
+			}
+			break;
+		case Operation::Tanh:
+			accumulate(a, emit(Operation::Multiply, gradient, emit(Operation::Subtract, constant(1.f), emit(Operation::Multiply, out, out))));
+			break;
+		case Operation::ReLU:
+		{
+			// leaky, the slope is 0.1 + 0.9 * step(out)
+			Socket slope = emit(Operation::Add, constant(0.1f), emit(Operation::Multiply, constant(0.9f), emit(Operation::Step, out, Socket())));
+			accumulate(a, emit(Operation::Multiply, gradient, slope));
+		}
+		break;
+		case Operation::Sin:
+			accumulate(a, emit(Operation::Multiply, gradient, emit(Operation::Cos, a, Socket())));
+			break;
+		case Operation::Cos:
+			accumulate(a, emit(Operation::Subtract, Socket(), emit(Operation::Multiply, gradient, emit(Operation::Sin, a, Socket()))));
+			break;
+		case Operation::Sqrt:
+			accumulate(a, emit(Operation::Divide, emit(Operation::Multiply, gradient, constant(0.5f)), out));
+			break;
+		case Operation::Log:
+			accumulate(a, emit(Operation::Divide, gradient, a));
+			break;
+		case Operation::Step:
+			break;
+		case Operation::MeanSquaredError:
+		{
+			Socket difference = emit(Operation::Multiply, gradient, emit(Operation::Multiply, constant(2.f), emit(Operation::Subtract, a, b)));
+			accumulate(a, difference);
+			accumulate(b, emit(Operation::Subtract, Socket(), difference));
+		}
+		break;
+		case Operation::Hinge:
+		{
+			// y is 2 * step(b - 0.5) - 1, the loss only has a slope while out is positive
+			Socket y = emit(Operation::Subtract, emit(Operation::Multiply, constant(2.f), emit(Operation::Step, emit(Operation::Subtract, b, constant(0.5f)), Socket())), constant(1.f));
+			accumulate(a, emit(Operation::Subtract, Socket(), emit(Operation::Multiply, gradient, emit(Operation::Multiply, y, emit(Operation::Step, out, Socket())))));
+		}
+		break;
+		case Operation::Logistic:
+		{
+			// sigmoid(a) = 0.5 + 0.5 * tanh(a / 2)
+			Socket sigmoid = emit(Operation::Add, constant(0.5f), emit(Operation::Multiply, constant(0.5f), emit(Operation::Tanh, emit(Operation::Multiply, constant(0.5f), a), Socket())));
+			accumulate(a, emit(Operation::Multiply, gradient, emit(Operation::Subtract, sigmoid, b)));
+			accumulate(b, emit(Operation::Subtract, Socket(), emit(Operation::Multiply, gradient, a)));
+		}
+		break;
+		case Operation::SoftmaxCrossEntropy:
+		{
+			// softmax from e^logit over their sum, minus a one hot made of two steps
+			const Socket label = values[i].m_inputs[0];
+			vector<Socket> logits;
+			vector<Socket> exponentials;
+			Socket sum;
+			for (int k = 1; k < MAX_INPUTS; k++) {
+				if (!is_input_used(values[i].m_inputs[k]))
+					continue;
+				logits.push_back(values[i].m_inputs[k]);
+				exponentials.push_back(emit(Operation::Power, constant(2.718281828f), values[i].m_inputs[k]));
+				sum = sum.node == NULL_INDEX ? exponentials.back() : emit(Operation::Add, sum, exponentials.back());
+			}
+			for (size_t k = 0; k < logits.size(); k++) {
+				if (!depends[logits[k].node])
+					continue;
+				Socket softmax = emit(Operation::Divide, exponentials[k], sum);
+				Socket one_hot = emit(Operation::Subtract,
+					emit(Operation::Step, emit(Operation::Subtract, label, constant((float)k - 0.5f)), Socket()),
+					emit(Operation::Step, emit(Operation::Subtract, label, constant((float)k + 0.5f)), Socket()));
+				accumulate(logits[k], emit(Operation::Multiply, gradient, emit(Operation::Subtract, softmax, one_hot)));
+			}
+		}
+		break;
+		case Operation::Display:
+		case Operation::Result:
+		case Operation::Backwards:
+			accumulate(a, gradient);
+			break;
+		default:
+			// plugin ops and expressions only have kernels, there are no nodes to write them as
+			break;
+		}
+	}
+
+	vector<Index> gradient_nodes;
+	vector<std::string> new_names;
+	for (Index i : wrt) {
+		Socket gradient = i < next_free_index && adjoint[i].node != NULL_INDEX ? adjoint[i] : constant(0.f);
+		emit(Operation::Display, gradient, Socket());
+		new_names.resize(new_values.size());
+		new_names.back() = std::string("d") + (i < next_free_index && values[i].m_name ? values[i].m_name : "param");
+		gradient_nodes.push_back(new_values.back().m_index);
+	}
+	new_names.resize(new_values.size());
+
+	Index allocated = allocate_values((Index)new_values.size());
+	IM_ASSERT(allocated == base);
+	EditOperation op = EditOperation::add_nodes(new_values, new_names);
+	apply_operation(op);
+	return gradient_nodes;
+}
 
 void ComputationGraph::randomize_parameters() {
-	for (int i = 0; i < MAX_NODES; i++) {
+	// keyed on the node so the same seed always gives the same parameters
+	for (int i = 0; i < next_free_index; i++) {
 		if (used[i]) {
 			if (values[i].m_operation == Operation::Parameter) {
-				values[i].m_value = distribution(generator);
+				values[i].m_value = counter_random_range(parameter_seed, i, -1.f, 1.f);
 			}
 		}
 	}
+	parameter_seed++;
 }
 
 void ComputationGraph::do_stochastic_gradient_descent_step(float learning_rate) {
-	for (int i = 0; i < MAX_NODES; i++) {
+	for (int i = 0; i < next_free_index; i++) {
 		if (used[i]) {
 			if (values[i].m_operation != Operation::Parameter && values[i].m_operation != Operation::Constant) {
 				values[i].m_value = 0.f;
@@ -190,7 +498,7 @@ void ComputationGraph::do_stochastic_gradient_descent_step(float learning_rate)
 	if (current_backwards_node != NULL_INDEX)
 		backwards(&data_source.data[data_source.current_data_point].x);
 
-	for (int i = 0; i < MAX_NODES; i++) {
+	for (int i = 0; i < next_free_index; i++) {
 		if (used[i]) {
 			if (values[i].m_operation == Operation::Parameter) {
 				values[i].m_value -= learning_rate * values[i].m_gradient;
@@ -200,7 +508,10 @@ void ComputationGraph::do_stochastic_gradient_descent_step(float learning_rate)
 }
 
 void ComputationGraph::do_stochastic_gradient_descent(float learning_rate, int batch_size, int& current_point, vector<int>& shuffled_points) {
-	memset(gradient_acc, 0, sizeof(gradient_acc));
+	compile_plan();
+	plan.load_parameters(*this);
+
+	gradient_acc.assign(plan.parameters.size(), 0.f);
 
 	for (int i = 0; i < batch_size; i++) {
 		if (current_point == 0) {
@@ -212,87 +523,34 @@ void ComputationGraph::do_stochastic_gradient_descent(float learning_rate, int b
 		}
 		data_source.current_data_point = shuffled_points[current_point];
 		current_point = (current_point+1)%shuffled_points.size();
-		forwards(&data_source.data[data_source.current_data_point].x);
-		if (current_backwards_node != NULL_INDEX)
-			backwards(&data_source.data[data_source.current_data_point].x);
-		for (int i = 0; i < next_free_index; i++) {
-			if (used[i]) {
-				if (values[i].m_operation == Operation::Parameter) {
-					gradient_acc[i] += values[i].m_gradient;
-				}
-			}
-		}
-	}
-
-	for (int i = 0; i < next_free_index; i++) {
-		if (used[i]) {
-			float rate = learning_rate / (float)batch_size;
-			if (values[i].m_operation == Operation::Parameter) {
-				values[i].m_value -= rate * gradient_acc[i];
-			}
-		}
+		plan.accumulate_gradients(&data_source.data[data_source.current_data_point].x, gradient_acc);
 	}
 
+	plan.apply_gradients(gradient_acc, learning_rate / (float)batch_size);
+	plan.store_values(*this);
 }
 
 
-void ComputationGraph::forwards(float* data_values) {
-	//first we find all the nodes with no parents
-	if (cached_topological_sorted_descendants.size() == 0) {
-		unordered_set <Index> checked;
-		unordered_set <Index> has_parent;
-
-		for (int i = 0; i < next_free_index; i++) {
-			if (used[i]) {
-				checked.insert(i);
-				for (int k = 0; k < MAX_INPUTS; k++) {
-					if (values[i].m_inputs[k].node != NULL_INDEX)
-						has_parent.insert(values[i].m_inputs[k].node);
-				}
-			}
-		}
-
-		for (auto& it : checked) {
-			if (has_parent.find(it) == has_parent.end()) {
-				cached_no_parent.insert(it);
-			}
-		}
-
-		unordered_set <Index> calculated;
-		for (const auto& it : cached_no_parent) {
-			vector<Index> sorted_descendants = values[it].get_topological_sorted_descendants(values);
-			cached_topological_sorted_descendants[it] = sorted_descendants;
-
-			
-		}
+void ComputationGraph::compile_plan() {
+	if (plan_dirty) {
+		plan.compile(*this);
+		plan.pool = &TaskPool::shared();
+		plan_dirty = false;
+		plan_version++;
 	}
+}
 
-	for (const auto& it : cached_no_parent) {
-		for (const auto& descendant : cached_topological_sorted_descendants[it]) {
-			values[descendant].single_forwards(values, data_values);
-		}
-
-	}
+void ComputationGraph::forwards(float* data_values) {
+	compile_plan();
+	plan.load_parameters(*this);
+	plan.forwards(data_values);
+	plan.store_values(*this);
 }
 
 void ComputationGraph::backwards(float* data_values) {
-	if (cached_sorted_descendants.size() == 0) {
-		cached_sorted_descendants = values[current_backwards_node].get_topological_sorted_descendants(values);
-	}
-
-	for (auto& it : cached_sorted_descendants) {
-		values[it].m_gradient = 0.f;
-		values[it].m_gradient_calculated = true;
-	}
-
-	values[current_backwards_node].m_gradient = 1.f;
-
-	values[current_backwards_node].m_gradient_calculated = true;
-
-	for (vector<Index>::reverse_iterator it = cached_sorted_descendants.rbegin(); it != cached_sorted_descendants.rend(); ++it) {
-
-		values[*it].single_backwards(values, data_values);
-	}
+	compile_plan();
+	plan.backwards();
+	plan.store_gradients(*this);
 }
 
 void ComputationGraph::zero_gradients() {
@@ -315,8 +573,6 @@ vector<Index> ComputationGraph::from_json(const json& json, const ImVec2& origin
 
 	vector<Index> nodes = vector<Index>();
 
-	printf("FROM_JSON: %s\n", json.dump(4).c_str());
-
 	map<Index, Index> json_index_to_index;
 	for (int i = 0; i < json["nodes"].size(); i++) {
 		Index index = get_new_value();
@@ -392,12 +648,105 @@ vector<Index> ComputationGraph::from_json(const json& json, const ImVec2& origin
 			socket.node = json_index_to_index[output["node"]];
 			function_node_data[json_index_to_index[i]].m_function_output_nodes.push_back(socket);
 		}
+		// older files don't have frames, those instances don't get function edits propagated to them
+		for (auto& node : json["function_node_data"][i]["frame"]) {
+			auto it = json_index_to_index.find((Index)node);
+			function_node_data[json_index_to_index[i]].m_frame.push_back(it == json_index_to_index.end() ? NULL_INDEX : it->second);
+		}
 	}
 
 	edit_operations.back().m_final = true;
 	return nodes;
 }
 
+void FunctionTemplate::from_json(const json& j) {
+	*this = FunctionTemplate();
+
+	// Local indices are the json indices. They're dense for freshly collapsed functions
+	// but can have holes once nodes get deleted from the function's graph.
+	Index num_local = 0;
+	for (auto& node : j["nodes"]) {
+		num_local = ImMax(num_local, (Index)node["index"] + 1);
+	}
+
+	Value hole;
+	hole.m_index = NULL_INDEX;
+	m_nodes.assign(num_local, hole);
+	m_names.assign(num_local, "");
+	m_offsets.assign(num_local, ImVec2());
+	m_function_node_data.resize(num_local);
+
+	auto is_local = [&](Index index) {
+		return index < num_local && m_nodes[index].m_index != NULL_INDEX;
+	};
+
+	for (Index i = 0; i < j["nodes"].size(); i++) {
+		Index local = j["nodes"][i]["index"];
+		m_nodes[local].m_index = local;
+	}
+
+	int num_top_level = 0;
+	for (Index i = 0; i < j["nodes"].size(); i++) {
+		Value value;
+		value.from_json(j["nodes"][i]);
+		Index local = value.m_index;
+		if (!is_local(value.m_parent)) {
+			value.m_parent = NULL_INDEX;
+		}
+		for (Socket& input : value.m_inputs) {
+			if (input.node != NULL_INDEX && !is_local(input.node)) {
+				input = Socket();
+			}
+		}
+
+		if (value.m_name != nullptr) {
+			m_names[local] = value.m_name;
+			free(value.m_name);
+			value.m_name = nullptr;
+		}
+
+		m_offsets[local] = ImVec2(j["offsets"][i][0], j["offsets"][i][1]);
+		if (value.m_parent == NULL_INDEX) {
+			m_average_offset += m_offsets[local];
+			num_top_level++;
+		}
+
+		m_nodes[local] = value;
+	}
+
+	if (num_top_level > 0) {
+		m_average_offset = m_average_offset / (float)num_top_level;
+	}
+
+	// Pins are in list order, pins that aren't connected inside the function stay as null sockets
+	for (auto& ui : j["unmatched_inputs"]) {
+		m_input_nodes.push_back(is_local(ui["end"]) ? Socket(ui["end"], ui["end_slot"]) : Socket());
+	}
+	for (auto& uo : j["unmatched_outputs"]) {
+		m_output_nodes.push_back(is_local(uo["start"]) ? Socket(uo["start"], uo["start_slot"]) : Socket());
+	}
+
+	if (!j.contains("function_node_data"))
+		return;
+
+	for (Index local = 0; local < j["function_node_data"].size() && local < num_local; local++) {
+		const json& data = j["function_node_data"][local];
+		if (data.is_null() || !is_local(local))
+			continue;
+		m_function_node_data[local].m_function_id = data["function_id"];
+		for (auto& input : data["function_input_nodes"]) {
+			Socket socket;
+			socket.from_json(input);
+			m_function_node_data[local].m_function_input_nodes.push_back(socket);
+		}
+		for (auto& output : data["function_output_nodes"]) {
+			Socket socket;
+			socket.from_json(output);
+			m_function_node_data[local].m_function_output_nodes.push_back(socket);
+		}
+	}
+}
+
 json ComputationGraph::to_json(Index* indices, const ImVec2& origin, int num) const {
 	int next_json_index = 0;
 	json j;
@@ -516,6 +865,15 @@ json ComputationGraph::to_json(Index* indices, const ImVec2& origin, int num) co
 			output_nodes.push_back(json_data);
 		}
 		j["function_node_data"][json_index]["function_output_nodes"] = output_nodes;
+
+		if (!function_node_data[index].m_frame.empty()) {
+			json frame = json::array();
+			for (Index node : function_node_data[index].m_frame) {
+				auto it = index_to_json_index.find(node);
+				frame.push_back(it == index_to_json_index.end() ? NULL_INDEX : (Index)it->second);
+			}
+			j["function_node_data"][json_index]["frame"] = frame;
+		}
 	}
 
 	printf("TO_JSON: %s\n", j.dump(4).c_str());
@@ -536,29 +894,311 @@ void ComputationGraph::apply_operation(EditOperation& operation) {
 	}
 	edit_operations.push_back(operation);
 	edit_operations.back().apply(this);
-	cached_no_parent.clear();
-	cached_sorted_descendants.clear();
-	cached_topological_sorted_descendants.clear();
+	plan_dirty = true;
+	if (record_edits) {
+		recorded_edits.push_back(edit_operations.back());
+	}
 	current_operation++;
 }
 
 void ComputationGraph::undo() {
+	plan_dirty = true;
 	if (current_operation > 0) {
 		do {
 			current_operation--;
 			edit_operations[current_operation].undo(this);
+			if (record_edits) {
+				const EditOperation& operation = edit_operations[current_operation];
+				if (operation.m_type == EditOperationType::AddNodes) {
+					for (const Value& value : operation.m_values) {
+						recorded_edits.push_back(EditOperation::remove_node(value.m_index));
+					}
+				}
+				else {
+					recorded_edits.push_back(operation.inverse());
+				}
+			}
 		} while (current_operation > 0 && !edit_operations[current_operation - 1].m_final);
 	}
 }
 
 void ComputationGraph::redo() {
+	plan_dirty = true;
 	if (current_operation < edit_operations.size()) {
 		do {
 			edit_operations[current_operation].apply(this);
+			if (record_edits) {
+				recorded_edits.push_back(edit_operations[current_operation]);
+			}
 			current_operation++;
 		} while (current_operation < edit_operations.size() && !edit_operations[current_operation - 1].m_final);
 	}
 }
+void ComputationGraph::apply_function_edit(Index instance, FunctionNodeData& data, const EditOperation& edit, const ComputationGraph& function_graph, const vector<Socket>& input_feeds) {
+	auto frame_node = [&](Index local) {
+		return local < data.m_frame.size() ? data.m_frame[local] : NULL_INDEX;
+	};
+
+	// Sockets in the function's graph map through the frame, the input node's pins map to
+	// whatever feeds that pin of the instance.
+	auto to_instance = [&](const Socket& socket) {
+		if (socket.node == NULL_INDEX || socket.node >= function_graph.next_free_index)
+			return Socket();
+		if (function_graph.values[socket.node].m_operation == Operation::FunctionInput) {
+			return socket.slot < input_feeds.size() ? input_feeds[socket.slot] : Socket();
+		}
+		Index node = frame_node(socket.node);
+		return node == NULL_INDEX ? Socket() : Socket(node, socket.slot);
+	};
+
+	auto set_input = [&](Index node, unsigned short slot, const Socket& start) {
+		Connection connection;
+		connection.start = start;
+		connection.end = Socket(node, slot);
+		EditOperation op = EditOperation::add_connection(connection, false);
+		apply_operation(op);
+	};
+
+	// Every node gets its index first, the values can link to each other in any order
+	auto add_nodes = [&](const vector<Value>& locals, const vector<std::string>& local_names) {
+		vector<Index> added;
+		for (const Value& value : locals) {
+			Index local = value.m_index;
+			if (value.m_operation == Operation::FunctionInput || value.m_operation == Operation::FunctionOutput)
+				continue;
+			if (data.m_frame.size() <= local)
+				data.m_frame.resize(local + 1, NULL_INDEX);
+			data.m_frame[local] = get_new_value();
+			added.push_back(local);
+		}
+		if (added.empty())
+			return;
+
+		vector<Value> new_values;
+		vector<std::string> new_names;
+		for (size_t i = 0; i < locals.size(); i++) {
+			const Value& value = locals[i];
+			if (value.m_operation == Operation::FunctionInput || value.m_operation == Operation::FunctionOutput)
+				continue;
+			Value new_value = value;
+			new_value.m_index = frame_node(value.m_index);
+			new_value.m_parent = value.m_parent == NULL_INDEX ? instance : frame_node(value.m_parent);
+			new_value.m_name = nullptr;
+			for (Socket& input : new_value.m_inputs) {
+				input = to_instance(input);
+			}
+			new_values.push_back(new_value);
+			new_names.push_back(local_names[i]);
+		}
+		EditOperation op = EditOperation::add_nodes(new_values, new_names, {}, false);
+		apply_operation(op);
+	};
+
+	switch (edit.m_type) {
+	case EditOperationType::AddNode:
+		add_nodes({ edit.m_value }, { edit.m_value.m_name ? edit.m_value.m_name : "" });
+		break;
+	case EditOperationType::AddNodes:
+		add_nodes(edit.m_values, edit.m_names);
+		break;
+	case EditOperationType::RemoveNode:
+	{
+		Index index = frame_node(edit.m_index);
+		if (index != NULL_INDEX) {
+			// links first, like deleting a selection, so undo puts them back
+			for (Index i = 0; i < next_free_index; i++) {
+				if (!used[i])
+					continue;
+				for (unsigned short slot = 0; slot < MAX_INPUTS; slot++) {
+					if (values[i].m_inputs[slot].node == index) {
+						Connection connection;
+						connection.start = values[i].m_inputs[slot];
+						connection.end = Socket(i, slot);
+						EditOperation op = EditOperation::remove_link(connection, i, false);
+						apply_operation(op);
+					}
+				}
+			}
+			EditOperation op = EditOperation::remove_node(index, false);
+			apply_operation(op);
+			data.m_frame[edit.m_index] = NULL_INDEX;
+			for (Socket& pin : data.m_function_output_nodes) {
+				if (pin.node == index) {
+					pin = Socket();
+				}
+			}
+		}
+	}
+	break;
+	case EditOperationType::AddLink:
+	{
+		Socket start = to_instance(edit.m_connection.start);
+		const Socket& end = edit.m_connection.end;
+		if (function_graph.values[end.node].m_operation == Operation::FunctionOutput) {
+			// the output pin now comes from a different node, move the outside links over
+			vector<Socket>& pins = data.m_function_output_nodes;
+			if (end.slot >= pins.size() || start.node == NULL_INDEX)
+				break;
+			Socket old_start = pins[end.slot];
+			pins[end.slot] = start;
+			for (Index i = 0; i < next_free_index; i++) {
+				if (!used[i] || values[i].m_parent == instance)
+					continue;
+				for (unsigned short slot = 0; slot < MAX_INPUTS; slot++) {
+					const Socket& input = values[i].m_inputs[slot];
+					if (input.node == old_start.node && input.slot == old_start.slot) {
+						set_input(i, slot, start);
+					}
+				}
+			}
+		}
+		else if (frame_node(end.node) != NULL_INDEX) {
+			set_input(frame_node(end.node), end.slot, start);
+		}
+	}
+	break;
+	case EditOperationType::RemoveLink:
+	{
+		const Socket& end = edit.m_connection.end;
+		Index node = frame_node(end.node);
+		if (node != NULL_INDEX && values[node].m_inputs[end.slot].node != NULL_INDEX) {
+			Connection connection;
+			connection.start = values[node].m_inputs[end.slot];
+			connection.end = Socket(node, end.slot);
+			EditOperation op = EditOperation::remove_link(connection, node, false);
+			apply_operation(op);
+		}
+	}
+	break;
+	case EditOperationType::SetName:
+		if (frame_node(edit.m_index) != NULL_INDEX) {
+			EditOperation op = EditOperation::set_name(frame_node(edit.m_index), edit.m_names[0].c_str(), false);
+			apply_operation(op);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void ComputationGraph::rebind_function_pins(Index instance, FunctionNodeData& data, const FunctionTemplate& function_template, const vector<Socket>& input_feeds) {
+	auto frame_socket = [&](const Socket& socket) {
+		if (socket.node == NULL_INDEX || socket.node >= data.m_frame.size() || data.m_frame[socket.node] == NULL_INDEX)
+			return Socket();
+		return Socket(data.m_frame[socket.node], socket.slot);
+	};
+
+	data.m_function_input_nodes.clear();
+	for (Index p = 0; p < function_template.m_input_nodes.size(); p++) {
+		Socket pin = frame_socket(function_template.m_input_nodes[p]);
+		// the pin's consumer might be new, it still has to be fed from outside
+		if (pin.node != NULL_INDEX && p < input_feeds.size() && input_feeds[p].node != NULL_INDEX && values[pin.node].m_inputs[pin.slot].node == NULL_INDEX) {
+			Connection connection;
+			connection.start = input_feeds[p];
+			connection.end = pin;
+			EditOperation op = EditOperation::add_connection(connection, false);
+			apply_operation(op);
+		}
+		data.m_function_input_nodes.push_back(pin);
+	}
+
+	data.m_function_output_nodes.clear();
+	for (const Socket& output : function_template.m_output_nodes) {
+		data.m_function_output_nodes.push_back(frame_socket(output));
+	}
+}
+
+json ComputationGraph::to_function_json() const {
+	Index input_node = NULL_INDEX;
+	Index output_node = NULL_INDEX;
+	ImVec2 origin = ImVec2();
+	int num_positioned = 0;
+	for (Index i = 0; i < next_free_index; i++) {
+		if (!used[i])
+			continue;
+		if (values[i].m_operation == Operation::FunctionInput)
+			input_node = i;
+		else if (values[i].m_operation == Operation::FunctionOutput)
+			output_node = i;
+		else if (values[i].m_parent == NULL_INDEX) {
+			origin += values[i].m_position;
+			num_positioned++;
+		}
+	}
+	if (num_positioned > 0) {
+		origin = origin / (float)num_positioned;
+	}
+
+	// Local indices are this graph's indices, so instances' frames stay valid as the
+	// function gets edited.
+	json j;
+	j["nodes"] = json::array();
+	j["offsets"] = json::array();
+	j["unmatched_inputs"] = json::array();
+	j["unmatched_outputs"] = json::array();
+
+	int num_inputs = input_node != NULL_INDEX ? values[input_node].m_variableNumConnections : 0;
+	vector<Socket> input_pins(num_inputs);
+
+	for (Index i = 0; i < next_free_index; i++) {
+		if (!used[i] || i == input_node || i == output_node)
+			continue;
+
+		json node = values[i].to_json();
+		for (int k = 0; k < MAX_INPUTS; k++) {
+			const Socket& input = values[i].m_inputs[k];
+			if (input.node != NULL_INDEX && input.node == input_node) {
+				if (input.slot < input_pins.size() && input_pins[input.slot].node == NULL_INDEX) {
+					input_pins[input.slot] = Socket(i, k);
+				}
+				node["inputs"][k] = nullptr;
+			}
+		}
+		j["nodes"].push_back(node);
+
+		if (values[i].m_parent == NULL_INDEX) {
+			j["offsets"].push_back({ values[i].m_position.x - origin.x, values[i].m_position.y - origin.y });
+		}
+		else {
+			j["offsets"].push_back({ 0, 0 });
+		}
+
+		if (values[i].m_operation == Operation::Function) {
+			j["function_node_data"][i]["function_id"] = function_node_data[i].m_function_id;
+			json input_nodes = json::array();
+			for (const Socket& input : function_node_data[i].m_function_input_nodes) {
+				input_nodes.push_back(input.to_json());
+			}
+			j["function_node_data"][i]["function_input_nodes"] = input_nodes;
+			json output_nodes = json::array();
+			for (const Socket& output : function_node_data[i].m_function_output_nodes) {
+				output_nodes.push_back(output.to_json());
+			}
+			j["function_node_data"][i]["function_output_nodes"] = output_nodes;
+		}
+	}
+
+	// One entry per pin, in pin order, unconnected pins keep their place with a null node
+	for (const Socket& pin : input_pins) {
+		json unmatched_input;
+		unmatched_input["end"] = pin.node;
+		unmatched_input["end_slot"] = pin.slot;
+		j["unmatched_inputs"].push_back(unmatched_input);
+	}
+
+	if (output_node != NULL_INDEX) {
+		for (int q = 0; q < values[output_node].m_variableNumConnections; q++) {
+			const Socket& output = values[output_node].m_inputs[q];
+			json unmatched_output;
+			unmatched_output["start"] = output.node;
+			unmatched_output["start_slot"] = output.slot;
+			j["unmatched_outputs"].push_back(unmatched_output);
+		}
+	}
+
+	return j;
+}
+
 #include <algorithm>  
 void ComputationGraph::copy_selected_nodes(const ImVec2& origin) {
 	int num_nodes_selected = ImNodes::NumSelectedNodes();
@@ -570,7 +1210,7 @@ void ComputationGraph::copy_selected_nodes(const ImVec2& origin) {
 		for (int i = 0; i < selected_nodes.size(); i++) {
 			Index index = selected_nodes[i]; 
 			if (values[index].m_operation == Operation::Function) {
-				for (int j = 0; j < MAX_NODES; j++) {
+				for (int j = 0; j < next_free_index; j++) {
 					if (used[j]) {
 						if (values[j].m_parent == index) {
 							selected_nodes.push_back(j);
@@ -605,7 +1245,7 @@ void ComputationGraph::delete_selected_nodes() {
 		ImNodes::GetSelectedNodes(selected_nodes);
 
 		for (int i = 0; i < num_nodes_selected; i++) {
-			for (int j = 0; j < MAX_NODES; j++) {
+			for (int j = 0; j < next_free_index; j++) {
 				for (int k = 0; k < MAX_INPUTS; k++) {
 					if (values[j].m_inputs[k].node == selected_nodes[i]) {
 						//remove all links
@@ -697,10 +1337,17 @@ unsigned ComputationGraph::get_attribute_output_index(Index i, unsigned output)
 }
 
 bool DataSource::load(const char* filename) {
+	vector<DataPoint> new_data;
+	if (!read_csv(filename, new_data))
+		return false;
+	set_data(std::move(new_data));
+	return true;
+}
+
+bool DataSource::read_csv(const char* filename, vector<DataPoint>& data) {
 	std::string line;
 	std::ifstream file(filename);
 
-	current_data_point = 0;
 	// Check if file is open
 	if (!file.is_open()) {
 		std::cerr << "Error opening file" << std::endl;
@@ -723,11 +1370,16 @@ bool DataSource::load(const char* filename) {
 	}
 
 	file.close();
+	return true;
+}
+
+void DataSource::set_data(vector<DataPoint> new_data) {
+	current_data_point = 0;
+	data = std::move(new_data);
 
 	for (int i = 0; i < NUM_IMAGES; i++) {
 		update_image(nullptr);
 	}
-	return 0;
 }
 
 void DataSource::update_image(ComputationGraph* graph) {
@@ -764,24 +1416,44 @@ void DataSource::update_image(ComputationGraph* graph) {
 	max.x += (max.x - min.x) * 0.1f;
 	max.y += (max.y - min.y) * 0.1f;
 
-	if (graph && graph->current_result_node) {
-		for (int x = 0; x < BACKGROUND_IMAGE_RESOLUTION; x++) {
-			for (int y = 0; y < BACKGROUND_IMAGE_RESOLUTION; y++) {
-				override_data_point.x = min.x + (max.x - min.x) * (((float)x+0.5f) / (float)BACKGROUND_IMAGE_RESOLUTION);
-				override_data_point.y = (min.y + (max.y - min.y) * (((float)y+0.5f) / (float)BACKGROUND_IMAGE_RESOLUTION));
-				should_override_data_point = true;
-				graph->forwards(&override_data_point.x);
-
-				float result = graph->values[graph->current_result_node].m_value;
-
-				//unsigned int red = 255 - (100 * ImClamp(result, 0.f, 1.f));
-				unsigned int red = 255 - (100 * ImClamp(result, 0.f, 1.f));
-				unsigned int green = 255 - (100 * ImClamp(ImAbs(result), 0.f, 1.f)/1.5f);
-				unsigned int blue = 255 - (100 * ImClamp(-result, 0.f, 1.f));
-///todo double buffer and only update background
-				((uint32_t*)background_image_data[current_image_index] )[x + (BACKGROUND_IMAGE_RESOLUTION - 1 - y) * BACKGROUND_IMAGE_RESOLUTION] = IM_COL32(red, green, blue, 255);
+	if (graph && graph->current_result_node != NULL_INDEX) {
+		graph->compile_plan();
+
+		// The columns are split in blocks over the task pool, each with its own copy of the plan,
+		// planned so the copies only hold what the result needs
+		ExecutionPlan base_plan = graph->plan;
+		base_plan.load_parameters(*graph);
+		base_plan.plan_memory(true);
+		base_plan.pool = nullptr;
+		Register result_register = base_plan.result_register;
+		uint32_t* background = (uint32_t*)background_image_data[current_image_index];
+		const ImVec2 image_min = min;
+		const ImVec2 image_max = max;
+
+		TaskPool& pool = TaskPool::shared();
+		unsigned num_blocks = pool.num_workers() + 1;
+		pool.parallel_for(num_blocks, [&](unsigned block) {
+			ExecutionPlan plan = base_plan;
+			int first_x = BACKGROUND_IMAGE_RESOLUTION * block / num_blocks;
+			int end_x = BACKGROUND_IMAGE_RESOLUTION * (block + 1) / num_blocks;
+			for (int x = first_x; x < end_x; x++) {
+				for (int y = 0; y < BACKGROUND_IMAGE_RESOLUTION; y++) {
+					DataPoint point;
+					point.x = image_min.x + (image_max.x - image_min.x) * (((float)x+0.5f) / (float)BACKGROUND_IMAGE_RESOLUTION);
+					point.y = (image_min.y + (image_max.y - image_min.y) * (((float)y+0.5f) / (float)BACKGROUND_IMAGE_RESOLUTION));
+					point.label = 0.f;
+					plan.forwards(&point.x);
+
+					float result = result_register != NULL_INDEX ? plan.values[result_register] : 0.f;
+
+					//unsigned int red = 255 - (100 * ImClamp(result, 0.f, 1.f));
+					unsigned int red = 255 - (100 * ImClamp(result, 0.f, 1.f));
+					unsigned int green = 255 - (100 * ImClamp(ImAbs(result), 0.f, 1.f)/1.5f);
+					unsigned int blue = 255 - (100 * ImClamp(-result, 0.f, 1.f));
+					background[x + (BACKGROUND_IMAGE_RESOLUTION - 1 - y) * BACKGROUND_IMAGE_RESOLUTION] = IM_COL32(red, green, blue, 255);
+				}
 			}
-		}
+		}, TaskPriority::Interactive);
 	}
 	else {
 		for (int x = 0; x < BACKGROUND_IMAGE_RESOLUTION; x++) {
@@ -993,6 +1665,24 @@ void ComputationGraph::show_node(Index i, vector<Function>& functions) {
 	case Operation::Sqrt:
 		ImGui::TextUnformatted("sqrt");
 		break;
+	case Operation::Log:
+		ImGui::TextUnformatted("log");
+		break;
+	case Operation::Step:
+		ImGui::TextUnformatted("step");
+		break;
+	case Operation::MeanSquaredError:
+		ImGui::TextUnformatted("mse");
+		break;
+	case Operation::Hinge:
+		ImGui::TextUnformatted("hinge");
+		break;
+	case Operation::Logistic:
+		ImGui::TextUnformatted("logistic");
+		break;
+	case Operation::SoftmaxCrossEntropy:
+		ImGui::TextUnformatted("softmax xent");
+		break;
 	case Operation::Parameter:
 	{
 		if (currentValue.m_name == nullptr) {
@@ -1010,10 +1700,39 @@ void ComputationGraph::show_node(Index i, vector<Function>& functions) {
 	case Operation::Constant:
 		ImGui::TextUnformatted("constant");
 		break;
+	case Operation::Delay:
+		ImGui::TextUnformatted("delay");
+		break;
+	case Operation::Expression:
+	{
+		if (currentValue.m_name == nullptr) {
+			currentValue.m_name = (char*)malloc(128);
+			currentValue.m_name[0] = '\0';
+		}
+		ImGui::PushStyleColor(ImGuiCol_FrameBg, ImVec4(0, 0, 0, 0));
+		ImGui::PushItemWidth(glm::max(node_width, ImGui::CalcTextSize(currentValue.m_name).x + 10.0f));
+		// typed in place so the node follows along, the whole edit goes in the history once it's done
+		if (ImGui::InputText("##input", currentValue.m_name, 128))
+			plan_dirty = true;
+		if (ImGui::IsItemActivated())
+			name_before_edit = currentValue.m_name;
+		if (ImGui::IsItemDeactivatedAfterEdit()) {
+			EditOperation op = EditOperation::set_name(i, currentValue.m_name);
+			snprintf(currentValue.m_name, 128, "%s", name_before_edit.c_str());
+			apply_operation(op);
+		}
+		ImGui::PopItemWidth();
+		ImGui::PopStyleColor();
+	}
+		break;
 	case Operation::DataSource:
 		ImGui::TextUnformatted("data");
 		break;
 	default:
+		if (is_plugin_operation(currentValue.m_operation)) {
+			ImGui::TextUnformatted(PluginRegistry::shared().op(currentValue.m_operation).name.c_str());
+			break;
+		}
 		IM_ASSERT(0 && "Missing title for operation type");
 		break;
 	}
@@ -1047,8 +1766,21 @@ void ComputationGraph::show_node(Index i, vector<Function>& functions) {
 		char text[128];
 		sprintf(text, "%.3f", currentValue.m_value);
 		ImGui::Text(text);
+		if (sensitivity_parameter != NULL_INDEX && i < sensitivities.size()) {
+			ImGui::PushStyleColor(ImGuiCol_Text, IM_COL32(0xc8, 0x6a, 0xc0, 255));
+			ImGui::Text("d/d%s %.3f", values[sensitivity_parameter].m_name ? values[sensitivity_parameter].m_name : "param", sensitivities[i]);
+			ImGui::PopStyleColor();
+		}
 		ImGui::PopItemWidth();
 		ImNodes::EndInputAttribute();
+
+		if (currentValue.m_operation == Operation::Backwards) {
+			// the plan bakes the weights in, so a new weight means a new plan
+			ImGui::PushItemWidth(node_width);
+			if (ImGui::DragFloat("##weight", &currentValue.m_weight, 0.01f, 0.f, 100.f, "x%.2f"))
+				plan_dirty = true;
+			ImGui::PopItemWidth();
+		}
 	}
 	break;
 	case Operation::Add:
@@ -1056,6 +1788,9 @@ void ComputationGraph::show_node(Index i, vector<Function>& functions) {
 	case Operation::Divide:
 	case Operation::Multiply:
 	case Operation::Power:
+	case Operation::MeanSquaredError:
+	case Operation::Hinge:
+	case Operation::Logistic:
 	{
 		for (int input = 0; input < 2; input++) {
 			ImNodes::BeginInputAttribute(attribute_index + input);
@@ -1080,11 +1815,46 @@ void ComputationGraph::show_node(Index i, vector<Function>& functions) {
 		ImNodes::EndOutputAttribute();
 	}
 	break;
+	case Operation::SoftmaxCrossEntropy:
+	{
+		// the label, then the logits with always one free pin to connect the next one to
+		int num_pins = 3;
+		for (int input = 1; input < MAX_INPUTS; input++) {
+			if (currentValue.m_inputs[input].node != NULL_INDEX)
+				num_pins = ImMax(num_pins, input + 2);
+		}
+		num_pins = ImMin(num_pins, MAX_INPUTS);
+
+		for (int input = 0; input < num_pins; input++) {
+			ImNodes::BeginInputAttribute(attribute_index + input);
+			if (input == 0) {
+				ImGui::TextUnformatted("label");
+			}
+			else {
+				ImGui::Text("%i", input - 1);
+			}
+			ImNodes::EndInputAttribute();
+		}
+
+		ImNodes::BeginOutputAttribute(attribute_index + MAX_INPUTS);
+		{
+			char text[128];
+			sprintf(text, "%.3f", currentValue.m_value);
+			const float label_width = ImGui::CalcTextSize(text).x;
+			ImGui::Indent(node_width - label_width);
+			ImGui::Text(text);
+		}
+		ImNodes::EndOutputAttribute();
+	}
+	break;
 	case Operation::Tanh:
 	case Operation::ReLU:
 	case Operation::Sin:
 	case Operation::Cos:
 	case Operation::Sqrt:
+	case Operation::Log:
+	case Operation::Step:
+	case Operation::Delay:
 	{
 		ImNodes::BeginInputAttribute(attribute_index);
 		{
@@ -1149,7 +1919,60 @@ void ComputationGraph::show_node(Index i, vector<Function>& functions) {
 		data_source.show_body(attribute_index + MAX_INPUTS, 100.f);
 	}	
 	break;
+	case Operation::Expression:
+	{
+		// a pin per name in the formula, plus any still connected from before an edit
+		const Expression& expression = Expression::cached(currentValue.m_name ? currentValue.m_name : "");
+		unsigned num_pins = expression.num_inputs();
+		for (unsigned input = num_pins; input < MAX_INPUTS; input++) {
+			if (currentValue.m_inputs[input].node != NULL_INDEX)
+				num_pins = input + 1;
+		}
+		for (unsigned input = 0; input < num_pins; input++) {
+			ImNodes::BeginInputAttribute(attribute_index + input);
+			if (input < expression.num_inputs())
+				ImGui::TextUnformatted(expression.m_inputs[input].c_str());
+			else
+				ImGui::TextDisabled("unused");
+			ImNodes::EndInputAttribute();
+		}
+
+		ImNodes::BeginOutputAttribute(attribute_index + MAX_INPUTS);
+		{
+			char text[128];
+			sprintf(text, "%.3f", currentValue.m_value);
+			const float label_width = ImGui::CalcTextSize(text).x;
+			ImGui::Indent(node_width - label_width);
+			ImGui::Text(text);
+		}
+		if (!expression.m_error.empty())
+			ImGui::TextDisabled("%s", expression.m_error.c_str());
+		ImNodes::EndOutputAttribute();
+	}
+	break;
 	default:
+		if (is_plugin_operation(currentValue.m_operation)) {
+			// a pin per input the plugin asked for, ops whose plugin isn't loaded have none
+			const PluginOp& plugin = PluginRegistry::shared().op(currentValue.m_operation);
+			for (unsigned input = 0; input < plugin.num_inputs; input++) {
+				ImNodes::BeginInputAttribute(attribute_index + input);
+				ImGui::Text("%u", input);
+				ImNodes::EndInputAttribute();
+			}
+
+			ImNodes::BeginOutputAttribute(attribute_index + MAX_INPUTS);
+			{
+				char text[128];
+				sprintf(text, "%.3f", currentValue.m_value);
+				const float label_width = ImGui::CalcTextSize(text).x;
+				ImGui::Indent(node_width - label_width);
+				ImGui::Text(text);
+			}
+			if (plugin.forward == nullptr)
+				ImGui::TextDisabled("not loaded");
+			ImNodes::EndOutputAttribute();
+			break;
+		}
 		IM_ASSERT(0 && "Missing body for operation type");
 		break;
 	}
@@ -1259,6 +2082,9 @@ void ComputationGraph::create_connection(Connection link) {
 	connection.end.node   = patched_end_node; 
 	connection.end.slot   = patched_end_slot;
 
+	if (patched_start_node == NULL_INDEX || patched_end_node == NULL_INDEX)
+		return;
+
 	apply_operation(EditOperation::add_connection(connection, patched_end_node));
 }
 
@@ -1269,6 +2095,12 @@ void ComputationGraph::update() {
 
 	if (current_backwards_node != NULL_INDEX)
 		backwards(&data_source.data[data_source.current_data_point].x);
+
+	// the values are still those of the forwards pass above
+	if (sensitivity_parameter != NULL_INDEX && sensitivity_parameter < plan.node_register.size()) {
+		plan.forwards_tangents(plan.node_register[sensitivity_parameter]);
+		plan.store_tangents(*this);
+	}
 }
 
 void ComputationGraph::show(const int editor_id, bool* open, std::vector<Function>& functions, const char* name) {
@@ -1382,6 +2214,8 @@ void ComputationGraph::show(const int editor_id, bool* open, std::vector<Functio
 
 			bool nodes_selected = num_nodes_selected > 0;
 			bool node_hovered = ImNodes::IsNodeHovered(&last_node_hovered);
+			sensitivity_parameter = node_hovered && last_node_hovered >= 0 && last_node_hovered < (int)next_free_index &&
+				used[last_node_hovered] && values[last_node_hovered].m_operation == Operation::Parameter ? (Index)last_node_hovered : NULL_INDEX;
 			bool is_hovered_node_selected = false;
 
 			for (int i = 0; i < num_nodes_selected; ++i) {
@@ -1491,6 +2325,71 @@ void ComputationGraph::show(const int editor_id, bool* open, std::vector<Functio
 					EditOperation edit_operation = EditOperation::add_node(value);
 					apply_operation(edit_operation);
 				}
+				if (ImGui::MenuItem("Create Log")) {
+					Value value = Value();
+					value.m_operation = Operation::Log;
+					value.m_position = click_pos;
+					EditOperation edit_operation = EditOperation::add_node(value);
+					apply_operation(edit_operation);
+				}
+				if (ImGui::MenuItem("Create Step")) {
+					Value value = Value();
+					value.m_operation = Operation::Step;
+					value.m_position = click_pos;
+					EditOperation edit_operation = EditOperation::add_node(value);
+					apply_operation(edit_operation);
+				}
+				if (ImGui::MenuItem("Create Delay")) {
+					Value value = Value();
+					value.m_operation = Operation::Delay;
+					value.m_position = click_pos;
+					EditOperation edit_operation = EditOperation::add_node(value);
+					apply_operation(edit_operation);
+				}
+				if (ImGui::BeginItemTooltip()) {
+					ImGui::Text("Outputs its input from the previous data point, for recurrent graphs");
+					ImGui::EndTooltip();
+				}
+				if (ImGui::MenuItem("Create Expression")) {
+					Value value = Value();
+					value.m_operation = Operation::Expression;
+					value.m_name = (char*)malloc(128);
+					strcpy(value.m_name, "tanh(a*x + b)");
+					value.m_position = click_pos;
+					EditOperation edit_operation = EditOperation::add_node(value);
+					apply_operation(edit_operation);
+				}
+				if (ImGui::BeginItemTooltip()) {
+					ImGui::Text("A formula over named inputs, run as one node");
+					ImGui::EndTooltip();
+				}
+				if (ImGui::BeginMenu("Create Loss")) {
+					const Operation losses[] = { Operation::MeanSquaredError, Operation::Hinge, Operation::Logistic, Operation::SoftmaxCrossEntropy };
+					const char* names[] = { "Mean Squared Error", "Hinge", "Logistic", "Softmax Cross Entropy" };
+					for (int loss = 0; loss < IM_ARRAYSIZE(losses); loss++) {
+						if (ImGui::MenuItem(names[loss])) {
+							Value value = Value();
+							value.m_operation = losses[loss];
+							value.m_position = click_pos;
+							EditOperation edit_operation = EditOperation::add_node(value);
+							apply_operation(edit_operation);
+						}
+					}
+					ImGui::EndMenu();
+				}
+				const PluginRegistry& plugins = PluginRegistry::shared();
+				if (!plugins.ops().empty() && ImGui::BeginMenu("Create Plugin Op")) {
+					for (unsigned op = 0; op < plugins.ops().size(); op++) {
+						if (plugins.is_loaded(op) && ImGui::MenuItem(plugins.ops()[op].name.c_str())) {
+							Value value = Value();
+							value.m_operation = plugin_operation(op);
+							value.m_position = click_pos;
+							EditOperation edit_operation = EditOperation::add_node(value);
+							apply_operation(edit_operation);
+						}
+					}
+					ImGui::EndMenu();
+				}
 				if (ImGui::MenuItem("Create Data Source Node")) {
 					Value value = Value::make_data_source();
 					value.m_position = click_pos;
@@ -1559,6 +2458,16 @@ void ComputationGraph::show(const int editor_id, bool* open, std::vector<Functio
 					EditOperation op = EditOperation::remove_node(last_node_hovered);
 					apply_operation(op);
 				}
+				Operation hovered_operation = values[last_node_hovered].m_operation;
+				if (is_computed_operation(hovered_operation) && ImGui::MenuItem("Emit Gradient Graph")) {
+					// with respect to every parameter, the ones it doesn't depend on get a zero
+					vector<Index> parameters;
+					for (Index i = 0; i < next_free_index; i++) {
+						if (used[i] && values[i].m_operation == Operation::Parameter)
+							parameters.push_back(i);
+					}
+					nodes_to_select = emit_gradient_graph(last_node_hovered, parameters);
+				}
 
 				ImGui::EndPopup();
 			}
@@ -46,7 +46,20 @@ void Context::show_training_menu(bool* open) {
 					if (ImGui::Selectable(items[n], is_selected)) {
 						item_current_idx = n;
 
-						main_graph.data_source.load(items[n]);
+						// read off the main thread, swapped in on it
+						std::string filename = items[n];
+						auto data = std::make_shared<vector<DataPoint>>();
+						TaskHandle read = TaskPool::shared().submit([filename, data]() {
+							DataSource::read_csv(filename.c_str(), *data);
+						}, TaskPriority::Normal);
+						TaskPool::shared().submit_main_thread([this, data]() {
+							if (data->empty())
+								return;
+							main_graph.data_source.set_data(*data);
+							if (trainer.is_running()) {
+								trainer.submit_data(main_graph.data_source.data);
+							}
+						}, { read });
 					}
 
 					// Set the initial focus when opening the combo (scrolling + keyboard navigation focus)
@@ -57,6 +70,7 @@ void Context::show_training_menu(bool* open) {
 			}
 
 			if (ImGui::Button(ICON_FA_REFRESH)) {
+				// picked up as hand edits if training is running
 				main_graph.randomize_parameters();
 			}
 			if (ImGui::BeginItemTooltip()) {
@@ -70,6 +84,71 @@ void Context::show_training_menu(bool* open) {
 			ImGui::InputFloat("##learning_rate", &learning_rate, 0.001f);
 			ImGui::PopItemWidth();
 			ImGui::InputInt("##batch_size", &batch_size, 1);
+			// graphs with delays train on the points in order, backpropagating through this many at a time
+			if (main_graph.plan.has_state()) {
+				ImGui::SetNextItemWidth(120);
+				if (ImGui::InputInt("Window", &sequence_window, 1))
+					sequence_window = ImMax(sequence_window, 1);
+			}
+
+			const char* modes[] = { "Synchronous", "Hogwild", "Deterministic", "Pipeline", "L-BFGS", "Evolution" };
+			int mode = (int)training_mode;
+			ImGui::SetNextItemWidth(120);
+			if (ImGui::Combo("##training_mode", &mode, modes, IM_ARRAYSIZE(modes))) {
+				training_mode = (TrainingMode)mode;
+				// picked up when the trainer restarts next frame
+				trainer.stop();
+			}
+			// L-BFGS and evolution pick their own steps
+			if (training_mode != TrainingMode::LBFGS && training_mode != TrainingMode::Evolution) {
+				const char* optimizers[(int)OptimizerType::Count];
+				for (int type = 0; type < (int)OptimizerType::Count; type++) {
+					optimizers[type] = optimizer_name((OptimizerType)type);
+				}
+				int optimizer = (int)optimizer_type;
+				ImGui::SameLine();
+				ImGui::SetNextItemWidth(120);
+				if (ImGui::Combo("##optimizer", &optimizer, optimizers, IM_ARRAYSIZE(optimizers))) {
+					optimizer_type = (OptimizerType)optimizer;
+					// its state doesn't carry over to another kind of optimizer, start it fresh
+					trainer.stop();
+				}
+			}
+			// the modes that sum gradients over a whole batch in one place
+			if (training_mode == TrainingMode::Synchronous || training_mode == TrainingMode::Pipeline || main_graph.plan.has_state()) {
+				const char* precisions[(int)Precision::Count];
+				for (int precision = 0; precision < (int)Precision::Count; precision++) {
+					precisions[precision] = precision_name((Precision)precision);
+				}
+				int precision = (int)gradient_precision;
+				ImGui::SameLine();
+				ImGui::SetNextItemWidth(120);
+				if (ImGui::Combo("##precision", &precision, precisions, IM_ARRAYSIZE(precisions))) {
+					gradient_precision = (Precision)precision;
+					trainer.stop();
+				}
+				if (ImGui::BeginItemTooltip()) {
+					ImGui::Text("How the batch's gradients are summed");
+					ImGui::EndTooltip();
+				}
+			}
+			if (training_mode != TrainingMode::Synchronous) {
+				ImGui::SameLine();
+				ImGui::SetNextItemWidth(120);
+				if (ImGui::InputInt("Workers", &training_workers, 1)) {
+					training_workers = ImClamp(training_workers, 1, (int)ImMax(std::thread::hardware_concurrency(), 1u));
+					trainer.stop();
+				}
+			}
+			if (training_mode != TrainingMode::Pipeline) {
+				ImGui::SameLine();
+				if (ImGui::Checkbox("Checkpointing", &gradient_checkpointing))
+					trainer.stop();
+				if (ImGui::BeginItemTooltip()) {
+					ImGui::Text("Keep fewer activations and recompute the rest during the backwards pass");
+					ImGui::EndTooltip();
+				}
+			}
 
 			ImGui::SameLine();
 				
@@ -90,11 +169,6 @@ void Context::show_training_menu(bool* open) {
 				}
 			}
 			else if (ImGui::Button(ICON_FA_PLAY)) {
-				m_shuffled_data_points.clear();
-				for (int i = 0; i < main_graph.data_source.data.size(); i++) {
-					m_shuffled_data_points.push_back(i);
-				}
-				std::random_shuffle(m_shuffled_data_points.begin(), m_shuffled_data_points.end());
 				m_training = true;
 			}
 			ImGui::SameLine();
@@ -109,6 +183,12 @@ void Context::show_training_menu(bool* open) {
 			ImGui::Text("tps: %.3f", ((double)training_steps_this_interval/delta));
 			ImGui::SameLine();
 			ImGui::Text("Average Error: %.3f", current_average_error);
+			if (ImGui::InputInt("Target fps", &target_fps, 5)) {
+				target_fps = ImClamp(target_fps, 10, 240);
+			}
+			ImGui::Text("Frame: %.1f ms, trainer running %.0f%% of the time", frame_time * 1000.f, training_duty_cycle * 100.f);
+			if (trainer.m_unplanned_registers > 0)
+				ImGui::Text("Registers: %u, %u before memory planning", trainer.m_planned_registers, trainer.m_unplanned_registers);
 			tps_last_time = current_time;
 		}
 		ImGui::End();
@@ -135,44 +215,66 @@ void Context::create_function_graph(int function_id) {
 
 	ComputationGraph& function_graph = function_graphs[function_id];
 	Function& function = functions[function_id];
-	function_graph.clear();
-	function_graph.from_json(function.m_json, ImVec2());
-	
-	Index input_node_index = function_graph.get_new_value();
-	function_graph.values[input_node_index].m_operation = Operation::FunctionInput;
-
-	Index output_node_index = function_graph.get_new_value();
-	function_graph.values[output_node_index].m_operation = Operation::FunctionOutput;
-
-	int num_nodes = function.m_json["nodes"].size();
-
-	function_graph.values[input_node_index].m_variableNumConnections = 0;
-	for (int i = 0; i < function.m_json["unmatched_inputs"].size(); i++) {
-		function_graph.values[function.m_json["unmatched_inputs"][i]["end"]].m_inputs[function.m_json["unmatched_inputs"][i]["end_slot"]].node = input_node_index;
-		
-		function_graph.values[function.m_json["unmatched_inputs"][i]["end"]].m_inputs[function.m_json["unmatched_inputs"][i]["end_slot"]].slot = function_graph.values[input_node_index].m_variableNumConnections;
-
-		function_graph.values[input_node_index].m_variableNumConnections++;
+	const FunctionTemplate& function_template = function.m_template;
+	Index num_local = function_template.m_nodes.size();
 
+	// Nodes keep their local indices, so edits made here line up with the instances' frames.
+	function_graph.clear();
+	function_graph.allocate_values(num_local + 2);
+	Index input_node_index = num_local;
+	Index output_node_index = num_local + 1;
+
+	vector<Value> new_values;
+	vector<std::string> new_names;
+	vector<FunctionNodeData> new_function_node_data;
+	for (Index local = 0; local < num_local; local++) {
+		if (function_template.m_nodes[local].m_index == NULL_INDEX)
+			continue;
+		Value value = function_template.m_nodes[local];
+		value.m_position = function_template.m_offsets[local];
+		new_values.push_back(value);
+		new_names.push_back(function_template.m_names[local]);
+		new_function_node_data.push_back(function_template.m_function_node_data[local]);
 	}
 
-	/*for (auto& node : function.m_json["nodes"]) {
-		for (int i = 0; i < node["inputs"].size(); i++) {
-			if (node["inputs"][i]["index"] >= num_nodes) {
-				Socket& input = function_graph.values[node["index"]].m_inputs[i];
-				input.node = input_node_index;
-				input.slot = node["inputs"][i]["index"] - num_nodes;
-				function_graph.values[input_node_index].m_variableNumConnections++;
+	Value input_value = Value::make_value();
+	input_value.m_index = input_node_index;
+	input_value.m_operation = Operation::FunctionInput;
+	input_value.m_variableNumConnections = function_template.m_input_nodes.size();
+	new_values.push_back(input_value);
+	new_names.emplace_back();
+	new_function_node_data.emplace_back();
+
+	Value output_value = Value::make_value();
+	output_value.m_index = output_node_index;
+	output_value.m_operation = Operation::FunctionOutput;
+	output_value.m_variableNumConnections = function_template.m_output_nodes.size();
+	for (Index q = 0; q < function_template.m_output_nodes.size(); q++) {
+		output_value.m_inputs[q] = function_template.m_output_nodes[q];
+	}
+	new_values.push_back(output_value);
+	new_names.emplace_back();
+	new_function_node_data.emplace_back();
+
+	for (Index p = 0; p < function_template.m_input_nodes.size(); p++) {
+		const Socket& pin = function_template.m_input_nodes[p];
+		if (pin.node == NULL_INDEX)
+			continue;
+		for (Value& value : new_values) {
+			if (value.m_index == pin.node) {
+				value.m_inputs[pin.slot] = Socket(input_node_index, p);
 			}
 		}
-	}*/
+	}
 
-	function_graph.values[output_node_index].m_variableNumConnections = 0;
+	EditOperation op = EditOperation::add_nodes(new_values, new_names, new_function_node_data);
+	function_graph.apply_operation(op);
 
-	for (int i = 0; i < function.m_json["unmatched_outputs"].size(); i++) {
-		function_graph.values[output_node_index].m_inputs[i].node = functions[function_id].m_json["unmatched_outputs"][i]["start"];
-		function_graph.values[output_node_index].m_variableNumConnections++;
-	}
+	// Opening the window isn't an edit of the function, start recording from here
+	function_graph.edit_operations.clear();
+	function_graph.current_operation = 0;
+	function_graph.recorded_edits.clear();
+	function_graph.record_edits = true;
 
 	ImVec2 average_pos{0.f, 0.f};
 	int num_pos_nodes = 0;
@@ -194,34 +296,128 @@ void Context::create_function_graph(int function_id) {
 	function_graph.values[output_node_index].m_position = ImVec2(max_x + 200.f, average_pos.y);
 }
 
+// Replays what was edited in a function's window on every instance of it in the main graph,
+// then regenerates the function's json so new instances match.
+void Context::propagate_function_edits(int function_id) {
+	ComputationGraph& function_graph = function_graphs[function_id];
+	if (function_graph.recorded_edits.empty())
+		return;
+
+	Function& function = functions[function_id];
+	// older files don't have frames, those instances don't get edits propagated to them
+	vector<Index> instances;
+	vector<vector<Socket>> input_feeds;
+	for (Index i = 0; i < main_graph.next_free_index; i++) {
+		if (!main_graph.used[i] || main_graph.values[i].m_operation != Operation::Function)
+			continue;
+		const FunctionNodeData& data = main_graph.function_node_data[i];
+		if (data.m_function_id != function.m_id || data.m_frame.empty())
+			continue;
+		vector<Socket> feeds;
+		for (const Socket& pin : data.m_function_input_nodes) {
+			feeds.push_back(pin.node == NULL_INDEX ? Socket() : main_graph.values[pin.node].m_inputs[pin.slot]);
+		}
+		instances.push_back(i);
+		input_feeds.push_back(feeds);
+	}
+
+	// All of it goes through the main graph's history, one undo there takes back the lot
+	vector<FunctionNodeData> instance_data;
+	for (Index i = 0; i < instances.size(); i++) {
+		instance_data.push_back(main_graph.function_node_data[instances[i]]);
+		for (const EditOperation& edit : function_graph.recorded_edits) {
+			main_graph.apply_function_edit(instances[i], instance_data[i], edit, function_graph, input_feeds[i]);
+		}
+	}
+	function_graph.recorded_edits.clear();
+
+	function.m_json = function_graph.to_function_json();
+	function.m_template.from_json(function.m_json);
+	for (Index i = 0; i < instances.size(); i++) {
+		main_graph.rebind_function_pins(instances[i], instance_data[i], function.m_template, input_feeds[i]);
+		EditOperation op = EditOperation::set_function_data(instances[i], instance_data[i], i + 1 == instances.size());
+		main_graph.apply_operation(op);
+	}
+	for (Index i = 0; i < function_graph.next_free_index; i++) {
+		if (!function_graph.used[i])
+			continue;
+		if (function_graph.values[i].m_operation == Operation::FunctionInput)
+			function.m_num_inputs = function_graph.values[i].m_variableNumConnections;
+		else if (function_graph.values[i].m_operation == Operation::FunctionOutput)
+			function.m_num_outputs = function_graph.values[i].m_variableNumConnections;
+	}
+}
+
+void Context::pace_training() {
+	float delta_time = ImGui::GetIO().DeltaTime;
+	frame_time = frame_time <= 0.f ? delta_time : frame_time * 0.9f + delta_time * 0.1f;
+
+	// multiplicative decrease, additive increase, so it settles just under the target
+	if (frame_time > 1.f / (float)target_fps)
+		training_duty_cycle = ImMax(training_duty_cycle * 0.9f, 0.05f);
+	else
+		training_duty_cycle = ImMin(training_duty_cycle + 0.01f, 1.f);
+	trainer.m_duty_cycle = training_duty_cycle;
+}
+
 void Context::show(bool* open) {
+	TaskPool::shared().run_main_thread_tasks();
+	pace_training();
 	training_steps_this_interval = 0;
 
 	if (m_training && main_graph.current_backwards_node != NULL_INDEX) {
-		double startTime = glfwGetTime();
-		Index data_source_index = NULL_INDEX;
-		for (int i = 0; i < MAX_NODES; i++) {
-			if (main_graph.values[i].m_operation == Operation::DataSource) {
-				data_source_index = i;
-				break;
+		// Training happens on the trainer's thread, edits get sent over without stopping it
+		main_graph.compile_plan();
+		trainer.m_mode = training_mode;
+		trainer.m_num_workers = training_workers;
+		trainer.m_optimizer_type = optimizer_type;
+		trainer.m_checkpointing = gradient_checkpointing;
+		trainer.m_precision = gradient_precision;
+		if (!trainer.is_running()) {
+			trainer.start(main_graph, training_steps, current_average_error);
+			trained_plan_version = main_graph.plan_version;
+		}
+		else if (trained_plan_version != main_graph.plan_version) {
+			if (!trainer.submit_plan(main_graph)) {
+				trainer.start(main_graph, training_steps, current_average_error);
 			}
+			trained_plan_version = main_graph.plan_version;
+		}
+		trainer.m_learning_rate = learning_rate;
+		trainer.m_batch_size = batch_size;
+		trainer.m_sequence_window = sequence_window;
+
+		// Parameters that don't match what was last shown were changed by hand
+		const vector<Index>& parameters = main_graph.plan.parameters;
+		vector<Index> edited_nodes;
+		vector<float> edited_values;
+		if (training_snapshot.m_plan_version == main_graph.plan_version) {
+			for (size_t p = 0; p < training_snapshot.m_num_parameters && p < parameters.size(); p++) {
+				if (main_graph.values[parameters[p]].m_value != training_snapshot.m_parameters[p]) {
+					edited_nodes.push_back(parameters[p]);
+					edited_values.push_back(main_graph.values[parameters[p]].m_value);
+					// sent once, later frames go back to reading snapshots
+					training_snapshot.m_parameters[p] = main_graph.values[parameters[p]].m_value;
+				}
+			}
+		}
+		if (!edited_nodes.empty()) {
+			trainer.submit_parameters(edited_nodes, edited_values);
 		}
 
-
-		while (glfwGetTime() - startTime < (1.0f/60.f)) {
-			//main_graph.do_stochastic_gradient_descent_step(learning_rate);
-			main_graph.do_stochastic_gradient_descent(learning_rate, batch_size, m_current_shuffled_data_point, m_shuffled_data_points);
-
-			if (current_average_error <= 0.0f)
-				current_average_error = main_graph.values[main_graph.current_backwards_node].m_value;
-			else
-				current_average_error = main_graph.values[main_graph.current_backwards_node].m_value * 0.001f + current_average_error * 0.999f;
-			
-			training_steps += batch_size;
-			training_steps_this_interval += batch_size;
+		if (edited_nodes.empty() && trainer.read_snapshot(training_snapshot) && training_snapshot.m_plan_version == main_graph.plan_version) {
+			for (size_t p = 0; p < training_snapshot.m_num_parameters && p < parameters.size(); p++) {
+				main_graph.values[parameters[p]].m_value = training_snapshot.m_parameters[p];
+			}
+			current_average_error = training_snapshot.m_average_error;
+			training_steps_this_interval = ImMax(training_snapshot.m_steps - training_steps, 0);
+			training_steps = training_snapshot.m_steps;
 		}
 		main_graph.data_source.update_image(&main_graph);
 	}
+	else if (trainer.is_running()) {
+		trainer.stop();
+	}
 
 	main_graph.update();
 	main_graph.show(0, open, functions, "main graph");
@@ -233,13 +429,10 @@ void Context::show(bool* open) {
 			char name[128];
 			sprintf(name, "Function ID %i", function_id);
 			function_graphs[function_id].show(function_id+1, &functions[function_id].m_is_open, functions, name);
+			propagate_function_edits(function_id);
 		}
-		else {
-			if (function_graphs.find(function_id) != function_graphs.end()) {
-				function_graphs[function_id].clear();
-				function_graphs.erase(function_id);
-			}
-		}
+		// Closed function graphs stay in function_graphs, they only hold the function's body
+		// so keeping them around is cheap and reopening the window doesn't re-parse the json.
 	}
 }
 
@@ -262,43 +455,61 @@ void Context::save(const char* filename) {
 	}
 	save_json["functions"] = functions_json;
 
-	FILE* save_file = fopen(filename, "w");
-	std::string dump = save_json.dump(4);
-	fwrite(dump.c_str(), 1, dump.size(), save_file);
-	fclose(save_file);
+	// the json is a copy, dumping and writing it can happen off the main thread
+	std::string path = filename;
+	auto shared_json = std::make_shared<json>(std::move(save_json));
+	TaskPool::shared().submit([path, shared_json]() {
+		FILE* save_file = fopen(path.c_str(), "w");
+		if (!save_file)
+			return;
+		std::string dump = shared_json->dump(4);
+		fwrite(dump.c_str(), 1, dump.size(), save_file);
+		fclose(save_file);
+	}, TaskPriority::Normal);
 }
 
 void Context::load(const char* filename) {
-	//ImNodes::BeginNodeEditor(0);
-	json content = json();
-	FILE* save_file = fopen(filename, "rb");
-
-	if (save_file) {
+	// read and parsed on a worker, the graph gets replaced on the main thread
+	std::string path = filename;
+	auto content = std::make_shared<json>();
+	TaskHandle read = TaskPool::shared().submit([path, content]() {
+		FILE* save_file = fopen(path.c_str(), "rb");
+		if (!save_file)
+			return;
 		fseek(save_file, 0, SEEK_END);
 		long size = ftell(save_file);
+		std::string buffer;
 		if (size != -1L) {
 			fseek(save_file, 0, SEEK_SET);
-			char* buffer = new char[size + 1];
-			fread(buffer, 1, (size_t)size, save_file);
-			buffer[size] = 0;
-			fclose(save_file);
-			content = json::parse(buffer);
-			delete[] buffer;
-			clear();
+			buffer.resize((size_t)size);
+			buffer.resize(fread(&buffer[0], 1, buffer.size(), save_file));
 		}
-		else {
-			return;
+		fclose(save_file);
+		// a file that doesn't parse leaves content null, nothing gets loaded
+		try {
+			*content = json::parse(buffer);
 		}
-	}
-	else {
-		return;
-	}
+		catch (const json::exception& e) {
+			printf("Couldn't load %s: %s\n", path.c_str(), e.what());
+		}
+	}, TaskPriority::Normal);
+
+	TaskPool::shared().submit_main_thread([this, content]() {
+		if (!content->is_null()) {
+			apply_loaded(*content);
+		}
+	}, { read });
+}
 
+void Context::apply_loaded(const json& content) {
+	clear();
 	main_graph.from_json(content["main_graph"], ImVec2());
 
+	function_graphs.clear();
 	for (int i = 0; i < content["functions"].size(); i++) {
 		Function function;
 		function.m_json = content["functions"][i]["json"];
+		function.m_template.from_json(function.m_json);
 		function.m_is_open = false;
 		function.m_num_inputs = content["functions"][i]["num_inputs"];
 		function.m_num_outputs = content["functions"][i]["num_outputs"];
@@ -1,5 +1,15 @@
 #include "edit_operation.h"
 #include "computation_graph.h"
+
+static void write_name(Value& value, const std::string& name) {
+	if (value.m_name == nullptr) {
+		if (name.empty())
+			return;
+		value.m_name = (char*)malloc(128);
+	}
+	snprintf(value.m_name, 128, "%s", name.c_str());
+}
+
 void EditOperation::apply(ComputationGraph* context) {
 	switch (m_type) {
 	case EditOperationType::AddNode:
@@ -19,18 +29,46 @@ void EditOperation::apply(ComputationGraph* context) {
 		m_index = index;
 	}
 	break;
+	case EditOperationType::AddNodes:
+		for (size_t i = 0; i < m_values.size(); i++) {
+			const Value& value = m_values[i];
+			context->values[value.m_index] = value;
+			context->used[value.m_index] = true;
+			// a fresh copy every time, deleting the node frees it and a redo needs another
+			if (!m_names[i].empty()) {
+				char* name = (char*)malloc(128);
+				snprintf(name, 128, "%s", m_names[i].c_str());
+				context->values[value.m_index].m_name = name;
+			}
+			if (value.m_operation == Operation::Function && i < m_function_node_data.size()) {
+				context->function_node_data[value.m_index] = m_function_node_data[i];
+			}
+			if (value.m_operation == Operation::Backwards) {
+				context->current_backwards_node = value.m_index;
+			}
+			if (value.m_operation == Operation::Result) {
+				context->current_result_node = value.m_index;
+			}
+		}
+		break;
 	case EditOperationType::RemoveNode:
 		m_value = context->values[m_index];
-		if (context->values[m_index].m_operation == Operation::Backwards) {
-			context->current_backwards_node = NULL_INDEX;
-		}
 		if (context->values[m_index].m_operation == Operation::Result) {
 			context->current_result_node = NULL_INDEX;
 		}
 		context->values[m_index] = Value();
 		context->used[m_index] = false;
+		if (context->current_backwards_node == m_index) {
+			// training carries on from any other backwards node that's left
+			context->current_backwards_node = NULL_INDEX;
+			for (Index i = 0; i < context->next_free_index; i++) {
+				if (context->used[i] && context->values[i].m_operation == Operation::Backwards)
+					context->current_backwards_node = i;
+			}
+		}
 		break;
 	case EditOperationType::AddLink:
+		m_previous_start = context->values[m_index].m_inputs[m_connection.end.slot];
 		context->values[m_index].m_inputs[m_connection.end.slot] = m_connection.start;
 		break;
 	case EditOperationType::RemoveLink:
@@ -39,6 +77,14 @@ void EditOperation::apply(ComputationGraph* context) {
 	case EditOperationType::MoveNodes:
 		context->values[m_index].m_position += m_pos_delta;
 		break;
+	case EditOperationType::SetFunctionData:
+		m_function_node_data[1] = context->function_node_data[m_index];
+		context->function_node_data[m_index] = m_function_node_data[0];
+		break;
+	case EditOperationType::SetName:
+		m_names[1] = context->values[m_index].m_name ? context->values[m_index].m_name : "";
+		write_name(context->values[m_index], m_names[0]);
+		break;
 	default:
 		break;
 	}
@@ -48,6 +94,30 @@ void EditOperation::undo(ComputationGraph* context) {
 	switch (m_type) {
 	case EditOperationType::AddNode:
 		context->values[m_index] = Value();
+		context->used[m_index] = false;
+		break;
+	case EditOperationType::AddNodes:
+		for (const Value& value : m_values) {
+			if (context->values[value.m_index].m_operation == Operation::Result) {
+				context->current_result_node = NULL_INDEX;
+			}
+			if (value.m_operation == Operation::Function) {
+				context->function_node_data[value.m_index] = FunctionNodeData();
+			}
+			free(context->values[value.m_index].m_name);
+			context->values[value.m_index] = Value();
+			context->used[value.m_index] = false;
+		}
+		for (const Value& value : m_values) {
+			if (context->current_backwards_node == value.m_index) {
+				// same as removing it, training carries on from any other backwards node
+				context->current_backwards_node = NULL_INDEX;
+				for (Index i = 0; i < context->next_free_index; i++) {
+					if (context->used[i] && context->values[i].m_operation == Operation::Backwards)
+						context->current_backwards_node = i;
+				}
+			}
+		}
 		break;
 	case EditOperationType::RemoveNode:
 	{
@@ -59,7 +129,7 @@ void EditOperation::undo(ComputationGraph* context) {
 	}
 	break;
 	case EditOperationType::AddLink:
-		context->values[m_index].m_inputs[m_connection.end.node] = Socket();
+		context->values[m_index].m_inputs[m_connection.end.slot] = m_previous_start;
 		break;
 	case EditOperationType::RemoveLink:
 		context->values[m_index].m_inputs[m_connection.end.slot] = m_connection.start;
@@ -68,9 +138,52 @@ void EditOperation::undo(ComputationGraph* context) {
 		context->values[m_index].m_position -= m_pos_delta;
 		context->values[m_index].m_positionDirty = true;
 		break;
+	case EditOperationType::SetFunctionData:
+		context->function_node_data[m_index] = m_function_node_data[1];
+		break;
+	case EditOperationType::SetName:
+		write_name(context->values[m_index], m_names[1]);
+		break;
 	}
 }
 
+// The operation that undoes this one. AddNodes has no single inverse and is returned unchanged.
+EditOperation EditOperation::inverse() const {
+	EditOperation op = *this;
+	switch (m_type) {
+	case EditOperationType::AddNode:
+		op.m_type = EditOperationType::RemoveNode;
+		break;
+	case EditOperationType::RemoveNode:
+		op.m_type = EditOperationType::AddNode;
+		op.m_value.m_index = m_index;
+		break;
+	case EditOperationType::AddLink:
+		if (m_previous_start.node == NULL_INDEX) {
+			op.m_type = EditOperationType::RemoveLink;
+		}
+		else {
+			op.m_connection.start = m_previous_start;
+		}
+		break;
+	case EditOperationType::RemoveLink:
+		op.m_type = EditOperationType::AddLink;
+		break;
+	case EditOperationType::MoveNodes:
+		op.m_pos_delta = ImVec2(-m_pos_delta.x, -m_pos_delta.y);
+		break;
+	case EditOperationType::SetFunctionData:
+		std::swap(op.m_function_node_data[0], op.m_function_node_data[1]);
+		break;
+	case EditOperationType::SetName:
+		std::swap(op.m_names[0], op.m_names[1]);
+		break;
+	default:
+		break;
+	}
+	return op;
+}
+
 EditOperation EditOperation::add_node(const Value& value, const bool _final) {
 	EditOperation op;
 	op.m_type = EditOperationType::AddNode;
@@ -79,6 +192,22 @@ EditOperation EditOperation::add_node(const Value& value, const bool _final) {
 	return op;
 }
 
+EditOperation EditOperation::add_nodes(const vector<Value>& values, const vector<std::string>& names,
+	const vector<FunctionNodeData>& function_node_data, const bool _final) {
+	IM_ASSERT(names.size() == values.size());
+	EditOperation op;
+	op.m_type = EditOperationType::AddNodes;
+	op.m_values = values;
+	op.m_names = names;
+	op.m_function_node_data = function_node_data;
+	// the names are only kept as strings, a pointer here would be shared with the graph
+	for (Value& value : op.m_values) {
+		value.m_name = nullptr;
+	}
+	op.m_final = _final;
+	return op;
+}
+
 EditOperation EditOperation::remove_node(const Index index, const bool _final) {
 	EditOperation op;
 	op.m_type = EditOperationType::RemoveNode;
@@ -114,3 +243,21 @@ EditOperation EditOperation::move_node(const Index index, const ImVec2& delta, c
 	op.m_final = _final;
 	return op;
 }
+
+EditOperation EditOperation::set_function_data(const Index index, const FunctionNodeData& data, const bool _final) {
+	EditOperation op;
+	op.m_type = EditOperationType::SetFunctionData;
+	op.m_index = index;
+	op.m_function_node_data = { data, FunctionNodeData() };
+	op.m_final = _final;
+	return op;
+}
+
+EditOperation EditOperation::set_name(const Index index, const char* name, const bool _final) {
+	EditOperation op;
+	op.m_type = EditOperationType::SetName;
+	op.m_index = index;
+	op.m_names = { name, "" };
+	op.m_final = _final;
+	return op;
+}
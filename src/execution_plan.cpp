@@ -0,0 +1,1512 @@
+#include "execution_plan.h"
+#include "computation_graph.h"
+#include "task_pool.h"
+#include "optimizer.h"
+#include "plugin_ops.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+static bool is_function_member(const ComputationGraph& graph, Index i) {
+	Index parent = graph.values[i].m_parent;
+	return parent != NULL_INDEX && parent < graph.next_free_index && graph.used[parent] &&
+		graph.values[parent].m_operation == Operation::Function;
+}
+
+void ExecutionPlan::compile(const ComputationGraph& graph) {
+	*this = ExecutionPlan();
+	plugin_ops = PluginRegistry::shared().ops();
+
+	const Index num_nodes = graph.next_free_index;
+	node_register.assign(num_nodes, NULL_INDEX);
+
+	// Function instances whose body only has plain operations are run as calls,
+	// anything else (nested functions, data sources) is inlined node by node.
+	map<Index, vector<Index>> members;
+	for (Index i = 0; i < num_nodes; i++) {
+		if (graph.used[i] && is_function_member(graph, i)) {
+			members[graph.values[i].m_parent].push_back(i);
+		}
+	}
+
+	vector<Index> instance_of(num_nodes, NULL_INDEX);
+	for (auto& it : members) {
+		bool callable = true;
+		for (Index member : it.second) {
+			Operation op = graph.values[member].m_operation;
+			callable &= (is_computed_operation(op) && !is_variadic_operation(op)) || op == Operation::Parameter || op == Operation::Constant;
+		}
+		if (callable) {
+			for (Index member : it.second) {
+				instance_of[member] = it.first;
+			}
+		}
+	}
+
+	auto unit_of = [&](Index i) {
+		return instance_of[i] != NULL_INDEX ? instance_of[i] : i;
+	};
+
+	auto is_input_used = [&](const Socket& socket) {
+		return socket.node != NULL_INDEX && socket.node < num_nodes && graph.used[socket.node];
+	};
+
+	// A delay reads its input a step later, so that's not an edge of the schedule and
+	// recurrent loops through a delay don't count as cycles
+	auto is_edge = [&](Index i, const Socket& input) {
+		return is_input_used(input) && graph.values[i].m_operation != Operation::Delay;
+	};
+
+	// Schedule units (plain nodes and whole instances) level by level. An instance that
+	// feeds back into itself through outside nodes can't run as a single call, those get
+	// inlined and the schedule is redone.
+	vector<vector<Index>> levels;
+	bool reschedule = true;
+	while (reschedule) {
+		reschedule = false;
+		levels.clear();
+
+		vector<unsigned> num_consumers(num_nodes + 1, 0);
+		vector<unsigned> in_degree(num_nodes, 0);
+		for (Index i = 0; i < num_nodes; i++) {
+			if (!graph.used[i])
+				continue;
+			for (const Socket& input : graph.values[i].m_inputs) {
+				if (is_edge(i, input) && unit_of(input.node) != unit_of(i)) {
+					num_consumers[unit_of(input.node) + 1]++;
+					in_degree[unit_of(i)]++;
+				}
+			}
+		}
+		for (Index i = 0; i < num_nodes; i++) {
+			num_consumers[i + 1] += num_consumers[i];
+		}
+		vector<Index> consumers(num_consumers[num_nodes]);
+		vector<unsigned> fill(num_consumers.begin(), num_consumers.end() - 1);
+		for (Index i = 0; i < num_nodes; i++) {
+			if (!graph.used[i])
+				continue;
+			for (const Socket& input : graph.values[i].m_inputs) {
+				if (is_edge(i, input) && unit_of(input.node) != unit_of(i)) {
+					consumers[fill[unit_of(input.node)]++] = unit_of(i);
+				}
+			}
+		}
+
+		vector<Index> current;
+		for (Index i = 0; i < num_nodes; i++) {
+			if (graph.used[i] && unit_of(i) == i && in_degree[i] == 0) {
+				current.push_back(i);
+			}
+		}
+		while (!current.empty()) {
+			vector<Index> next;
+			for (Index unit : current) {
+				for (unsigned c = num_consumers[unit]; c < num_consumers[unit + 1]; c++) {
+					if (--in_degree[consumers[c]] == 0) {
+						next.push_back(consumers[c]);
+					}
+				}
+			}
+			levels.push_back(current);
+			current.swap(next);
+		}
+
+		for (auto& it : members) {
+			if (in_degree[it.first] > 0 && instance_of[it.second[0]] == it.first) {
+				for (Index member : it.second) {
+					instance_of[member] = NULL_INDEX;
+				}
+				reschedule = true;
+			}
+		}
+	}
+	// Whatever is left unscheduled is part of a cycle and doesn't get evaluated.
+
+	Register next_register = 0;
+	for (const auto& level : levels) {
+		for (Index unit : level) {
+			auto instance = members.find(unit);
+			if (instance != members.end() && instance_of[instance->second[0]] == unit) {
+				for (Index member : instance->second) {
+					node_register[member] = next_register++;
+				}
+			}
+			else if (graph.values[unit].m_operation == Operation::DataSource) {
+				node_register[unit] = next_register;
+				data_registers.push_back(next_register);
+				next_register += 3;
+			}
+			else if (graph.values[unit].m_operation != Operation::Function) {
+				node_register[unit] = next_register++;
+			}
+		}
+	}
+
+	for (Index i = 0; i < num_nodes; i++) {
+		if (node_register[i] == NULL_INDEX)
+			continue;
+		Operation op = graph.values[i].m_operation;
+		if (op == Operation::Parameter) {
+			parameters.push_back(i);
+			parameter_registers.push_back(node_register[i]);
+		}
+		else if (op == Operation::Constant || op == Operation::FunctionInput) {
+			constants.push_back(i);
+		}
+	}
+
+	auto socket_register = [&](const Socket& socket) -> Register {
+		if (!is_input_used(socket) || node_register[socket.node] == NULL_INDEX)
+			return NULL_INDEX;
+		if (graph.values[socket.node].m_operation == Operation::DataSource)
+			return node_register[socket.node] + socket.slot;
+		return node_register[socket.node];
+	};
+
+	for (Index i = 0; i < num_nodes; i++) {
+		if (node_register[i] != NULL_INDEX && graph.values[i].m_operation == Operation::Delay) {
+			delay_registers.push_back(node_register[i]);
+			delay_sources.push_back(socket_register(graph.values[i].m_inputs[0]));
+		}
+	}
+
+	// Only the ancestors of the backwards nodes take part in the backwards pass. Every
+	// backwards node is seeded with its weight, shared ancestors are only visited once.
+	vector<bool> needs_gradient(num_nodes, false);
+	vector<Index> stack;
+	for (Index backwards_node = 0; backwards_node < num_nodes; backwards_node++) {
+		if (!graph.used[backwards_node] || graph.values[backwards_node].m_operation != Operation::Backwards ||
+			node_register[backwards_node] == NULL_INDEX)
+			continue;
+		backwards_registers.push_back(node_register[backwards_node]);
+		backwards_weights.push_back(graph.values[backwards_node].m_weight);
+		if (!needs_gradient[backwards_node]) {
+			needs_gradient[backwards_node] = true;
+			stack.push_back(backwards_node);
+		}
+	}
+	while (!stack.empty()) {
+		Index i = stack.back();
+		stack.pop_back();
+		gradient_nodes.push_back(i);
+		for (const Socket& input : graph.values[i].m_inputs) {
+			if (is_input_used(input) && !needs_gradient[input.node] && node_register[input.node] != NULL_INDEX) {
+				needs_gradient[input.node] = true;
+				stack.push_back(input.node);
+			}
+		}
+	}
+
+	Index result_node = graph.current_result_node;
+	if (result_node != NULL_INDEX && result_node < num_nodes) {
+		result_register = node_register[result_node];
+	}
+
+	// Compiles an instance to frame relative code, reusing an existing body when another
+	// instance of the same function has the same structure.
+	auto compile_call = [&](Index function_node) {
+		const vector<Index>& body_members = members[function_node];
+		auto local_of = [&](Index i) -> unsigned {
+			auto it = std::lower_bound(body_members.begin(), body_members.end(), i);
+			return (it != body_members.end() && *it == i) ? (unsigned)(it - body_members.begin()) : NULL_INDEX;
+		};
+
+		vector<unsigned> local_in_degree(body_members.size(), 0);
+		vector<vector<unsigned>> local_consumers(body_members.size());
+		for (unsigned l = 0; l < body_members.size(); l++) {
+			for (const Socket& input : graph.values[body_members[l]].m_inputs) {
+				unsigned local = is_input_used(input) ? local_of(input.node) : NULL_INDEX;
+				if (local != NULL_INDEX) {
+					local_consumers[local].push_back(l);
+					local_in_degree[l]++;
+				}
+			}
+		}
+		vector<unsigned> order;
+		for (unsigned l = 0; l < body_members.size(); l++) {
+			if (local_in_degree[l] == 0)
+				order.push_back(l);
+		}
+		for (unsigned k = 0; k < order.size(); k++) {
+			for (unsigned consumer : local_consumers[order[k]]) {
+				if (--local_in_degree[consumer] == 0)
+					order.push_back(consumer);
+			}
+		}
+
+		FunctionBody body;
+		body.m_function_id = graph.function_node_data[function_node].m_function_id;
+		body.m_frame_size = body_members.size();
+
+		Call call;
+		call.frame = node_register[body_members[0]];
+		call.first_port = call_ports.size();
+
+		for (unsigned l : order) {
+			const Value& value = graph.values[body_members[l]];
+			if (!is_computed_operation(value.m_operation))
+				continue;
+			Instruction instruction;
+			instruction.op = value.m_operation;
+			instruction.out = l;
+			for (int k = 0; k < num_operation_inputs(value.m_operation); k++) {
+				unsigned local = is_input_used(value.m_inputs[k]) ? local_of(value.m_inputs[k].node) : NULL_INDEX;
+				if (local != NULL_INDEX) {
+					instruction.in[k] = local;
+				}
+				else {
+					instruction.in[k] = PORT_FLAG | body.m_num_ports++;
+					call_ports.push_back(socket_register(value.m_inputs[k]));
+				}
+			}
+			body.m_code.push_back(instruction);
+		}
+
+		unsigned body_index = 0;
+		for (; body_index < bodies.size(); body_index++) {
+			const FunctionBody& other = bodies[body_index];
+			if (other.m_function_id == body.m_function_id && other.m_frame_size == body.m_frame_size &&
+				other.m_num_ports == body.m_num_ports && other.m_code == body.m_code) {
+				break;
+			}
+		}
+		if (body_index == bodies.size()) {
+			bodies.push_back(body);
+		}
+		return std::make_pair(body_index, call);
+	};
+
+	const unsigned expression_key = (unsigned)plugin_ops.size() + 1;
+	auto run_key = [&](Index unit) {
+		Operation op = graph.values[unit].m_operation;
+		if (op == Operation::Expression)
+			return expression_key;
+		return is_plugin_operation(op) ? plugin_index(op) + 1 : 0;
+	};
+	auto formula = [&](Index unit) {
+		return graph.values[unit].m_name ? graph.values[unit].m_name : "";
+	};
+
+	for (vector<Index> level : levels) {
+		// a plugin op's nodes go next to each other, so its batched kernels get all of them at
+		// once, and so do expressions with the same formula
+		std::stable_sort(level.begin(), level.end(), [&](Index l, Index r) {
+			unsigned key_l = run_key(l);
+			unsigned key_r = run_key(r);
+			if (key_l != key_r)
+				return key_l < key_r;
+			return key_l == expression_key && strcmp(formula(l), formula(r)) < 0;
+		});
+		level_starts.push_back(code.size());
+		backwards_level_starts.push_back(backwards_code.size());
+		map<unsigned, vector<Call>> level_calls;
+		map<unsigned, bool> level_calls_need_gradient;
+		for (Index unit : level) {
+			auto instance = members.find(unit);
+			if (instance != members.end() && instance_of[instance->second[0]] == unit) {
+				auto body_and_call = compile_call(unit);
+				level_calls[body_and_call.first].push_back(body_and_call.second);
+				for (Index member : instance->second) {
+					level_calls_need_gradient[body_and_call.first] = level_calls_need_gradient[body_and_call.first] || needs_gradient[member];
+				}
+				continue;
+			}
+
+			const Value& value = graph.values[unit];
+			if (!is_computed_operation(value.m_operation))
+				continue;
+
+			Instruction instruction;
+			instruction.op = value.m_operation;
+			instruction.out = node_register[unit];
+			for (int k = 0; k < num_operation_inputs(value.m_operation); k++) {
+				instruction.in[k] = socket_register(value.m_inputs[k]);
+			}
+			if (value.m_operation == Operation::Expression) {
+				// input k is the formula's k-th name, connected or not
+				const char* formula = value.m_name ? value.m_name : "";
+				unsigned program = 0;
+				while (program < expressions.size() && expressions[program].m_formula != formula) {
+					program++;
+				}
+				if (program == expressions.size())
+					expressions.push_back(Expression::cached(formula));
+				instruction.in[0] = operands.size();
+				for (unsigned k = 0; k < expressions[program].num_inputs(); k++) {
+					operands.push_back(socket_register(value.m_inputs[k]));
+				}
+				instruction.in[1] = program;
+			}
+			else if (is_plugin_operation(value.m_operation)) {
+				// plugin ops take their inputs by position, connected or not
+				instruction.in[0] = operands.size();
+				for (unsigned k = 0; k < plugin_ops[plugin_index(value.m_operation)].num_inputs; k++) {
+					operands.push_back(socket_register(value.m_inputs[k]));
+				}
+				instruction.in[1] = operands.size() - instruction.in[0];
+			}
+			else if (is_variadic_operation(value.m_operation)) {
+				// the first input always gets a slot, later ones only when connected
+				instruction.in[0] = operands.size();
+				operands.push_back(socket_register(value.m_inputs[0]));
+				for (int k = 1; k < MAX_INPUTS; k++) {
+					Register operand = socket_register(value.m_inputs[k]);
+					if (operand != NULL_INDEX)
+						operands.push_back(operand);
+				}
+				instruction.in[1] = operands.size() - instruction.in[0];
+			}
+			if (needs_gradient[unit])
+				backwards_code.push_back(code.size());
+			code.push_back(instruction);
+		}
+
+		for (auto& it : level_calls) {
+			CallGroup group;
+			group.body = it.first;
+			group.first_call = calls.size();
+			group.num_calls = it.second.size();
+			calls.insert(calls.end(), it.second.begin(), it.second.end());
+
+			Instruction instruction;
+			instruction.op = Operation::Function;
+			instruction.in[0] = call_groups.size();
+			call_groups.push_back(group);
+			if (level_calls_need_gradient[it.first])
+				backwards_code.push_back(code.size());
+			code.push_back(instruction);
+		}
+	}
+
+	level_starts.push_back(code.size());
+	backwards_level_starts.push_back(backwards_code.size());
+
+	values.assign(next_register, 0.f);
+	gradients.assign(next_register, 0.f);
+	build_parallel_levels();
+}
+
+void ExecutionPlan::build_parallel_levels() {
+	const unsigned num_levels = level_starts.size() - 1;
+
+	auto instruction_work = [&](const Instruction& instruction) {
+		if (instruction.op != Operation::Function)
+			return 1u;
+		const CallGroup& group = call_groups[instruction.in[0]];
+		return group.num_calls * (unsigned)bodies[group.body].m_code.size();
+	};
+
+	// Splits the instructions at positions [begin, end) of a level into chunks, position
+	// maps to an index into code
+	auto split = [&](unsigned begin, unsigned end, const unsigned* positions, vector<LevelChunk>& chunks, bool with_scratch) {
+		unsigned work = 0;
+		for (unsigned position = begin; position < end; position++) {
+			work += instruction_work(code[positions ? positions[position] : position]);
+		}
+		if (work < PARALLEL_MIN_LEVEL_WORK)
+			return;
+		// variadic instructions have no fixed scratch layout, levels with one run sequentially
+		for (unsigned position = begin; position < end; position++) {
+			if (is_variadic_operation(code[positions ? positions[position] : position].op))
+				return;
+		}
+
+		unsigned scratch = gradients.size();
+		LevelChunk plain;
+		plain.begin = plain.end = begin;
+		auto flush = [&]() {
+			if (plain.end > plain.begin) {
+				plain.scratch = scratch;
+				if (with_scratch)
+					scratch += 2 * (plain.end - plain.begin);
+				chunks.push_back(plain);
+			}
+		};
+
+		for (unsigned position = begin; position < end; position++) {
+			const Instruction& instruction = code[positions ? positions[position] : position];
+			if (instruction.op != Operation::Function) {
+				if (plain.end == plain.begin)
+					plain.begin = position;
+				plain.end = position + 1;
+				if (plain.end - plain.begin >= PARALLEL_CHUNK_WORK) {
+					flush();
+					plain.begin = plain.end;
+				}
+				continue;
+			}
+
+			flush();
+			plain.begin = plain.end = position + 1;
+
+			const CallGroup& group = call_groups[instruction.in[0]];
+			const FunctionBody& body = bodies[group.body];
+			unsigned calls_per_chunk = ImMax(PARALLEL_CHUNK_WORK / ImMax((unsigned)body.m_code.size(), 1u), 1u);
+			for (unsigned first = 0; first < group.num_calls; first += calls_per_chunk) {
+				LevelChunk chunk;
+				chunk.group = instruction.in[0];
+				chunk.first_call = first;
+				chunk.num_calls = ImMin(calls_per_chunk, group.num_calls - first);
+				chunk.scratch = scratch;
+				if (with_scratch)
+					scratch += chunk.num_calls * body.m_num_ports;
+				chunks.push_back(chunk);
+			}
+		}
+		flush();
+
+		if (with_scratch)
+			gradients.resize(scratch, 0.f);
+	};
+
+	for (unsigned level = 0; level < num_levels; level++) {
+		forwards_chunk_starts.push_back(forwards_chunks.size());
+		split(level_starts[level], level_starts[level + 1], nullptr, forwards_chunks, false);
+	}
+	forwards_chunk_starts.push_back(forwards_chunks.size());
+
+	for (unsigned level = 0; level < num_levels; level++) {
+		backwards_chunk_starts.push_back(backwards_chunks.size());
+		reduce_target_starts.push_back(reduce_targets.size());
+		unsigned first_chunk = backwards_chunks.size();
+		split(backwards_level_starts[level], backwards_level_starts[level + 1], backwards_code.data(), backwards_chunks, true);
+
+		// which scratch slot goes to which register, kept in slot order so the sums always
+		// happen in the same order
+		vector<std::pair<Register, unsigned>> contributions;
+		for (unsigned c = first_chunk; c < backwards_chunks.size(); c++) {
+			const LevelChunk& chunk = backwards_chunks[c];
+			if (chunk.group == NULL_INDEX) {
+				for (unsigned position = chunk.begin; position < chunk.end; position++) {
+					const Instruction& instruction = code[backwards_code[position]];
+					for (int k = 0; k < 2; k++) {
+						if (instruction.in[k] != NULL_INDEX)
+							contributions.push_back(std::make_pair(instruction.in[k], chunk.scratch + 2 * (position - chunk.begin) + k));
+					}
+				}
+				continue;
+			}
+			const CallGroup& group = call_groups[chunk.group];
+			const FunctionBody& body = bodies[group.body];
+			for (unsigned c = 0; c < chunk.num_calls; c++) {
+				const Call& call = calls[group.first_call + chunk.first_call + c];
+				for (unsigned port = 0; port < body.m_num_ports; port++) {
+					Register target = call_ports[call.first_port + port];
+					if (target != NULL_INDEX)
+						contributions.push_back(std::make_pair(target, chunk.scratch + c * body.m_num_ports + port));
+				}
+			}
+		}
+		std::stable_sort(contributions.begin(), contributions.end(), [](const std::pair<Register, unsigned>& l, const std::pair<Register, unsigned>& r) {
+			return l.first < r.first;
+		});
+		for (size_t i = 0; i < contributions.size(); i++) {
+			if (i == 0 || contributions[i].first != contributions[i - 1].first) {
+				reduce_targets.push_back(contributions[i].first);
+				reduce_slot_starts.push_back(reduce_slots.size());
+			}
+			reduce_slots.push_back(contributions[i].second);
+		}
+	}
+	backwards_chunk_starts.push_back(backwards_chunks.size());
+	reduce_target_starts.push_back(reduce_targets.size());
+	reduce_slot_starts.push_back(reduce_slots.size());
+}
+
+void ExecutionPlan::plan_memory(bool forwards_only, bool checkpoint) {
+	const unsigned num_old = values.size();
+	const unsigned levels = num_levels();
+
+	auto for_each_call = [&](const Instruction& instruction, const std::function<void(const Call&, const FunctionBody&)>& visit) {
+		const CallGroup& group = call_groups[instruction.in[0]];
+		for (unsigned c = 0; c < group.num_calls; c++) {
+			visit(calls[group.first_call + c], bodies[group.body]);
+		}
+	};
+
+	// Gradients only matter for registers that depend on a parameter. The backwards pass
+	// keeps the instructions that have such an input, a call with one taints its whole frame.
+	vector<bool> trainable(num_old, false);
+	for (Register r : parameter_registers)
+		trainable[r] = true;
+	auto is_trainable = [&](Register r) {
+		return r != NULL_INDEX && trainable[r];
+	};
+	auto has_trainable_input = [&](const Instruction& instruction) {
+		bool any = false;
+		if (instruction.op == Operation::Function) {
+			// parameters inside the function live in its frame
+			for_each_call(instruction, [&](const Call& call, const FunctionBody& body) {
+				for (unsigned port = 0; port < body.m_num_ports; port++)
+					any = any || is_trainable(call_ports[call.first_port + port]);
+				for (unsigned f = 0; f < body.m_frame_size; f++)
+					any = any || trainable[call.frame + f];
+			});
+		}
+		else if (is_variadic_operation(instruction.op)) {
+			for (unsigned k = 0; k < num_operands(instruction); k++)
+				any = any || is_trainable(operands[instruction.in[0] + k]);
+		}
+		else {
+			any = is_trainable(instruction.in[0]) || is_trainable(instruction.in[1]);
+		}
+		return any;
+	};
+	// Delays carry it over to the next step, that can go round a loop so repeat until it settles
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (const Instruction& instruction : code) {
+			if (!has_trainable_input(instruction))
+				continue;
+			if (instruction.op == Operation::Function) {
+				for_each_call(instruction, [&](const Call& call, const FunctionBody& body) {
+					for (unsigned f = 0; f < body.m_frame_size; f++)
+						trainable[call.frame + f] = true;
+				});
+			}
+			else {
+				trainable[instruction.out] = true;
+			}
+		}
+		for (size_t i = 0; i < delay_registers.size(); i++) {
+			if (is_trainable(delay_sources[i]) && !trainable[delay_registers[i]]) {
+				trainable[delay_registers[i]] = true;
+				changed = true;
+			}
+		}
+	}
+
+	vector<unsigned> kept_code;
+	vector<unsigned> kept_level_starts;
+	for (unsigned level = 0; level < levels; level++) {
+		kept_level_starts.push_back(kept_code.size());
+		if (forwards_only)
+			continue;
+		for (unsigned position = backwards_level_starts[level]; position < backwards_level_starts[level + 1]; position++) {
+			if (has_trainable_input(code[backwards_code[position]]))
+				kept_code.push_back(backwards_code[position]);
+		}
+	}
+	kept_level_starts.push_back(kept_code.size());
+	backwards_code.swap(kept_code);
+	backwards_level_starts.swap(kept_level_starts);
+
+	vector<bool> pinned(num_old, false);
+	auto pin = [&](Register r) {
+		if (r != NULL_INDEX)
+			pinned[r] = true;
+	};
+
+	for (Register r : parameter_registers)
+		pin(r);
+	for (Index constant : constants)
+		pin(node_register[constant]);
+	for (Register r : data_registers) {
+		pin(r);
+		pin(r + 1);
+		pin(r + 2);
+	}
+	for (Register r : backwards_registers)
+		pin(r);
+	for (size_t i = 0; i < delay_registers.size(); i++) {
+		pin(delay_registers[i]);
+		pin(delay_sources[i]);
+	}
+	pin(result_register);
+
+	// Only plain instructions get their outputs reused, anything else keeps its register
+	vector<unsigned> defined_at(num_old, NULL_INDEX);
+	vector<unsigned> last_read(num_old, NULL_INDEX);
+	for (unsigned level = 0; level < levels; level++) {
+		for (unsigned i = level_starts[level]; i < level_starts[level + 1]; i++) {
+			const Instruction& instruction = code[i];
+			if (instruction.op == Operation::Function) {
+				for_each_call(instruction, [&](const Call& call, const FunctionBody& body) {
+					for (unsigned f = 0; f < body.m_frame_size; f++)
+						pin(call.frame + f);
+					for (unsigned port = 0; port < body.m_num_ports; port++) {
+						Register r = call_ports[call.first_port + port];
+						if (r != NULL_INDEX)
+							last_read[r] = level;
+					}
+				});
+				continue;
+			}
+			defined_at[instruction.out] = level;
+			if (is_variadic_operation(instruction.op)) {
+				for (unsigned k = 0; k < num_operands(instruction); k++) {
+					Register r = operands[instruction.in[0] + k];
+					if (r != NULL_INDEX)
+						last_read[r] = level;
+				}
+			}
+			else {
+				for (int k = 0; k < 2; k++) {
+					if (instruction.in[k] != NULL_INDEX)
+						last_read[instruction.in[k]] = level;
+				}
+			}
+		}
+	}
+
+	// The backwards pass reads the inputs and outputs of everything it still runs
+	vector<bool> read_backwards(num_old, false);
+	auto mark = [&](Register r) {
+		if (r != NULL_INDEX)
+			read_backwards[r] = true;
+	};
+	for (unsigned position : backwards_code) {
+		const Instruction& instruction = code[position];
+		if (instruction.op == Operation::Function) {
+			for_each_call(instruction, [&](const Call& call, const FunctionBody& body) {
+				for (unsigned port = 0; port < body.m_num_ports; port++)
+					mark(call_ports[call.first_port + port]);
+			});
+		}
+		else if (is_variadic_operation(instruction.op)) {
+			mark(instruction.out);
+			for (unsigned k = 0; k < num_operands(instruction); k++)
+				mark(operands[instruction.in[0] + k]);
+		}
+		else {
+			mark(instruction.out);
+			mark(instruction.in[0]);
+			mark(instruction.in[1]);
+		}
+	}
+
+	// Checkpointing cuts the levels into about sqrt(levels) segments. Only registers read
+	// outside the segment that defines them are stored for the whole pass, the backwards
+	// pass recomputes a segment before running it, so the registers local to a segment
+	// can be shared with the other segments' ones.
+	checkpoint_levels.clear();
+	local_registers_begin = local_registers_end = 0;
+	vector<unsigned> segment_of(levels, 0);
+	if (checkpoint && !forwards_only && levels > 1) {
+		unsigned segment_levels = (unsigned)ceilf(sqrtf((float)levels));
+		for (unsigned level = 0; level < levels; level++) {
+			if (level % segment_levels == 0)
+				checkpoint_levels.push_back(level);
+			segment_of[level] = checkpoint_levels.size() - 1;
+		}
+		checkpoint_levels.push_back(levels);
+	}
+	auto is_local = [&](Register r) {
+		return !checkpoint_levels.empty() && !pinned[r] && defined_at[r] != NULL_INDEX &&
+			(last_read[r] == NULL_INDEX || segment_of[last_read[r]] == segment_of[defined_at[r]]);
+	};
+
+	// Kept registers go first in their old order, so frames and data columns stay contiguous
+	vector<bool> kept(num_old, false);
+	vector<Register> remap(num_old, NULL_INDEX);
+	Register next_register = 0;
+	for (Register r = 0; r < num_old; r++) {
+		kept[r] = pinned[r] || defined_at[r] == NULL_INDEX || (!checkpoint_levels.empty() ? !is_local(r) : read_backwards[r]);
+		if (kept[r])
+			remap[r] = next_register++;
+	}
+
+	// Then the segments' registers the backwards pass reads, every segment starts over at
+	// the same place
+	if (!checkpoint_levels.empty()) {
+		vector<Register> segment_next(checkpoint_levels.size() - 1, next_register);
+		for (Register r = 0; r < num_old; r++) {
+			if (!kept[r] && read_backwards[r])
+				remap[r] = segment_next[segment_of[defined_at[r]]]++;
+		}
+		local_registers_begin = local_registers_end = next_register;
+		for (Register end : segment_next)
+			local_registers_end = ImMax(local_registers_end, end);
+		next_register = local_registers_end;
+	}
+
+	// The rest are handed out level by level. A register is free again once the level that
+	// last reads it is done, the barrier between levels makes that safe for parallel ones too.
+	vector<Register> free_registers;
+	vector<vector<Register>> released(levels);
+	for (unsigned level = 0; level < levels; level++) {
+		for (unsigned i = level_starts[level]; i < level_starts[level + 1]; i++) {
+			const Instruction& instruction = code[i];
+			if (instruction.op == Operation::Function || remap[instruction.out] != NULL_INDEX)
+				continue;
+			Register slot;
+			if (free_registers.empty()) {
+				slot = next_register++;
+			}
+			else {
+				slot = free_registers.back();
+				free_registers.pop_back();
+			}
+			remap[instruction.out] = slot;
+			unsigned last = last_read[instruction.out];
+			released[last == NULL_INDEX ? level : last].push_back(slot);
+		}
+		free_registers.insert(free_registers.end(), released[level].begin(), released[level].end());
+	}
+
+	auto renumber = [&](Register& r) {
+		if (r != NULL_INDEX)
+			r = remap[r];
+	};
+	for (Instruction& instruction : code) {
+		if (instruction.op == Operation::Function)
+			continue;
+		renumber(instruction.out);
+		if (!is_variadic_operation(instruction.op)) {
+			renumber(instruction.in[0]);
+			renumber(instruction.in[1]);
+		}
+	}
+	for (Register& r : operands)
+		renumber(r);
+	for (Register& r : call_ports)
+		renumber(r);
+	for (Call& call : calls)
+		renumber(call.frame);
+	for (Register& r : parameter_registers)
+		renumber(r);
+	for (Register& r : data_registers)
+		renumber(r);
+	for (Register& r : backwards_registers)
+		renumber(r);
+	for (Register& r : delay_registers)
+		renumber(r);
+	for (Register& r : delay_sources)
+		renumber(r);
+	renumber(result_register);
+	for (Register& r : node_register) {
+		if (r != NULL_INDEX)
+			r = kept[r] ? remap[r] : NULL_INDEX;
+	}
+	gradient_nodes.erase(std::remove_if(gradient_nodes.begin(), gradient_nodes.end(), [&](Index node) {
+		return node_register[node] == NULL_INDEX;
+	}), gradient_nodes.end());
+
+	vector<float> planned_values(next_register, 0.f);
+	for (Register r = 0; r < num_old; r++) {
+		if (kept[r])
+			planned_values[remap[r]] = values[r];
+	}
+	values.swap(planned_values);
+	gradients.assign(next_register, 0.f);
+	tangents.clear();
+
+	// The chunks point at scratch slots past the registers and at backwards_code, both moved
+	forwards_chunks.clear();
+	forwards_chunk_starts.clear();
+	backwards_chunks.clear();
+	backwards_chunk_starts.clear();
+	reduce_targets.clear();
+	reduce_target_starts.clear();
+	reduce_slot_starts.clear();
+	reduce_slots.clear();
+	build_parallel_levels();
+
+	if (unplanned_registers == 0)
+		unplanned_registers = num_old;
+}
+
+void ExecutionPlan::load_parameters(const ComputationGraph& graph) {
+	for (size_t i = 0; i < parameters.size(); i++) {
+		values[parameter_registers[i]] = graph.values[parameters[i]].m_value;
+	}
+	for (Index constant : constants) {
+		values[node_register[constant]] = graph.values[constant].m_value;
+	}
+}
+
+void ExecutionPlan::forwards(const float* data_values) {
+	load_data(data_values);
+	forwards_levels(0, num_levels());
+}
+
+void ExecutionPlan::load_data(const float* data_values) {
+	for (Register data_register : data_registers) {
+		values[data_register + 0] = data_values[0];
+		values[data_register + 1] = data_values[1];
+		values[data_register + 2] = data_values[2];
+	}
+}
+
+unsigned ExecutionPlan::level_work(unsigned level) const {
+	unsigned work = 0;
+	for (unsigned i = level_starts[level]; i < level_starts[level + 1]; i++) {
+		const Instruction& instruction = code[i];
+		if (instruction.op == Operation::Function) {
+			const CallGroup& group = call_groups[instruction.in[0]];
+			work += group.num_calls * (unsigned)bodies[group.body].m_code.size();
+		}
+		else {
+			work++;
+		}
+	}
+	return work;
+}
+
+void ExecutionPlan::forwards_levels(unsigned first_level, unsigned end_level) {
+	for (unsigned level = first_level; level < end_level; level++) {
+		unsigned first_chunk = forwards_chunk_starts[level];
+		unsigned num_chunks = forwards_chunk_starts[level + 1] - first_chunk;
+		if (pool && num_chunks > 0) {
+			pool->parallel_for(num_chunks, [&](unsigned i) {
+				forwards_chunk(forwards_chunks[first_chunk + i]);
+			}, priority);
+			continue;
+		}
+		for (unsigned i = level_starts[level]; i < level_starts[level + 1];) {
+			if (is_plugin_operation(code[i].op)) {
+				i = forwards_plugin_run(i, level_starts[level + 1]);
+				continue;
+			}
+			if (code[i].op == Operation::Expression) {
+				i = forwards_expression_run(i, level_starts[level + 1]);
+				continue;
+			}
+			forwards_instruction(code[i]);
+			i++;
+		}
+	}
+}
+
+void ExecutionPlan::forwards_instruction(const Instruction& instruction) {
+	if (instruction.op == Operation::Function) {
+		const CallGroup& group = call_groups[instruction.in[0]];
+		forwards_calls(group, 0, group.num_calls);
+	}
+	else if (is_variadic_operation(instruction.op)) {
+		values[instruction.out] = forwards_variadic(instruction);
+	}
+	else {
+		values[instruction.out] = forward_operation(instruction.op, read(instruction.in[0]), read(instruction.in[1]));
+	}
+}
+
+float ExecutionPlan::forwards_variadic(const Instruction& instruction) const {
+	if (instruction.op == Operation::Expression)
+		return forwards_expression(instruction);
+	if (is_plugin_operation(instruction.op))
+		return forwards_plugin(instruction);
+	const Register* operand = &operands[instruction.in[0]];
+	float logits[MAX_INPUTS];
+	unsigned num_logits = instruction.in[1] - 1;
+	for (unsigned i = 0; i < num_logits; i++) {
+		logits[i] = read(operand[1 + i]);
+	}
+	return softmax_cross_entropy(read(operand[0]), logits, num_logits);
+}
+
+void ExecutionPlan::backwards_variadic(const Instruction& instruction) {
+	if (instruction.op == Operation::Expression) {
+		backwards_expression(instruction);
+		return;
+	}
+	if (is_plugin_operation(instruction.op)) {
+		backwards_plugin(instruction);
+		return;
+	}
+	const Register* operand = &operands[instruction.in[0]];
+	float logits[MAX_INPUTS];
+	float logit_gradients[MAX_INPUTS];
+	unsigned num_logits = instruction.in[1] - 1;
+	for (unsigned i = 0; i < num_logits; i++) {
+		logits[i] = read(operand[1 + i]);
+	}
+	softmax_cross_entropy_backward(read(operand[0]), logits, num_logits, gradients[instruction.out], logit_gradients);
+	for (unsigned i = 0; i < num_logits; i++) {
+		gradients[operand[1 + i]] += logit_gradients[i];
+	}
+}
+
+float ExecutionPlan::tangents_variadic(const Instruction& instruction) const {
+	if (instruction.op == Operation::Expression)
+		return tangents_expression(instruction);
+	if (is_plugin_operation(instruction.op))
+		return tangents_plugin(instruction);
+	const Register* operand = &operands[instruction.in[0]];
+	float logits[MAX_INPUTS];
+	float partials[MAX_INPUTS];
+	unsigned num_logits = instruction.in[1] - 1;
+	for (unsigned i = 0; i < num_logits; i++) {
+		logits[i] = read(operand[1 + i]);
+	}
+	softmax_cross_entropy_backward(read(operand[0]), logits, num_logits, 1.f, partials);
+	float tangent = 0.f;
+	for (unsigned i = 0; i < num_logits; i++) {
+		if (tangents[operand[1 + i]] != 0.f)
+			tangent += partials[i] * tangents[operand[1 + i]];
+	}
+	return tangent;
+}
+
+float ExecutionPlan::forwards_expression(const Instruction& instruction) const {
+	const Expression& expression = expressions[instruction.in[1]];
+	float inputs[MAX_INPUTS];
+	float slots[MAX_EXPRESSION_SLOTS];
+	for (unsigned k = 0; k < expression.num_inputs(); k++) {
+		inputs[k] = read(operands[instruction.in[0] + k]);
+	}
+	return expression.forwards(inputs, slots);
+}
+
+void ExecutionPlan::backwards_expression(const Instruction& instruction) {
+	const Expression& expression = expressions[instruction.in[1]];
+	float inputs[MAX_INPUTS];
+	float input_gradients[MAX_INPUTS];
+	float slots[MAX_EXPRESSION_SLOTS];
+	float slot_gradients[MAX_EXPRESSION_SLOTS];
+	const Register* operand = &operands[instruction.in[0]];
+	for (unsigned k = 0; k < expression.num_inputs(); k++) {
+		inputs[k] = read(operand[k]);
+		input_gradients[k] = 0.f;
+	}
+	expression.backwards(inputs, gradients[instruction.out], input_gradients, slots, slot_gradients);
+	for (unsigned k = 0; k < expression.num_inputs(); k++) {
+		if (operand[k] != NULL_INDEX)
+			gradients[operand[k]] += input_gradients[k];
+	}
+}
+
+float ExecutionPlan::tangents_expression(const Instruction& instruction) const {
+	const Expression& expression = expressions[instruction.in[1]];
+	float inputs[MAX_INPUTS];
+	float partials[MAX_INPUTS];
+	float slots[MAX_EXPRESSION_SLOTS];
+	float slot_gradients[MAX_EXPRESSION_SLOTS];
+	const Register* operand = &operands[instruction.in[0]];
+	for (unsigned k = 0; k < expression.num_inputs(); k++) {
+		inputs[k] = read(operand[k]);
+		partials[k] = 0.f;
+	}
+	expression.backwards(inputs, 1.f, partials, slots, slot_gradients);
+	float tangent = 0.f;
+	for (unsigned k = 0; k < expression.num_inputs(); k++) {
+		if (operand[k] != NULL_INDEX && tangents[operand[k]] != 0.f)
+			tangent += partials[k] * tangents[operand[k]];
+	}
+	return tangent;
+}
+
+unsigned ExecutionPlan::forwards_expression_run(unsigned begin, unsigned end) {
+	const unsigned program = code[begin].in[1];
+	unsigned run_end = begin + 1;
+	while (run_end < end && code[run_end].op == Operation::Expression && code[run_end].in[1] == program) {
+		run_end++;
+	}
+
+	const Expression& expression = expressions[program];
+	const unsigned count = run_end - begin;
+	if (count == 1) {
+		values[code[begin].out] = forwards_expression(code[begin]);
+		return run_end;
+	}
+
+	const unsigned num_inputs = expression.num_inputs();
+	expression_slots.resize(expression.num_slots() * count);
+	for (unsigned c = 0; c < count; c++) {
+		for (unsigned k = 0; k < num_inputs; k++) {
+			expression_slots[k * count + c] = read(operands[code[begin + c].in[0] + k]);
+		}
+	}
+	expression.forwards_batch(expression_slots.data(), count);
+	const float* result = expression.m_result == NULL_SLOT ? nullptr : &expression_slots[expression.m_result * count];
+	for (unsigned c = 0; c < count; c++) {
+		values[code[begin + c].out] = result ? result[c] : 0.f;
+	}
+	return run_end;
+}
+
+unsigned ExecutionPlan::backwards_expression_run(unsigned first, unsigned last) {
+	const unsigned program = code[backwards_code[last]].in[1];
+	unsigned run_start = last;
+	while (run_start > first && code[backwards_code[run_start - 1]].op == Operation::Expression &&
+		code[backwards_code[run_start - 1]].in[1] == program) {
+		run_start--;
+	}
+
+	const Expression& expression = expressions[program];
+	const unsigned count = last + 1 - run_start;
+	if (count == 1) {
+		backwards_expression(code[backwards_code[last]]);
+		return run_start;
+	}
+	if (expression.m_result == NULL_SLOT)
+		return run_start;
+
+	const unsigned num_inputs = expression.num_inputs();
+	expression_slots.resize(expression.num_slots() * count);
+	expression_slot_gradients.resize(expression.num_slots() * count);
+	expression_gradients.resize(count);
+	for (unsigned c = 0; c < count; c++) {
+		const Instruction& instruction = code[backwards_code[run_start + c]];
+		for (unsigned k = 0; k < num_inputs; k++) {
+			expression_slots[k * count + c] = read(operands[instruction.in[0] + k]);
+		}
+		expression_gradients[c] = gradients[instruction.out];
+	}
+	expression.backwards_batch(expression_gradients.data(), expression_slots.data(), expression_slot_gradients.data(), count);
+	for (unsigned c = 0; c < count; c++) {
+		const Instruction& instruction = code[backwards_code[run_start + c]];
+		for (unsigned k = 0; k < num_inputs; k++) {
+			Register operand = operands[instruction.in[0] + k];
+			if (operand != NULL_INDEX)
+				gradients[operand] += expression_slot_gradients[k * count + c];
+		}
+	}
+	return run_start;
+}
+
+float ExecutionPlan::forwards_plugin(const Instruction& instruction) const {
+	const PluginOp& plugin = plugin_ops[plugin_index(instruction.op)];
+	if (!plugin.forward)
+		return 0.f;
+	float inputs[MAX_INPUTS];
+	for (unsigned k = 0; k < instruction.in[1]; k++) {
+		inputs[k] = read(operands[instruction.in[0] + k]);
+	}
+	return plugin.forward(inputs, plugin.user_data);
+}
+
+void ExecutionPlan::backwards_plugin(const Instruction& instruction) {
+	const PluginOp& plugin = plugin_ops[plugin_index(instruction.op)];
+	if (!plugin.backward)
+		return;
+	float inputs[MAX_INPUTS];
+	float input_gradients[MAX_INPUTS];
+	const Register* operand = &operands[instruction.in[0]];
+	for (unsigned k = 0; k < instruction.in[1]; k++) {
+		inputs[k] = read(operand[k]);
+		input_gradients[k] = 0.f;
+	}
+	plugin.backward(inputs, values[instruction.out], gradients[instruction.out], input_gradients, plugin.user_data);
+	for (unsigned k = 0; k < instruction.in[1]; k++) {
+		if (operand[k] != NULL_INDEX)
+			gradients[operand[k]] += input_gradients[k];
+	}
+}
+
+float ExecutionPlan::tangents_plugin(const Instruction& instruction) const {
+	const PluginOp& plugin = plugin_ops[plugin_index(instruction.op)];
+	if (!plugin.backward)
+		return 0.f;
+	float inputs[MAX_INPUTS];
+	float partials[MAX_INPUTS];
+	const Register* operand = &operands[instruction.in[0]];
+	for (unsigned k = 0; k < instruction.in[1]; k++) {
+		inputs[k] = read(operand[k]);
+		partials[k] = 0.f;
+	}
+	plugin.backward(inputs, values[instruction.out], 1.f, partials, plugin.user_data);
+	float tangent = 0.f;
+	for (unsigned k = 0; k < instruction.in[1]; k++) {
+		if (operand[k] != NULL_INDEX && tangents[operand[k]] != 0.f)
+			tangent += partials[k] * tangents[operand[k]];
+	}
+	return tangent;
+}
+
+unsigned ExecutionPlan::forwards_plugin_run(unsigned begin, unsigned end) {
+	const Operation op = code[begin].op;
+	unsigned run_end = begin + 1;
+	while (run_end < end && code[run_end].op == op) {
+		run_end++;
+	}
+
+	const PluginOp& plugin = plugin_ops[plugin_index(op)];
+	const unsigned count = run_end - begin;
+	if (!plugin.forward_batch || count == 1) {
+		for (unsigned i = begin; i < run_end; i++) {
+			values[code[i].out] = forwards_plugin(code[i]);
+		}
+		return run_end;
+	}
+
+	const unsigned num_inputs = plugin.num_inputs;
+	plugin_inputs.resize(count * num_inputs);
+	plugin_outputs.resize(count);
+	for (unsigned c = 0; c < count; c++) {
+		for (unsigned k = 0; k < num_inputs; k++) {
+			plugin_inputs[c * num_inputs + k] = read(operands[code[begin + c].in[0] + k]);
+		}
+	}
+	plugin.forward_batch(plugin_inputs.data(), plugin_outputs.data(), count, plugin.user_data);
+	for (unsigned c = 0; c < count; c++) {
+		values[code[begin + c].out] = plugin_outputs[c];
+	}
+	return run_end;
+}
+
+unsigned ExecutionPlan::backwards_plugin_run(unsigned first, unsigned last) {
+	const Operation op = code[backwards_code[last]].op;
+	unsigned run_start = last;
+	while (run_start > first && code[backwards_code[run_start - 1]].op == op) {
+		run_start--;
+	}
+
+	const PluginOp& plugin = plugin_ops[plugin_index(op)];
+	const unsigned count = last + 1 - run_start;
+	if (!plugin.backward_batch || count == 1) {
+		for (unsigned position = run_start; position <= last; position++) {
+			backwards_plugin(code[backwards_code[position]]);
+		}
+		return run_start;
+	}
+
+	const unsigned num_inputs = plugin.num_inputs;
+	plugin_inputs.resize(count * num_inputs);
+	plugin_outputs.resize(count);
+	plugin_gradients.resize(count);
+	plugin_input_gradients.assign(count * num_inputs, 0.f);
+	for (unsigned c = 0; c < count; c++) {
+		const Instruction& instruction = code[backwards_code[run_start + c]];
+		for (unsigned k = 0; k < num_inputs; k++) {
+			plugin_inputs[c * num_inputs + k] = read(operands[instruction.in[0] + k]);
+		}
+		plugin_outputs[c] = values[instruction.out];
+		plugin_gradients[c] = gradients[instruction.out];
+	}
+	plugin.backward_batch(plugin_inputs.data(), plugin_outputs.data(), plugin_gradients.data(),
+		plugin_input_gradients.data(), count, plugin.user_data);
+	for (unsigned c = 0; c < count; c++) {
+		const Instruction& instruction = code[backwards_code[run_start + c]];
+		for (unsigned k = 0; k < num_inputs; k++) {
+			Register operand = operands[instruction.in[0] + k];
+			if (operand != NULL_INDEX)
+				gradients[operand] += plugin_input_gradients[c * num_inputs + k];
+		}
+	}
+	return run_start;
+}
+
+void ExecutionPlan::forwards_calls(const CallGroup& group, unsigned first_call, unsigned num_calls) {
+	const FunctionBody& body = bodies[group.body];
+	const Call* group_calls = &calls[group.first_call + first_call];
+
+	for (const Instruction& instruction : body.m_code) {
+		for (unsigned c = 0; c < num_calls; c++) {
+			const Call& call = group_calls[c];
+			values[call.frame + instruction.out] = forward_operation(instruction.op,
+				read(resolve(call, instruction.in[0])), read(resolve(call, instruction.in[1])));
+		}
+	}
+}
+
+void ExecutionPlan::forwards_chunk(const LevelChunk& chunk) {
+	if (chunk.group != NULL_INDEX) {
+		forwards_calls(call_groups[chunk.group], chunk.first_call, chunk.num_calls);
+		return;
+	}
+	for (unsigned i = chunk.begin; i < chunk.end; i++) {
+		forwards_instruction(code[i]);
+	}
+}
+
+void ExecutionPlan::forwards_tangents(Register seed) {
+	tangents.assign(values.size(), 0.f);
+	if (seed == NULL_INDEX)
+		return;
+	tangents[seed] = 1.f;
+
+	// chunks only write their own outputs, same as the forwards pass
+	for (unsigned level = 0; level < num_levels(); level++) {
+		unsigned first_chunk = forwards_chunk_starts[level];
+		unsigned num_chunks = forwards_chunk_starts[level + 1] - first_chunk;
+		if (pool && num_chunks > 0) {
+			pool->parallel_for(num_chunks, [&](unsigned i) {
+				tangents_chunk(forwards_chunks[first_chunk + i]);
+			}, priority);
+			continue;
+		}
+		for (unsigned i = level_starts[level]; i < level_starts[level + 1]; i++) {
+			tangents_instruction(code[i]);
+		}
+	}
+}
+
+void ExecutionPlan::tangents_instruction(const Instruction& instruction) {
+	if (instruction.op == Operation::Function) {
+		const CallGroup& group = call_groups[instruction.in[0]];
+		tangents_calls(group, 0, group.num_calls);
+	}
+	else if (is_variadic_operation(instruction.op)) {
+		tangents[instruction.out] = tangents_variadic(instruction);
+	}
+	else {
+		tangents[instruction.out] = tangent_operation(instruction.op, instruction.out, instruction.in[0], instruction.in[1]);
+	}
+}
+
+void ExecutionPlan::tangents_calls(const CallGroup& group, unsigned first_call, unsigned num_calls) {
+	const FunctionBody& body = bodies[group.body];
+	const Call* group_calls = &calls[group.first_call + first_call];
+
+	for (const Instruction& instruction : body.m_code) {
+		for (unsigned c = 0; c < num_calls; c++) {
+			const Call& call = group_calls[c];
+			Register out = call.frame + instruction.out;
+			tangents[out] = tangent_operation(instruction.op, out, resolve(call, instruction.in[0]), resolve(call, instruction.in[1]));
+		}
+	}
+}
+
+void ExecutionPlan::tangents_chunk(const LevelChunk& chunk) {
+	if (chunk.group != NULL_INDEX) {
+		tangents_calls(call_groups[chunk.group], chunk.first_call, chunk.num_calls);
+		return;
+	}
+	for (unsigned i = chunk.begin; i < chunk.end; i++) {
+		tangents_instruction(code[i]);
+	}
+}
+
+void ExecutionPlan::backwards() {
+	if (!has_loss())
+		return;
+
+	clear_gradients();
+	run_backwards();
+}
+
+void ExecutionPlan::run_backwards() {
+	if (checkpoint_levels.empty()) {
+		backwards_levels(0, num_levels());
+		return;
+	}
+
+	// The last segment is still there from the forwards pass, the others get recomputed from
+	// the stored registers. Their gradients start from zero, the previous segment's
+	// gradients for the shared registers are stale.
+	for (size_t segment = checkpoint_levels.size() - 1; segment-- > 0;) {
+		unsigned first_level = checkpoint_levels[segment];
+		unsigned end_level = checkpoint_levels[segment + 1];
+		if (segment + 2 < checkpoint_levels.size()) {
+			forwards_levels(first_level, end_level);
+			std::fill(gradients.begin() + local_registers_begin, gradients.begin() + local_registers_end, 0.f);
+		}
+		backwards_levels(first_level, end_level);
+	}
+}
+
+void ExecutionPlan::clear_gradients() {
+	std::fill(gradients.begin(), gradients.end(), 0.f);
+	for (size_t i = 0; i < backwards_registers.size(); i++) {
+		gradients[backwards_registers[i]] += backwards_weights[i];
+	}
+}
+
+void ExecutionPlan::backwards_levels(unsigned first_level, unsigned end_level) {
+	for (unsigned level = end_level; level-- > first_level;) {
+		unsigned first_chunk = backwards_chunk_starts[level];
+		unsigned num_chunks = backwards_chunk_starts[level + 1] - first_chunk;
+		if (pool && num_chunks > 0) {
+			pool->parallel_for(num_chunks, [&](unsigned i) {
+				backwards_chunk(backwards_chunks[first_chunk + i]);
+			}, priority);
+			unsigned first_target = reduce_target_starts[level];
+			unsigned num_targets = reduce_target_starts[level + 1] - first_target;
+			unsigned num_tasks = (num_targets + PARALLEL_CHUNK_WORK - 1) / PARALLEL_CHUNK_WORK;
+			pool->parallel_for(num_tasks, [&](unsigned i) {
+				unsigned begin = first_target + i * PARALLEL_CHUNK_WORK;
+				reduce_gradients(begin, ImMin(begin + PARALLEL_CHUNK_WORK, first_target + num_targets));
+			}, priority);
+			continue;
+		}
+		for (unsigned position = backwards_level_starts[level + 1]; position-- > backwards_level_starts[level];) {
+			const Instruction& instruction = code[backwards_code[position]];
+			if (instruction.op == Operation::Function) {
+				backwards_call_group(call_groups[instruction.in[0]]);
+			}
+			else if (is_plugin_operation(instruction.op)) {
+				position = backwards_plugin_run(backwards_level_starts[level], position);
+			}
+			else if (instruction.op == Operation::Expression) {
+				position = backwards_expression_run(backwards_level_starts[level], position);
+			}
+			else if (is_variadic_operation(instruction.op)) {
+				backwards_variadic(instruction);
+			}
+			else {
+				backwards_instruction(instruction.op, instruction.out, instruction.in[0], instruction.in[1]);
+			}
+		}
+	}
+}
+
+void ExecutionPlan::accumulate_gradients(const float* data_values, vector<float>& gradient_acc) {
+	forwards(data_values);
+	if (!has_loss())
+		return;
+	backwards();
+	for (size_t p = 0; p < parameters.size(); p++) {
+		gradient_acc[p] += gradients[parameter_registers[p]];
+	}
+}
+
+void ExecutionPlan::reset_state() {
+	for (Register r : delay_registers) {
+		values[r] = 0.f;
+	}
+}
+
+void ExecutionPlan::advance_state() {
+	// read them all first, a delay can feed another one
+	step_state.resize(delay_registers.size());
+	for (size_t i = 0; i < delay_registers.size(); i++) {
+		step_state[i] = read(delay_sources[i]);
+	}
+	for (size_t i = 0; i < delay_registers.size(); i++) {
+		values[delay_registers[i]] = step_state[i];
+	}
+}
+
+float ExecutionPlan::accumulate_sequence_gradients(const float* data_values, unsigned num_points, GradientSum& gradient_sum) {
+	const size_t stride = sizeof(DataPoint) / sizeof(float);
+	const size_t num_values = values.size();
+
+	// The window's values are kept in one buffer that's reused by the next window
+	step_values.resize(num_points * num_values);
+	float sum = 0.f;
+	for (unsigned t = 0; t < num_points; t++) {
+		forwards(data_values + t * stride);
+		sum += loss();
+		std::copy(values.begin(), values.end(), step_values.begin() + t * num_values);
+		advance_state();
+	}
+	if (!has_loss())
+		return sum;
+
+	vector<float> next_state(delay_registers.size());
+	for (size_t i = 0; i < delay_registers.size(); i++) {
+		next_state[i] = values[delay_registers[i]];
+	}
+
+	// The gradient of a delay at one point goes to its input at the point before
+	delay_gradients.assign(delay_registers.size(), 0.f);
+	for (unsigned t = num_points; t-- > 0;) {
+		std::copy(step_values.begin() + t * num_values, step_values.begin() + (t + 1) * num_values, values.begin());
+		clear_gradients();
+		for (size_t i = 0; i < delay_registers.size(); i++) {
+			if (delay_sources[i] != NULL_INDEX)
+				gradients[delay_sources[i]] += delay_gradients[i];
+		}
+		run_backwards();
+		for (size_t i = 0; i < delay_registers.size(); i++) {
+			delay_gradients[i] = gradients[delay_registers[i]];
+		}
+		gradient_sum.add(*this);
+	}
+
+	for (size_t i = 0; i < delay_registers.size(); i++) {
+		values[delay_registers[i]] = next_state[i];
+	}
+	return sum;
+}
+
+void ExecutionPlan::accumulate_gradients(const float* data_values, GradientSum& gradient_sum) {
+	forwards(data_values);
+	if (!has_loss())
+		return;
+	backwards();
+	gradient_sum.add(*this);
+}
+
+void ExecutionPlan::apply_gradients(const vector<float>& gradient_acc, float rate) {
+	for (size_t p = 0; p < parameters.size(); p++) {
+		values[parameter_registers[p]] -= rate * gradient_acc[p];
+	}
+}
+
+void ExecutionPlan::backwards_call_group(const CallGroup& group) {
+	const FunctionBody& body = bodies[group.body];
+	const Call* group_calls = &calls[group.first_call];
+
+	for (auto it = body.m_code.rbegin(); it != body.m_code.rend(); ++it) {
+		for (unsigned c = 0; c < group.num_calls; c++) {
+			const Call& call = group_calls[c];
+			backwards_instruction(it->op, call.frame + it->out, resolve(call, it->in[0]), resolve(call, it->in[1]));
+		}
+	}
+}
+
+void ExecutionPlan::backwards_chunk(const LevelChunk& chunk) {
+	if (chunk.group == NULL_INDEX) {
+		for (unsigned position = chunk.begin; position < chunk.end; position++) {
+			const Instruction& instruction = code[backwards_code[position]];
+			Register slot = chunk.scratch + 2 * (position - chunk.begin);
+			gradients[slot] = 0.f;
+			gradients[slot + 1] = 0.f;
+			backwards_instruction(instruction.op, instruction.out, instruction.in[0], instruction.in[1],
+				instruction.in[0] != NULL_INDEX ? slot : NULL_INDEX, instruction.in[1] != NULL_INDEX ? slot + 1 : NULL_INDEX);
+		}
+		return;
+	}
+
+	const CallGroup& group = call_groups[chunk.group];
+	const FunctionBody& body = bodies[group.body];
+	const Call* chunk_calls = &calls[group.first_call + chunk.first_call];
+	std::fill(gradients.begin() + chunk.scratch, gradients.begin() + chunk.scratch + chunk.num_calls * body.m_num_ports, 0.f);
+
+	// frame registers belong to the call, ports might be shared with other chunks so their
+	// gradients go to scratch
+	auto gradient_target = [&](unsigned c, Register operand) {
+		if (operand == NULL_INDEX)
+			return NULL_INDEX;
+		if (operand & PORT_FLAG)
+			return chunk.scratch + c * body.m_num_ports + (operand & ~PORT_FLAG);
+		return chunk_calls[c].frame + operand;
+	};
+
+	for (auto it = body.m_code.rbegin(); it != body.m_code.rend(); ++it) {
+		for (unsigned c = 0; c < chunk.num_calls; c++) {
+			const Call& call = chunk_calls[c];
+			backwards_instruction(it->op, call.frame + it->out, resolve(call, it->in[0]), resolve(call, it->in[1]),
+				gradient_target(c, it->in[0]), gradient_target(c, it->in[1]));
+		}
+	}
+}
+
+void ExecutionPlan::reduce_gradients(unsigned first_target, unsigned end_target) {
+	for (unsigned target = first_target; target < end_target; target++) {
+		float sum = 0.f;
+		for (unsigned i = reduce_slot_starts[target]; i < reduce_slot_starts[target + 1]; i++) {
+			sum += gradients[reduce_slots[i]];
+		}
+		gradients[reduce_targets[target]] += sum;
+	}
+}
+
+void ExecutionPlan::backwards_instruction(Operation op, Register out, Register a, Register b, Register gradient_a, Register gradient_b) {
+	float a_gradient = 0.f;
+	float b_gradient = 0.f;
+	backward_operation(op, read(a), read(b), values[out], gradients[out], a_gradient, b_gradient);
+	if (gradient_a != NULL_INDEX)
+		gradients[gradient_a] += a_gradient;
+	if (gradient_b != NULL_INDEX)
+		gradients[gradient_b] += b_gradient;
+}
+
+void ExecutionPlan::store_values(ComputationGraph& graph) const {
+	for (Index i = 0; i < node_register.size() && i < graph.next_free_index; i++) {
+		if (node_register[i] != NULL_INDEX && graph.used[i] && graph.values[i].m_operation != Operation::DataSource) {
+			graph.values[i].m_value = values[node_register[i]];
+		}
+	}
+}
+
+void ExecutionPlan::store_tangents(ComputationGraph& graph) const {
+	graph.sensitivities.assign(graph.next_free_index, 0.f);
+	for (Index i = 0; i < node_register.size() && i < graph.next_free_index; i++) {
+		if (node_register[i] != NULL_INDEX && node_register[i] < tangents.size()) {
+			graph.sensitivities[i] = tangents[node_register[i]];
+		}
+	}
+}
+
+void ExecutionPlan::store_gradients(ComputationGraph& graph) const {
+	for (Index i : gradient_nodes) {
+		graph.values[i].m_gradient = gradients[node_register[i]];
+		graph.values[i].m_gradient_calculated = true;
+	}
+}
@@ -0,0 +1,366 @@
+#include "expression.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <unordered_map>
+
+namespace {
+
+// Where a value comes from while parsing, the slots are only known once every input and
+// constant has been seen
+struct Operand {
+	enum Kind : unsigned char { Input, Constant, Step, None } kind{ None };
+	unsigned short index{ 0 };
+
+	bool operator==(const Operand& other) const {
+		return kind == other.kind && index == other.index;
+	}
+};
+
+struct ParsedStep {
+	Operation op;
+	Operand	  a;
+	Operand	  b;
+};
+
+class Parser {
+public:
+	const char*			   text;
+	const char*			   at;
+	std::string			   error;
+	vector<std::string>	   inputs;
+	vector<float>		   constants;
+	vector<ParsedStep>	   steps;
+
+	explicit Parser(const char* formula) : text(formula), at(formula) {}
+
+	Operand parse() {
+		Operand result = parse_sum();
+		skip_spaces();
+		if (error.empty() && *at != '\0')
+			fail("unexpected '" + std::string(1, *at) + "'");
+		return result;
+	}
+
+private:
+	void fail(const std::string& message) {
+		if (error.empty())
+			error = message + " at " + std::to_string(at - text + 1);
+	}
+
+	void skip_spaces() {
+		while (isspace((unsigned char)*at))
+			at++;
+	}
+
+	bool accept(char c) {
+		skip_spaces();
+		if (*at != c)
+			return false;
+		at++;
+		return true;
+	}
+
+	Operand constant(float number) {
+		for (size_t k = 0; k < constants.size(); k++) {
+			if (constants[k] == number)
+				return { Operand::Constant, (unsigned short)k };
+		}
+		constants.push_back(number);
+		return { Operand::Constant, (unsigned short)(constants.size() - 1) };
+	}
+
+	// Folds operations on constants and reuses a step computing the same thing
+	Operand step(Operation op, Operand a, Operand b) {
+		if (a.kind == Operand::None || (num_operation_inputs(op) == 2 && b.kind == Operand::None))
+			return Operand();
+		if (a.kind == Operand::Constant && (b.kind == Operand::Constant || b.kind == Operand::None)) {
+			return constant(forward_operation(op, constants[a.index], b.kind == Operand::None ? 0.f : constants[b.index]));
+		}
+		for (size_t k = 0; k < steps.size(); k++) {
+			if (steps[k].op == op && steps[k].a == a && steps[k].b == b)
+				return { Operand::Step, (unsigned short)k };
+		}
+		steps.push_back({ op, a, b });
+		return { Operand::Step, (unsigned short)(steps.size() - 1) };
+	}
+
+	Operand parse_sum() {
+		Operand result = parse_product();
+		while (error.empty()) {
+			if (accept('+'))
+				result = step(Operation::Add, result, parse_product());
+			else if (accept('-'))
+				result = step(Operation::Subtract, result, parse_product());
+			else
+				break;
+		}
+		return result;
+	}
+
+	Operand parse_product() {
+		Operand result = parse_unary();
+		while (error.empty()) {
+			if (accept('*'))
+				result = step(Operation::Multiply, result, parse_unary());
+			else if (accept('/'))
+				result = step(Operation::Divide, result, parse_unary());
+			else
+				break;
+		}
+		return result;
+	}
+
+	// -x^2 is -(x^2), like on paper
+	Operand parse_unary() {
+		if (accept('-'))
+			return step(Operation::Subtract, constant(0.f), parse_unary());
+		if (accept('+'))
+			return parse_unary();
+		return parse_power();
+	}
+
+	// Right associative, 2^-x is allowed
+	Operand parse_power() {
+		Operand base = parse_primary();
+		if (error.empty() && accept('^'))
+			return step(Operation::Power, base, parse_unary());
+		return base;
+	}
+
+	Operand parse_primary() {
+		skip_spaces();
+		if (accept('(')) {
+			Operand result = parse_sum();
+			if (error.empty() && !accept(')'))
+				fail("missing ')'");
+			return result;
+		}
+		if (isdigit((unsigned char)*at) || *at == '.') {
+			char* end = nullptr;
+			float number = strtof(at, &end);
+			if (end == at) {
+				fail("bad number");
+				return Operand();
+			}
+			at = end;
+			return constant(number);
+		}
+		if (isalpha((unsigned char)*at) || *at == '_') {
+			const char* start = at;
+			while (isalnum((unsigned char)*at) || *at == '_')
+				at++;
+			std::string name(start, at);
+			if (accept('('))
+				return parse_call(name);
+			for (size_t k = 0; k < inputs.size(); k++) {
+				if (inputs[k] == name)
+					return { Operand::Input, (unsigned short)k };
+			}
+			if (inputs.size() == MAX_INPUTS) {
+				fail("more than " + std::to_string(MAX_INPUTS) + " inputs");
+				return Operand();
+			}
+			inputs.push_back(name);
+			return { Operand::Input, (unsigned short)(inputs.size() - 1) };
+		}
+		fail(*at == '\0' ? std::string("unexpected end") : "unexpected '" + std::string(1, *at) + "'");
+		return Operand();
+	}
+
+	Operand parse_call(const std::string& name) {
+		static const struct {
+			const char* name;
+			Operation	op;
+		} functions[] = {
+			{ "tanh", Operation::Tanh },
+			{ "relu", Operation::ReLU },
+			{ "sin",  Operation::Sin },
+			{ "cos",  Operation::Cos },
+			{ "sqrt", Operation::Sqrt },
+			{ "log",  Operation::Log },
+			{ "step", Operation::Step },
+		};
+		Operand argument = parse_sum();
+		if (error.empty() && !accept(')'))
+			fail("missing ')'");
+		if (name == "exp")
+			return step(Operation::Power, constant(2.718281828f), argument);
+		for (const auto& function : functions) {
+			if (name == function.name)
+				return step(function.op, argument, Operand());
+		}
+		fail("unknown function " + name);
+		return Operand();
+	}
+};
+
+}
+
+bool Expression::compile(const char* formula) {
+	*this = Expression();
+	m_formula = formula;
+
+	Parser parser(formula);
+	Operand result = parser.parse();
+	if (parser.error.empty() && result.kind == Operand::None)
+		parser.error = "empty";
+	if (parser.error.empty() && parser.inputs.size() + parser.constants.size() + parser.steps.size() > MAX_EXPRESSION_SLOTS)
+		parser.error = "too long";
+	if (!parser.error.empty()) {
+		m_error = parser.error;
+		return false;
+	}
+
+	m_inputs = parser.inputs;
+	m_constants = parser.constants;
+	const unsigned short first_constant = (unsigned short)m_inputs.size();
+	const unsigned short first_step = (unsigned short)(first_constant + m_constants.size());
+	auto slot = [&](Operand operand) -> unsigned short {
+		switch (operand.kind) {
+		case Operand::Input:
+			return operand.index;
+		case Operand::Constant:
+			return first_constant + operand.index;
+		case Operand::Step:
+			return first_step + operand.index;
+		default:
+			return NULL_SLOT;
+		}
+	};
+	for (const ParsedStep& step : parser.steps) {
+		m_code.push_back({ step.op, slot(step.a), slot(step.b) });
+	}
+	m_result = slot(result);
+	return true;
+}
+
+float Expression::forwards(const float* inputs, float* slots) const {
+	if (m_result == NULL_SLOT)
+		return 0.f;
+	for (unsigned k = 0; k < num_inputs(); k++) {
+		slots[k] = inputs[k];
+	}
+	forwards_batch(slots, 1);
+	return slots[m_result];
+}
+
+void Expression::backwards(const float* inputs, float gradient, float* input_gradients, float* slots, float* slot_gradients) const {
+	if (m_result == NULL_SLOT)
+		return;
+	for (unsigned k = 0; k < num_inputs(); k++) {
+		slots[k] = inputs[k];
+	}
+	backwards_batch(&gradient, slots, slot_gradients, 1);
+	for (unsigned k = 0; k < num_inputs(); k++) {
+		input_gradients[k] += slot_gradients[k];
+	}
+}
+
+void Expression::forwards_batch(float* slots, unsigned count) const {
+	if (m_result == NULL_SLOT)
+		return;
+	const unsigned first_constant = num_inputs();
+	for (size_t k = 0; k < m_constants.size(); k++) {
+		std::fill_n(slots + (first_constant + k) * count, count, m_constants[k]);
+	}
+	float* out = slots + (first_constant + m_constants.size()) * count;
+	for (const ExpressionStep& step : m_code) {
+		const float* a = slots + step.a * count;
+		const float* b = slots + (step.b == NULL_SLOT ? step.a : step.b) * count;
+		// the common ones get loops of their own, the compiler can vectorise those
+		switch (step.op) {
+		case Operation::Add:
+			for (unsigned c = 0; c < count; c++)
+				out[c] = a[c] + b[c];
+			break;
+		case Operation::Subtract:
+			for (unsigned c = 0; c < count; c++)
+				out[c] = a[c] - b[c];
+			break;
+		case Operation::Multiply:
+			for (unsigned c = 0; c < count; c++)
+				out[c] = a[c] * b[c];
+			break;
+		default:
+			for (unsigned c = 0; c < count; c++)
+				out[c] = forward_operation(step.op, a[c], b[c]);
+			break;
+		}
+		out += count;
+	}
+}
+
+void Expression::backwards_batch(const float* gradients, float* slots, float* slot_gradients, unsigned count) const {
+	if (m_result == NULL_SLOT)
+		return;
+	forwards_batch(slots, count);
+	std::fill_n(slot_gradients, num_slots() * count, 0.f);
+	std::copy_n(gradients, count, slot_gradients + m_result * count);
+
+	const unsigned first_step = num_slots() - (unsigned)m_code.size();
+	for (unsigned k = (unsigned)m_code.size(); k-- > 0;) {
+		const ExpressionStep& step = m_code[k];
+		const float* a = slots + step.a * count;
+		const float* out = slots + (first_step + k) * count;
+		const float* gradient = slot_gradients + (first_step + k) * count;
+		float* gradient_a = slot_gradients + step.a * count;
+		if (step.b == NULL_SLOT) {
+			for (unsigned c = 0; c < count; c++) {
+				float unused = 0.f;
+				float partial = 0.f;
+				backward_operation(step.op, a[c], 0.f, out[c], gradient[c], partial, unused);
+				gradient_a[c] += partial;
+			}
+			continue;
+		}
+		const float* b = slots + step.b * count;
+		float* gradient_b = slot_gradients + step.b * count;
+		switch (step.op) {
+		case Operation::Add:
+			for (unsigned c = 0; c < count; c++) {
+				gradient_a[c] += gradient[c];
+				gradient_b[c] += gradient[c];
+			}
+			break;
+		case Operation::Subtract:
+			for (unsigned c = 0; c < count; c++) {
+				gradient_a[c] += gradient[c];
+				gradient_b[c] -= gradient[c];
+			}
+			break;
+		case Operation::Multiply:
+			for (unsigned c = 0; c < count; c++) {
+				// a and b can be the same slot, x*x
+				float partial_a = gradient[c] * b[c];
+				float partial_b = gradient[c] * a[c];
+				gradient_a[c] += partial_a;
+				gradient_b[c] += partial_b;
+			}
+			break;
+		default:
+			for (unsigned c = 0; c < count; c++) {
+				float partial_a = 0.f;
+				float partial_b = 0.f;
+				backward_operation(step.op, a[c], b[c], out[c], gradient[c], partial_a, partial_b);
+				gradient_a[c] += partial_a;
+				gradient_b[c] += partial_b;
+			}
+			break;
+		}
+	}
+}
+
+const Expression& Expression::cached(const char* formula) {
+	// every edit of a formula adds one, start over once there are plenty
+	static std::unordered_map<std::string, Expression> expressions;
+	auto it = expressions.find(formula);
+	if (it != expressions.end())
+		return it->second;
+	if (expressions.size() >= 1024)
+		expressions.clear();
+	Expression& expression = expressions[formula];
+	expression.compile(formula);
+	return expression;
+}
@@ -12,6 +12,7 @@
 #include "imgui.h"
 #include "node_editor.h"
 #include "context.h"
+#include "plugin_ops.h"
 #include "imgui_canvas.h"
 
 
@@ -62,6 +63,8 @@ class NNGarden : public bigg::Application
 		int comp = 0;
 		
 		s_context.main_graph.initialise();
+		// before the graph, which may use their ops
+		PluginRegistry::shared().load_directory("plugins");
 		load("graph.json");
 	}
 
@@ -0,0 +1,378 @@
+#include "optimizer.h"
+#include "counter_random.h"
+
+#include <algorithm>
+#include <cmath>
+
+const char* optimizer_name(OptimizerType type) {
+	switch (type) {
+	case OptimizerType::SGD:		return "SGD";
+	case OptimizerType::Momentum:	return "Momentum";
+	case OptimizerType::RMSProp:	return "RMSProp";
+	case OptimizerType::Adam:		return "Adam";
+	default:						return "";
+	}
+}
+
+const char* precision_name(Precision precision) {
+	switch (precision) {
+	case Precision::Float:			return "Float";
+	case Precision::Compensated:	return "Compensated";
+	case Precision::Double:			return "Double";
+	default:						return "";
+	}
+}
+
+// Adds gradients into sum in Scalar. With compensation it's Kahan's: the part of each
+// addition that got rounded off is kept and taken back out of the next one.
+template <typename Scalar>
+static void add_gradients(Scalar* sum, Scalar* compensation, const float* gradients, const Register* registers, size_t count) {
+	if (compensation) {
+		for (size_t p = 0; p < count; p++) {
+			Scalar y = (Scalar)gradients[registers[p]] - compensation[p];
+			Scalar t = sum[p] + y;
+			compensation[p] = (t - sum[p]) - y;
+			sum[p] = t;
+		}
+		return;
+	}
+	for (size_t p = 0; p < count; p++) {
+		sum[p] += (Scalar)gradients[registers[p]];
+	}
+}
+
+void GradientSum::reset(size_t num_parameters) {
+	m_sum.assign(num_parameters, 0.f);
+	m_compensation.assign(m_precision == Precision::Compensated ? num_parameters : 0, 0.f);
+	m_wide.assign(m_precision == Precision::Double ? num_parameters : 0, 0.0);
+}
+
+void GradientSum::clear() {
+	std::fill(m_sum.begin(), m_sum.end(), 0.f);
+	std::fill(m_compensation.begin(), m_compensation.end(), 0.f);
+	std::fill(m_wide.begin(), m_wide.end(), 0.0);
+}
+
+void GradientSum::add(const ExecutionPlan& plan) {
+	const size_t count = plan.parameters.size();
+	if (m_sum.size() != count) {
+		reset(count);
+	}
+	const float* gradients = plan.gradients.data();
+	const Register* registers = plan.parameter_registers.data();
+	switch (m_precision) {
+	case Precision::Compensated:
+		add_gradients(m_sum.data(), m_compensation.data(), gradients, registers, count);
+		break;
+	case Precision::Double:
+		add_gradients<double>(m_wide.data(), nullptr, gradients, registers, count);
+		break;
+	default:
+		add_gradients<float>(m_sum.data(), nullptr, gradients, registers, count);
+		break;
+	}
+}
+
+const vector<float>& GradientSum::result() {
+	if (m_precision == Precision::Double) {
+		for (size_t p = 0; p < m_sum.size(); p++) {
+			m_sum[p] = (float)m_wide[p];
+		}
+	}
+	return m_sum;
+}
+
+void Optimizer::reset(size_t num_parameters) {
+	m_first_moment.assign(num_parameters, 0.f);
+	m_second_moment.assign(num_parameters, 0.f);
+	m_steps = 0;
+}
+
+void Optimizer::remap(const vector<Index>& old_parameters, const vector<Index>& new_parameters) {
+	map<Index, size_t> old_position;
+	for (size_t p = 0; p < old_parameters.size() && p < m_first_moment.size(); p++) {
+		old_position[old_parameters[p]] = p;
+	}
+
+	vector<float> first_moment(new_parameters.size(), 0.f);
+	vector<float> second_moment(new_parameters.size(), 0.f);
+	for (size_t p = 0; p < new_parameters.size(); p++) {
+		auto it = old_position.find(new_parameters[p]);
+		if (it != old_position.end()) {
+			first_moment[p] = m_first_moment[it->second];
+			second_moment[p] = m_second_moment[it->second];
+		}
+	}
+	m_first_moment.swap(first_moment);
+	m_second_moment.swap(second_moment);
+}
+
+void Optimizer::step(ExecutionPlan& plan, const vector<float>& gradient_acc, float gradient_scale, float learning_rate) {
+	const size_t num_parameters = plan.parameters.size();
+	if (m_first_moment.size() != num_parameters) {
+		reset(num_parameters);
+	}
+	m_steps++;
+
+	// The switch is outside the loops so each one is straight line arithmetic over the flat
+	// arrays, only the parameter values themselves are reached through their registers
+	float* values = plan.values.data();
+	const Register* registers = plan.parameter_registers.data();
+	const float* gradients = gradient_acc.data();
+	float* first = m_first_moment.data();
+	float* second = m_second_moment.data();
+	const float momentum = m_momentum;
+	const float decay = m_decay;
+	const float epsilon = m_epsilon;
+
+	switch (m_type) {
+	case OptimizerType::SGD:
+	{
+		const float rate = learning_rate * gradient_scale;
+		for (size_t p = 0; p < num_parameters; p++) {
+			values[registers[p]] -= rate * gradients[p];
+		}
+	}
+	break;
+	case OptimizerType::Momentum:
+		for (size_t p = 0; p < num_parameters; p++) {
+			float velocity = momentum * first[p] + gradients[p] * gradient_scale;
+			first[p] = velocity;
+			values[registers[p]] -= learning_rate * velocity;
+		}
+		break;
+	case OptimizerType::RMSProp:
+		for (size_t p = 0; p < num_parameters; p++) {
+			float gradient = gradients[p] * gradient_scale;
+			float mean_square = decay * second[p] + (1.f - decay) * gradient * gradient;
+			second[p] = mean_square;
+			values[registers[p]] -= learning_rate * gradient / (std::sqrt(mean_square) + epsilon);
+		}
+		break;
+	case OptimizerType::Adam:
+	{
+		// bias corrections folded into the step size
+		const float first_correction = 1.f - std::pow(momentum, (float)m_steps);
+		const float second_correction = 1.f - std::pow(decay, (float)m_steps);
+		const float rate = learning_rate * std::sqrt(second_correction) / first_correction;
+		const float corrected_epsilon = epsilon * std::sqrt(second_correction);
+		for (size_t p = 0; p < num_parameters; p++) {
+			float gradient = gradients[p] * gradient_scale;
+			float mean = momentum * first[p] + (1.f - momentum) * gradient;
+			float mean_square = decay * second[p] + (1.f - decay) * gradient * gradient;
+			first[p] = mean;
+			second[p] = mean_square;
+			values[registers[p]] -= rate * mean / (std::sqrt(mean_square) + corrected_epsilon);
+		}
+	}
+	break;
+	default:
+		break;
+	}
+}
+
+static double dot(const vector<float>& a, const vector<float>& b) {
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); i++) {
+		sum += (double)a[i] * (double)b[i];
+	}
+	return sum;
+}
+
+void LbfgsOptimizer::reset() {
+	m_s.clear();
+	m_y.clear();
+	m_rho.clear();
+	m_evaluated = false;
+}
+
+float LbfgsOptimizer::step(vector<float>& parameters, const Evaluate& evaluate) {
+	const size_t n = parameters.size();
+	if (!m_evaluated || m_gradient.size() != n) {
+		reset();
+		m_loss = evaluate(parameters, m_gradient);
+		m_evaluated = true;
+	}
+
+	// Two loop recursion, direction = -H * gradient
+	m_direction = m_gradient;
+	const size_t history = m_s.size();
+	m_alpha.resize(history);
+	for (size_t i = history; i-- > 0;) {
+		m_alpha[i] = m_rho[i] * (float)dot(m_s[i], m_direction);
+		for (size_t p = 0; p < n; p++) {
+			m_direction[p] -= m_alpha[i] * m_y[i][p];
+		}
+	}
+	// Scale of the initial Hessian, without any history the first step is one unit long
+	float scale = history > 0
+		? (float)(dot(m_s.back(), m_y.back()) / dot(m_y.back(), m_y.back()))
+		: (float)(1.0 / ImMax(std::sqrt(dot(m_gradient, m_gradient)), 1.0));
+	for (size_t p = 0; p < n; p++) {
+		m_direction[p] *= scale;
+	}
+	for (size_t i = 0; i < history; i++) {
+		float beta = m_rho[i] * (float)dot(m_y[i], m_direction);
+		for (size_t p = 0; p < n; p++) {
+			m_direction[p] += m_s[i][p] * (m_alpha[i] - beta);
+		}
+	}
+	for (size_t p = 0; p < n; p++) {
+		m_direction[p] = -m_direction[p];
+	}
+
+	double slope = dot(m_gradient, m_direction);
+	if (slope >= 0.0) {
+		// the history stopped describing the loss, fall back to steepest descent
+		reset();
+		m_evaluated = true;
+		scale = (float)(1.0 / ImMax(std::sqrt(dot(m_gradient, m_gradient)), 1.0));
+		for (size_t p = 0; p < n; p++) {
+			m_direction[p] = -m_gradient[p] * scale;
+		}
+		slope = dot(m_gradient, m_direction);
+		if (slope >= 0.0)
+			return m_loss;
+	}
+
+	// Backtracking until the loss drops enough (Armijo)
+	float step_size = 1.f;
+	bool accepted = false;
+	float trial_loss = m_loss;
+	m_trial.resize(n);
+	for (int tries = 0; tries < 30; tries++) {
+		for (size_t p = 0; p < n; p++) {
+			m_trial[p] = parameters[p] + step_size * m_direction[p];
+		}
+		trial_loss = evaluate(m_trial, m_trial_gradient);
+		if (std::isfinite(trial_loss) && trial_loss <= m_loss + 1e-4f * step_size * (float)slope) {
+			accepted = true;
+			break;
+		}
+		step_size *= 0.5f;
+	}
+	if (!accepted) {
+		// leave the parameters where they were and start over from plain gradients
+		reset();
+		return m_loss;
+	}
+
+	vector<float> s(n);
+	vector<float> y(n);
+	for (size_t p = 0; p < n; p++) {
+		s[p] = m_trial[p] - parameters[p];
+		y[p] = m_trial_gradient[p] - m_gradient[p];
+	}
+	// only keep pairs that keep the approximation positive definite
+	double curvature = dot(s, y);
+	if (curvature > 1e-10) {
+		if (m_s.size() >= m_history_size) {
+			m_s.erase(m_s.begin());
+			m_y.erase(m_y.begin());
+			m_rho.erase(m_rho.begin());
+		}
+		m_s.push_back(std::move(s));
+		m_y.push_back(std::move(y));
+		m_rho.push_back((float)(1.0 / curvature));
+	}
+
+	parameters.swap(m_trial);
+	m_gradient.swap(m_trial_gradient);
+	m_loss = trial_loss;
+	return m_loss;
+}
+
+void EvolutionStrategy::reset(const vector<float>& mean) {
+	const size_t n = mean.size();
+	const float dimensions = (float)ImMax(n, (size_t)1);
+
+	// Default strategy parameters, with the separable learning rates for the covariance
+	m_population_size = 4 + (unsigned)(3.f * std::log(dimensions));
+	m_parents = m_population_size / 2;
+	m_weights.resize(m_parents);
+	float weight_sum = 0.f;
+	for (unsigned i = 0; i < m_parents; i++) {
+		m_weights[i] = std::log(m_parents + 0.5f) - std::log(i + 1.f);
+		weight_sum += m_weights[i];
+	}
+	float square_sum = 0.f;
+	for (float& weight : m_weights) {
+		weight /= weight_sum;
+		square_sum += weight * weight;
+	}
+	m_mu_eff = 1.f / square_sum;
+
+	m_c_sigma = (m_mu_eff + 2.f) / (dimensions + m_mu_eff + 5.f);
+	m_d_sigma = 1.f + 2.f * ImMax(0.f, std::sqrt((m_mu_eff - 1.f) / (dimensions + 1.f)) - 1.f) + m_c_sigma;
+	m_c_c = (4.f + m_mu_eff / dimensions) / (dimensions + 4.f + 2.f * m_mu_eff / dimensions);
+	float separable = (dimensions + 2.f) / 3.f;
+	m_c_1 = ImMin(separable * 2.f / ((dimensions + 1.3f) * (dimensions + 1.3f) + m_mu_eff), 1.f);
+	m_c_mu = ImMin(1.f - m_c_1, separable * 2.f * (m_mu_eff - 2.f + 1.f / m_mu_eff) / ((dimensions + 2.f) * (dimensions + 2.f) + m_mu_eff));
+	m_expected_norm = std::sqrt(dimensions) * (1.f - 1.f / (4.f * dimensions) + 1.f / (21.f * dimensions * dimensions));
+
+	m_mean = mean;
+	m_step_size = m_initial_step_size;
+	m_variance.assign(n, 1.f);
+	m_deviation.assign(n, 1.f);
+	m_path_sigma.assign(n, 0.f);
+	m_path_c.assign(n, 0.f);
+	m_generation = 0;
+}
+
+float EvolutionStrategy::noise(unsigned k, size_t p) const {
+	uint64_t counter = ((m_generation * m_population_size + k) * (uint64_t)m_mean.size()) + p;
+	return counter_random_normal(m_seed, counter);
+}
+
+void EvolutionStrategy::update(const vector<float>& losses) {
+	const size_t n = m_mean.size();
+
+	m_order.resize(m_population_size);
+	for (unsigned k = 0; k < m_population_size; k++) {
+		m_order[k] = k;
+	}
+	// NaN losses sort last
+	std::stable_sort(m_order.begin(), m_order.end(), [&](unsigned a, unsigned b) {
+		return losses[a] < losses[b] || (std::isnan(losses[b]) && !std::isnan(losses[a]));
+	});
+
+	const float path_sigma_scale = std::sqrt(m_c_sigma * (2.f - m_c_sigma) * m_mu_eff);
+	const float path_c_scale = std::sqrt(m_c_c * (2.f - m_c_c) * m_mu_eff);
+
+	// The steps are weighted means of the parents' noise, the path update needs the length of
+	// the sigma path first so it's done in two passes
+	double path_sigma_norm = 0.0;
+	for (size_t p = 0; p < n; p++) {
+		float z = 0.f;
+		for (unsigned i = 0; i < m_parents; i++) {
+			z += m_weights[i] * noise(m_order[i], p);
+		}
+		m_path_sigma[p] = (1.f - m_c_sigma) * m_path_sigma[p] + path_sigma_scale * z;
+		path_sigma_norm += (double)m_path_sigma[p] * m_path_sigma[p];
+	}
+	path_sigma_norm = std::sqrt(path_sigma_norm);
+
+	float decay = 1.f - std::pow(1.f - m_c_sigma, 2.f * (float)(m_generation + 1));
+	bool stalled = path_sigma_norm / std::sqrt(ImMax(decay, 1e-12f)) >= (1.4f + 2.f / (n + 1.f)) * m_expected_norm;
+	float h_sigma = stalled ? 0.f : 1.f;
+
+	for (size_t p = 0; p < n; p++) {
+		float y = 0.f;
+		float rank_mu = 0.f;
+		for (unsigned i = 0; i < m_parents; i++) {
+			float y_i = m_deviation[p] * noise(m_order[i], p);
+			y += m_weights[i] * y_i;
+			rank_mu += m_weights[i] * y_i * y_i;
+		}
+		m_mean[p] += m_step_size * y;
+		m_path_c[p] = (1.f - m_c_c) * m_path_c[p] + h_sigma * path_c_scale * y;
+		m_variance[p] = (1.f - m_c_1 - m_c_mu) * m_variance[p]
+			+ m_c_1 * (m_path_c[p] * m_path_c[p] + (1.f - h_sigma) * m_c_c * (2.f - m_c_c) * m_variance[p])
+			+ m_c_mu * rank_mu;
+		m_deviation[p] = std::sqrt(m_variance[p]);
+	}
+
+	m_step_size *= std::exp((m_c_sigma / m_d_sigma) * ((float)path_sigma_norm / m_expected_norm - 1.f));
+	m_step_size = ImClamp(m_step_size, 1e-8f, 1e4f);
+	m_generation++;
+}
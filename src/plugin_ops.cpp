@@ -0,0 +1,119 @@
+#include "plugin_ops.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <dlfcn.h>
+#endif
+
+#include <cstring>
+
+PluginRegistry& PluginRegistry::shared() {
+	static PluginRegistry registry;
+	return registry;
+}
+
+int PluginRegistry::load_directory(const char* directory) {
+	vector<std::string> paths;
+#ifdef _WIN32
+	WIN32_FIND_DATAA find_data;
+	HANDLE find = FindFirstFileA((std::string(directory) + "\\*.dll").c_str(), &find_data);
+	if (find != INVALID_HANDLE_VALUE) {
+		do {
+			paths.push_back(std::string(directory) + "\\" + find_data.cFileName);
+		} while (FindNextFileA(find, &find_data));
+		FindClose(find);
+	}
+#else
+	DIR* dir = opendir(directory);
+	if (dir) {
+		while (dirent* entry = readdir(dir)) {
+			const char* extension = strrchr(entry->d_name, '.');
+			if (extension && (strcmp(extension, ".so") == 0 || strcmp(extension, ".dylib") == 0)) {
+				paths.push_back(std::string(directory) + "/" + entry->d_name);
+			}
+		}
+		closedir(dir);
+	}
+#endif
+
+	int loaded = 0;
+	for (const std::string& path : paths) {
+		if (load_library(path.c_str()))
+			loaded++;
+	}
+	return loaded;
+}
+
+bool PluginRegistry::load_library(const char* path) {
+#ifdef _WIN32
+	HMODULE library = LoadLibraryA(path);
+	if (!library) {
+		std::cout << "Couldn't load plugin " << path << std::endl;
+		return false;
+	}
+	MlgardenRegisterOps register_ops = (MlgardenRegisterOps)GetProcAddress(library, MLGARDEN_REGISTER_OPS_SYMBOL);
+#else
+	void* library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!library) {
+		std::cout << "Couldn't load plugin " << path << ": " << dlerror() << std::endl;
+		return false;
+	}
+	MlgardenRegisterOps register_ops = (MlgardenRegisterOps)dlsym(library, MLGARDEN_REGISTER_OPS_SYMBOL);
+#endif
+	if (!register_ops) {
+		std::cout << path << " doesn't export " << MLGARDEN_REGISTER_OPS_SYMBOL << std::endl;
+		return false;
+	}
+
+	if (!register_ops(MLGARDEN_PLUGIN_API_VERSION, &PluginRegistry::register_op, this)) {
+		std::cout << path << " doesn't support plugin api version " << MLGARDEN_PLUGIN_API_VERSION << std::endl;
+		return false;
+	}
+	m_libraries.push_back((void*)library);
+	std::cout << "Loaded plugin " << path << std::endl;
+	return true;
+}
+
+void PluginRegistry::register_op(void* registry, const MlgardenOp* op) {
+	PluginRegistry& self = *(PluginRegistry*)registry;
+	if (!op || !op->name || !op->forward) {
+		std::cout << "Plugin op without a name or forward kernel, skipped" << std::endl;
+		return;
+	}
+	if (op->num_inputs > MAX_INPUTS) {
+		std::cout << "Plugin op " << op->name << " has more than " << MAX_INPUTS << " inputs, skipped" << std::endl;
+		return;
+	}
+
+	// a placeholder from a graph loaded earlier gets its kernels now, a second op with the
+	// same name replaces the first
+	unsigned index = self.find_or_add(op->name);
+	PluginOp& plugin_op = self.m_ops[index];
+	plugin_op.num_inputs = op->num_inputs;
+	plugin_op.forward = op->forward;
+	plugin_op.backward = op->backward;
+	plugin_op.forward_batch = op->forward_batch;
+	plugin_op.backward_batch = op->backward_batch;
+	plugin_op.user_data = op->user_data;
+}
+
+unsigned PluginRegistry::find(const std::string& name) const {
+	for (unsigned i = 0; i < m_ops.size(); i++) {
+		if (m_ops[i].name == name)
+			return i;
+	}
+	return NULL_INDEX;
+}
+
+unsigned PluginRegistry::find_or_add(const std::string& name) {
+	unsigned index = find(name);
+	if (index != NULL_INDEX)
+		return index;
+	PluginOp op;
+	op.name = name;
+	m_ops.push_back(op);
+	return (unsigned)m_ops.size() - 1;
+}
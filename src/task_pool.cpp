@@ -0,0 +1,252 @@
+#include "task_pool.h"
+
+TaskPool::TaskPool(unsigned num_workers) {
+	for (unsigned queue = 0; queue < num_workers; queue++) {
+		m_queues.emplace_back(new Queue());
+	}
+	for (unsigned worker = 0; worker < num_workers; worker++) {
+		m_workers.emplace_back(&TaskPool::run_worker, this, worker);
+	}
+}
+
+TaskPool::~TaskPool() {
+	m_stop.store(true);
+	wake_workers(true);
+	for (std::thread& worker : m_workers) {
+		worker.join();
+	}
+}
+
+TaskPool& TaskPool::shared() {
+	static TaskPool pool(std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0);
+	return pool;
+}
+
+void TaskPool::parallel_for(unsigned count, const std::function<void(unsigned)>& task, TaskPriority priority) {
+	if (count == 0)
+		return;
+	if (m_workers.empty() || count == 1) {
+		for (unsigned i = 0; i < count; i++) {
+			task(i);
+		}
+		return;
+	}
+
+	std::atomic<unsigned> remaining{ count };
+	unsigned first_queue = m_next_queue.fetch_add(1, std::memory_order_relaxed);
+	for (unsigned i = 0; i < count; i++) {
+		Task item;
+		item.function = &task;
+		item.index = i;
+		item.remaining = &remaining;
+		push((first_queue + i) % m_queues.size(), priority, item);
+	}
+	wake_workers(true);
+
+	// help out until everything's done. Other callers' tasks might get run too, but nothing
+	// less urgent than this, the editor's frame shouldn't wait on a training step.
+	Task stolen;
+	while (remaining.load(std::memory_order_acquire) > 0) {
+		if (steal(first_queue, stolen, priority)) {
+			run(stolen);
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+TaskHandle TaskPool::submit(std::function<void()> work, TaskPriority priority, const std::vector<TaskHandle>& dependencies) {
+	return add_task(std::move(work), priority, false, dependencies);
+}
+
+TaskHandle TaskPool::submit_main_thread(std::function<void()> work, const std::vector<TaskHandle>& dependencies) {
+	return add_task(std::move(work), TaskPriority::Interactive, true, dependencies);
+}
+
+TaskHandle TaskPool::add_task(std::function<void()> work, TaskPriority priority, bool main_thread, const std::vector<TaskHandle>& dependencies) {
+	TaskHandle state = std::make_shared<TaskState>();
+	state->m_work = std::move(work);
+	state->m_priority = priority;
+	state->m_main_thread = main_thread;
+
+	for (const TaskHandle& dependency : dependencies) {
+		std::lock_guard<std::mutex> lock(dependency->m_mutex);
+		if (!dependency->m_done.load(std::memory_order_acquire)) {
+			state->m_unfinished_dependencies.fetch_add(1, std::memory_order_relaxed);
+			dependency->m_dependents.push_back(state);
+		}
+	}
+
+	if (state->m_unfinished_dependencies.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		schedule(state);
+	}
+	return state;
+}
+
+TaskHandle TaskPool::then(const TaskHandle& task, std::function<void()> work, TaskPriority priority) {
+	return submit(std::move(work), priority, { task });
+}
+
+bool TaskPool::is_done(const TaskHandle& task) const {
+	return !task || task->m_done.load(std::memory_order_acquire);
+}
+
+void TaskPool::wait(const TaskHandle& task) {
+	Task stolen;
+	while (!is_done(task)) {
+		if (steal(0, stolen, task->m_priority)) {
+			run(stolen);
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void TaskPool::run_main_thread_tasks() {
+	std::vector<TaskHandle> tasks;
+	{
+		std::lock_guard<std::mutex> lock(m_main_thread_mutex);
+		tasks.swap(m_main_thread_tasks);
+	}
+	for (TaskHandle& state : tasks) {
+		Task task;
+		task.state = state;
+		run(task);
+	}
+}
+
+void TaskPool::schedule(const TaskHandle& state) {
+	if (state->m_main_thread) {
+		std::lock_guard<std::mutex> lock(m_main_thread_mutex);
+		m_main_thread_tasks.push_back(state);
+		return;
+	}
+
+	Task task;
+	task.state = state;
+	if (m_workers.empty()) {
+		run(task);
+		return;
+	}
+	push(m_next_queue.fetch_add(1, std::memory_order_relaxed) % m_queues.size(), state->m_priority, task);
+	wake_workers(false);
+}
+
+void TaskPool::reserve_threads(unsigned count) {
+	std::lock_guard<std::mutex> lock(m_sleep_mutex);
+	m_reserved_threads.fetch_add(count, std::memory_order_relaxed);
+}
+
+void TaskPool::release_threads(unsigned count) {
+	{
+		std::lock_guard<std::mutex> lock(m_sleep_mutex);
+		m_reserved_threads.fetch_sub(count, std::memory_order_relaxed);
+	}
+	m_wake.notify_all();
+}
+
+bool TaskPool::is_awake(unsigned worker) const {
+	// m_workers is still being filled in while the first workers start, the queues are done
+	return worker == 0 || worker + m_reserved_threads.load(std::memory_order_relaxed) < m_queues.size();
+}
+
+void TaskPool::wake_workers(bool all) {
+	// taking the lock means a worker is either before its check of m_queued or waiting
+	{
+		std::lock_guard<std::mutex> lock(m_sleep_mutex);
+	}
+	// a single notify could go to a worker that's been put to sleep and get lost
+	if (all || m_reserved_threads.load(std::memory_order_relaxed) > 0) {
+		m_wake.notify_all();
+	}
+	else {
+		m_wake.notify_one();
+	}
+}
+
+void TaskPool::push(unsigned queue, TaskPriority priority, Task task) {
+	{
+		std::lock_guard<std::mutex> lock(m_queues[queue]->mutex);
+		m_queues[queue]->tasks[(int)priority].push_back(std::move(task));
+	}
+	m_queued.fetch_add(1, std::memory_order_release);
+}
+
+bool TaskPool::pop(unsigned queue, Task& task) {
+	Queue& own = *m_queues[queue];
+	std::lock_guard<std::mutex> lock(own.mutex);
+	for (auto& tasks : own.tasks) {
+		if (!tasks.empty()) {
+			task = std::move(tasks.back());
+			tasks.pop_back();
+			m_queued.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool TaskPool::steal(unsigned thief, Task& task, TaskPriority lowest) {
+	if (m_queued.load(std::memory_order_acquire) == 0)
+		return false;
+	// go through every queue once per priority so a busy queue's background work doesn't
+	// get taken ahead of another queue's interactive work
+	for (int priority = 0; priority <= (int)lowest; priority++) {
+		for (unsigned i = 1; i <= m_queues.size(); i++) {
+			Queue& victim = *m_queues[(thief + i) % m_queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			auto& tasks = victim.tasks[priority];
+			if (!tasks.empty()) {
+				task = std::move(tasks.front());
+				tasks.pop_front();
+				m_queued.fetch_sub(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool TaskPool::find_task(unsigned queue, Task& task) {
+	return pop(queue, task) || steal(queue, task);
+}
+
+void TaskPool::run(Task& task) {
+	if (!task.state) {
+		(*task.function)(task.index);
+		task.remaining->fetch_sub(1, std::memory_order_release);
+		return;
+	}
+
+	TaskHandle state = std::move(task.state);
+	state->m_work();
+	state->m_work = nullptr;
+
+	std::vector<TaskHandle> dependents;
+	{
+		std::lock_guard<std::mutex> lock(state->m_mutex);
+		state->m_done.store(true, std::memory_order_release);
+		dependents.swap(state->m_dependents);
+	}
+	for (const TaskHandle& dependent : dependents) {
+		if (dependent->m_unfinished_dependencies.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			schedule(dependent);
+		}
+	}
+}
+
+void TaskPool::run_worker(unsigned worker) {
+	Task task;
+	while (!m_stop.load(std::memory_order_relaxed)) {
+		if (is_awake(worker) && find_task(worker, task)) {
+			run(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(m_sleep_mutex);
+		m_wake.wait(lock, [this, worker] {
+			return m_stop.load(std::memory_order_relaxed) || (is_awake(worker) && m_queued.load(std::memory_order_acquire) > 0);
+		});
+	}
+}
@@ -0,0 +1,705 @@
+#include "trainer.h"
+
+#include <algorithm>
+#include <limits>
+
+Trainer::~Trainer() {
+	stop();
+}
+
+void Trainer::start(ComputationGraph& graph, int steps, float average_error) {
+	stop();
+
+	graph.compile_plan();
+	m_plan = graph.plan;
+	m_plan.load_parameters(graph);
+	// pipeline stages run levels on their own, that doesn't go with recomputing segments
+	m_plan.plan_memory(false, m_checkpointing && m_mode != TrainingMode::Pipeline);
+	m_plan.priority = TaskPriority::Background;
+	m_plan_version = graph.plan_version;
+	m_unplanned_registers = m_plan.unplanned_registers;
+	m_planned_registers = m_plan.num_registers();
+	m_data = graph.data_source.data;
+	m_current_point = 0;
+	m_sequence_point = 0;
+	m_gradient_sum.m_precision = m_precision;
+	m_gradient_sum.reset(m_plan.parameters.size());
+	m_optimizer.m_type = m_optimizer_type;
+	m_optimizer.reset(m_plan.parameters.size());
+	m_lbfgs.reset();
+	m_evolution.clear();
+	m_steps = steps;
+	m_average_error = average_error;
+
+	m_commands.drain([](TrainerCommand&) {});
+
+	// Sized up front with room for the graph to grow, the thread only ever writes into them
+	m_snapshot_capacity = ImMax((unsigned)m_plan.parameters.size() * 2, 64u);
+	for (int slot = 0; slot < 2; slot++) {
+		m_snapshots[slot].m_parameters.reset(new std::atomic<float>[m_snapshot_capacity]());
+		m_sequence[slot].store(0, std::memory_order_relaxed);
+	}
+	m_latest.store(0, std::memory_order_relaxed);
+
+	if (m_data.empty())
+		return;
+
+	m_running.store(true, std::memory_order_relaxed);
+
+	// the trainer's own thread is the first worker. Every worker gets a stream of its own,
+	// minstd_rand takes a seed of 0 as 1 so they start from 1.
+	m_random.seed(m_seed + 1);
+	m_helpers.clear();
+	m_pipeline_slots.clear();
+	m_sample_counter = 0;
+	if (m_mode != TrainingMode::Synchronous) {
+		if (m_mode == TrainingMode::Hogwild) {
+			m_shared_parameters.reset(new std::atomic<float>[m_snapshot_capacity]);
+		}
+		m_round.store(0, std::memory_order_relaxed);
+		m_finished.store(0, std::memory_order_relaxed);
+		m_helper_plans_dirty = false;
+		m_helpers.resize(ImMax(m_num_workers, 1) - 1);
+		for (unsigned helper = 0; helper < m_helpers.size(); helper++) {
+			m_helpers[helper].m_plan = m_plan;
+			m_helpers[helper].m_random.seed(m_seed + helper + 2);
+			m_helpers[helper].m_thread = std::thread(&Trainer::run_helper, this, helper);
+		}
+	}
+
+	// the threads keep their cores busy, the pool leaves them be rather than oversubscribe
+	m_reserved_threads = m_helpers.size() + 1;
+	TaskPool::shared().reserve_threads(m_reserved_threads);
+	m_thread = std::thread(&Trainer::run, this);
+}
+
+void Trainer::stop() {
+	{
+		std::lock_guard<std::mutex> lock(m_wake_mutex);
+		m_running.store(false, std::memory_order_relaxed);
+	}
+	m_wake.notify_all();
+	{
+		std::lock_guard<std::mutex> lock(m_round_mutex);
+	}
+	m_round_wake.notify_all();
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+	for (Helper& helper : m_helpers) {
+		if (helper.m_thread.joinable()) {
+			helper.m_thread.join();
+		}
+	}
+	m_helpers.clear();
+	TaskPool::shared().release_threads(m_reserved_threads);
+	m_reserved_threads = 0;
+}
+
+bool Trainer::submit_plan(ComputationGraph& graph) {
+	graph.compile_plan();
+	if (graph.plan.parameters.size() > m_snapshot_capacity)
+		return false;
+
+	TrainerCommand command;
+	command.m_type = TrainerCommandType::SetPlan;
+	command.m_plan = graph.plan;
+	command.m_plan.load_parameters(graph);
+	command.m_plan.plan_memory(false, m_checkpointing && m_mode != TrainingMode::Pipeline);
+	command.m_plan_version = graph.plan_version;
+	m_unplanned_registers = command.m_plan.unplanned_registers;
+	m_planned_registers = command.m_plan.num_registers();
+	push_command(std::move(command));
+	return true;
+}
+
+void Trainer::submit_parameters(const vector<Index>& nodes, const vector<float>& values) {
+	TrainerCommand command;
+	command.m_type = TrainerCommandType::SetParameters;
+	command.m_nodes = nodes;
+	command.m_values = values;
+	push_command(std::move(command));
+}
+
+void Trainer::submit_data(const vector<DataPoint>& data) {
+	TrainerCommand command;
+	command.m_type = TrainerCommandType::SetData;
+	command.m_data = data;
+	push_command(std::move(command));
+}
+
+void Trainer::push_command(TrainerCommand command) {
+	m_commands.push(std::move(command));
+	// taking the lock means the thread is either before its check of the queue or waiting
+	{
+		std::lock_guard<std::mutex> lock(m_wake_mutex);
+	}
+	m_wake.notify_one();
+}
+
+void Trainer::apply_command(TrainerCommand& command) {
+	// any edit changes the loss the history was built on
+	m_lbfgs.reset();
+	m_evolution.clear();
+	switch (command.m_type) {
+	case TrainerCommandType::SetPlan:
+	{
+		// carry over what's been learned so far for parameters that are still there
+		map<Index, float> trained;
+		for (size_t p = 0; p < m_plan.parameters.size(); p++) {
+			trained[m_plan.parameters[p]] = m_plan.values[m_plan.parameter_registers[p]];
+		}
+		m_optimizer.remap(m_plan.parameters, command.m_plan.parameters);
+		m_plan = std::move(command.m_plan);
+		m_plan.priority = TaskPriority::Background;
+		m_plan_version = command.m_plan_version;
+		for (size_t p = 0; p < m_plan.parameters.size(); p++) {
+			auto it = trained.find(m_plan.parameters[p]);
+			if (it != trained.end()) {
+				m_plan.values[m_plan.parameter_registers[p]] = it->second;
+			}
+		}
+		m_gradient_sum.reset(m_plan.parameters.size());
+		m_helper_plans_dirty = true;
+		// the new plan's delays start from 0, so the sequence does too
+		m_sequence_point = 0;
+	}
+	break;
+	case TrainerCommandType::SetParameters:
+		for (size_t i = 0; i < command.m_nodes.size(); i++) {
+			Index node = command.m_nodes[i];
+			if (node < m_plan.node_register.size() && m_plan.node_register[node] != NULL_INDEX) {
+				m_plan.values[m_plan.node_register[node]] = command.m_values[i];
+			}
+		}
+		break;
+	case TrainerCommandType::SetData:
+		m_data = std::move(command.m_data);
+		m_current_point = 0;
+		m_sequence_point = 0;
+		m_plan.reset_state();
+		break;
+	}
+}
+
+void Trainer::run() {
+	while (m_running.load(std::memory_order_relaxed)) {
+		m_commands.drain([this](TrainerCommand& command) { apply_command(command); });
+		if (m_data.empty()) {
+			// nothing to train on until a command brings data
+			std::unique_lock<std::mutex> lock(m_wake_mutex);
+			m_wake.wait(lock, [this]() {
+				return !m_commands.empty() || !m_running.load(std::memory_order_relaxed);
+			});
+			continue;
+		}
+
+		auto batch_start = std::chrono::steady_clock::now();
+		int batch_size = ImMax(m_batch_size.load(std::memory_order_relaxed), 1);
+		float learning_rate = m_learning_rate.load(std::memory_order_relaxed);
+		float error = 0.f;
+		if (m_plan.has_state()) {
+			error = sequence_batch(batch_size, learning_rate);
+			m_steps += batch_size;
+		}
+		else if (m_mode == TrainingMode::Hogwild) {
+			hogwild_round(batch_size, learning_rate);
+			m_steps += batch_size * (m_helpers.size() + 1);
+		}
+		else if (m_mode == TrainingMode::Pipeline) {
+			pipeline_batch(batch_size, learning_rate);
+			m_steps += batch_size;
+			const ExecutionPlan& last = m_pipeline_slots[(batch_size - 1) % m_pipeline_slots.size()];
+			error = last.loss();
+		}
+		else if (m_mode == TrainingMode::Evolution) {
+			error = evolution_generation(batch_size);
+			m_steps += batch_size * m_evolution.population_size();
+		}
+		else if (m_mode == TrainingMode::LBFGS) {
+			// the exact loss over the data set, nothing to smooth
+			m_average_error = lbfgs_iteration();
+			error = m_average_error;
+		}
+		else if (m_mode == TrainingMode::Deterministic) {
+			deterministic_batch(batch_size, learning_rate);
+			m_steps += batch_size;
+			error = m_leaf_errors.back();
+		}
+		else {
+			synchronous_batch(batch_size, learning_rate);
+			m_steps += batch_size;
+		}
+		// stop() cut the step short, there's nothing settled to publish
+		if (!m_running.load(std::memory_order_relaxed))
+			break;
+		if (!m_plan.has_state() && (m_mode == TrainingMode::Synchronous || m_mode == TrainingMode::Hogwild)) {
+			error = m_plan.loss();
+		}
+
+		if (m_average_error <= 0.0f)
+			m_average_error = error;
+		else
+			m_average_error = error * 0.001f + m_average_error * 0.999f;
+
+		publish();
+
+		// Leave the cores to the editor for part of the time if it's been falling behind
+		float duty_cycle = m_duty_cycle.load(std::memory_order_relaxed);
+		if (duty_cycle < 1.f) {
+			auto batch_time = std::chrono::steady_clock::now() - batch_start;
+			std::this_thread::sleep_for(batch_time * ((1.f - duty_cycle) / ImMax(duty_cycle, 0.01f)));
+		}
+	}
+}
+
+void Trainer::synchronous_batch(int batch_size, float learning_rate) {
+	m_gradient_sum.clear();
+
+	for (int i = 0; i < batch_size; i++) {
+		m_plan.accumulate_gradients(&m_data[next_point()].x, m_gradient_sum);
+	}
+
+	m_optimizer.step(m_plan, m_gradient_sum.result(), 1.f / (float)batch_size, learning_rate);
+}
+
+float Trainer::sequence_batch(int batch_size, float learning_rate) {
+	m_gradient_sum.clear();
+
+	float loss = 0.f;
+	int done = 0;
+	while (done < batch_size) {
+		// the sequence starts over from the first point, so does the state
+		if (m_sequence_point >= (int)m_data.size()) {
+			m_sequence_point = 0;
+			m_plan.reset_state();
+		}
+		int window = ImMin(ImMin(ImMax(m_sequence_window.load(std::memory_order_relaxed), 1), batch_size - done), (int)m_data.size() - m_sequence_point);
+		loss += m_plan.accumulate_sequence_gradients(&m_data[m_sequence_point].x, window, m_gradient_sum);
+		m_sequence_point += window;
+		done += window;
+	}
+
+	m_optimizer.step(m_plan, m_gradient_sum.result(), 1.f / (float)batch_size, learning_rate);
+	return loss / (float)batch_size;
+}
+
+int Trainer::next_point() {
+	if (m_current_point == 0) {
+		m_shuffled_points.clear();
+		for (int point = 0; point < m_data.size(); point++) {
+			m_shuffled_points.push_back(point);
+		}
+		std::shuffle(m_shuffled_points.begin(), m_shuffled_points.end(), m_random);
+	}
+	int point = m_shuffled_points[m_current_point];
+	m_current_point = (m_current_point + 1) % m_shuffled_points.size();
+	return point;
+}
+
+void Trainer::pipeline_batch(int batch_size, float learning_rate) {
+	unsigned num_stages = m_helpers.size() + 1;
+	if (m_helper_plans_dirty || m_pipeline_slots.empty()) {
+		split_pipeline_stages(m_plan, num_stages, m_stage_levels);
+		m_pipeline_slots.assign(num_stages, m_plan);
+		m_pipeline_schedules.resize(num_stages);
+		m_forwarded.reset(new std::atomic<unsigned>[num_stages]);
+		m_backwarded.reset(new std::atomic<unsigned>[num_stages]);
+		m_helper_plans_dirty = false;
+	}
+
+	for (ExecutionPlan& slot : m_pipeline_slots) {
+		for (size_t p = 0; p < m_plan.parameters.size(); p++) {
+			slot.values[m_plan.parameter_registers[p]] = m_plan.values[m_plan.parameter_registers[p]];
+		}
+	}
+	for (unsigned stage = 0; stage < num_stages; stage++) {
+		m_forwarded[stage].store(0, std::memory_order_relaxed);
+		m_backwarded[stage].store(0, std::memory_order_relaxed);
+	}
+	m_pipeline_points.clear();
+	for (int i = 0; i < batch_size; i++) {
+		m_pipeline_points.push_back(next_point());
+	}
+	m_gradient_sum.clear();
+
+	m_round_batch_size = batch_size;
+	if (!run_round())
+		return;
+
+	m_optimizer.step(m_plan, m_gradient_sum.result(), 1.f / (float)batch_size, learning_rate);
+}
+
+void Trainer::pipeline_stage(unsigned stage) {
+	const unsigned num_stages = m_pipeline_slots.size();
+	const unsigned num_points = m_round_batch_size;
+	const unsigned first_level = m_stage_levels[stage];
+	const unsigned end_level = m_stage_levels[stage + 1];
+
+	auto wait_for = [](const std::atomic<unsigned>& counter, unsigned count) {
+		while (counter.load(std::memory_order_acquire) < count) {
+			std::this_thread::yield();
+		}
+	};
+
+	auto forwards = [&](unsigned point) {
+		// a slot is reused once its previous point is all the way back through stage 0
+		ExecutionPlan& slot = m_pipeline_slots[point % num_stages];
+		if (stage == 0) {
+			slot.load_data(&m_data[m_pipeline_points[point]].x);
+			slot.clear_gradients();
+		}
+		else {
+			wait_for(m_forwarded[stage - 1], point + 1);
+		}
+		slot.forwards_levels(first_level, end_level);
+		m_forwarded[stage].store(point + 1, std::memory_order_release);
+	};
+
+	auto backwards = [&](unsigned point) {
+		ExecutionPlan& slot = m_pipeline_slots[point % num_stages];
+		if (stage + 1 < num_stages) {
+			wait_for(m_backwarded[stage + 1], point + 1);
+		}
+		if (slot.has_loss()) {
+			slot.backwards_levels(first_level, end_level);
+		}
+		if (stage == 0) {
+			m_gradient_sum.add(slot);
+		}
+		m_backwarded[stage].store(point + 1, std::memory_order_release);
+	};
+
+	vector<PipelineStep>& steps = m_pipeline_schedules[stage];
+	pipeline_schedule(stage, num_stages, num_points, steps);
+	for (const PipelineStep& step : steps) {
+		if (step.m_backwards) {
+			backwards(step.m_point);
+		}
+		else {
+			forwards(step.m_point);
+		}
+	}
+}
+
+void pipeline_schedule(unsigned stage, unsigned num_stages, unsigned num_points, vector<PipelineStep>& steps) {
+	steps.clear();
+	unsigned warmup = ImMin(num_stages - stage - 1, num_points);
+	unsigned forwarded = 0;
+	unsigned backwarded = 0;
+	while (forwarded < warmup) {
+		steps.push_back({ forwarded++, false });
+	}
+	while (forwarded < num_points) {
+		steps.push_back({ forwarded++, false });
+		steps.push_back({ backwarded++, true });
+	}
+	while (backwarded < num_points) {
+		steps.push_back({ backwarded++, true });
+	}
+}
+
+void split_pipeline_stages(const ExecutionPlan& plan, unsigned num_stages, vector<unsigned>& stage_levels) {
+	unsigned num_levels = plan.num_levels();
+	unsigned total_work = 0;
+	for (unsigned level = 0; level < num_levels; level++) {
+		total_work += plan.level_work(level);
+	}
+	stage_levels.assign(1, 0);
+	unsigned work = 0;
+	for (unsigned level = 0; level < num_levels; level++) {
+		work += plan.level_work(level);
+		if (stage_levels.size() < num_stages && work * num_stages >= total_work * stage_levels.size()) {
+			stage_levels.push_back(level + 1);
+		}
+	}
+	while (stage_levels.size() <= num_stages) {
+		stage_levels.push_back(num_levels);
+	}
+}
+
+void Trainer::sync_helper_plans() {
+	if (m_helper_plans_dirty) {
+		for (Helper& helper : m_helpers) {
+			helper.m_plan = m_plan;
+		}
+		m_helper_plans_dirty = false;
+	}
+}
+
+bool Trainer::run_round() {
+	unsigned round;
+	{
+		// checked under the lock so stop() either sees the round or the helpers never get it
+		std::lock_guard<std::mutex> lock(m_round_mutex);
+		if (!m_running.load(std::memory_order_relaxed))
+			return false;
+		round = m_round.fetch_add(1, std::memory_order_release) + 1;
+	}
+	m_round_wake.notify_all();
+
+	round_work(0, m_plan, m_random);
+
+	while (m_finished.load(std::memory_order_acquire) < round * m_helpers.size()) {
+		std::this_thread::yield();
+	}
+	return true;
+}
+
+void Trainer::round_work(unsigned worker, ExecutionPlan& plan, std::minstd_rand& random) {
+	if (m_mode == TrainingMode::Hogwild) {
+		hogwild_points(plan, random, m_round_batch_size, m_round_learning_rate);
+	}
+	else if (m_mode == TrainingMode::Pipeline) {
+		pipeline_stage(worker);
+	}
+	else if (m_mode == TrainingMode::Evolution) {
+		evolution_candidates(worker, plan);
+	}
+	else {
+		deterministic_leaves(worker, plan);
+	}
+}
+
+void Trainer::hogwild_round(int batch_size, float learning_rate) {
+	sync_helper_plans();
+	for (size_t p = 0; p < m_plan.parameters.size(); p++) {
+		m_shared_parameters[p].store(m_plan.values[m_plan.parameter_registers[p]], std::memory_order_relaxed);
+	}
+
+	m_round_batch_size = batch_size;
+	m_round_learning_rate = learning_rate;
+	if (!run_round())
+		return;
+
+	for (size_t p = 0; p < m_plan.parameters.size(); p++) {
+		m_plan.values[m_plan.parameter_registers[p]] = m_shared_parameters[p].load(std::memory_order_relaxed);
+	}
+}
+
+void Trainer::hogwild_points(ExecutionPlan& plan, std::minstd_rand& random, int batch_size, float learning_rate) {
+	std::uniform_int_distribution<int> pick(0, (int)m_data.size() - 1);
+	for (int i = 0; i < batch_size; i++) {
+		for (size_t p = 0; p < plan.parameters.size(); p++) {
+			plan.values[plan.parameter_registers[p]] = m_shared_parameters[p].load(std::memory_order_relaxed);
+		}
+
+		plan.forwards(&m_data[pick(random)].x);
+		if (!plan.has_loss())
+			continue;
+		plan.backwards();
+
+		// most parameters don't see a gradient from a given point, leave those alone
+		for (size_t p = 0; p < plan.parameters.size(); p++) {
+			float gradient = plan.gradients[plan.parameter_registers[p]];
+			if (gradient != 0.f) {
+				float value = m_shared_parameters[p].load(std::memory_order_relaxed);
+				m_shared_parameters[p].store(value - learning_rate * gradient, std::memory_order_relaxed);
+			}
+		}
+	}
+}
+
+void Trainer::deterministic_batch(int batch_size, float learning_rate) {
+	if (!sum_leaves(batch_size))
+		return;
+	m_optimizer.step(m_plan, m_leaf_gradients[0], 1.f / (float)batch_size, learning_rate);
+	m_sample_counter += batch_size;
+}
+
+bool Trainer::sum_leaves(int num_samples) {
+	sync_helper_plans();
+	for (Helper& helper : m_helpers) {
+		for (size_t p = 0; p < m_plan.parameters.size(); p++) {
+			helper.m_plan.values[m_plan.parameter_registers[p]] = m_plan.values[m_plan.parameter_registers[p]];
+		}
+	}
+
+	unsigned num_leaves = (num_samples + DETERMINISTIC_LEAF_SIZE - 1) / DETERMINISTIC_LEAF_SIZE;
+	m_leaf_gradients.resize(num_leaves);
+	m_leaf_errors.assign(num_leaves, 0.f);
+	m_round_batch_size = num_samples;
+	if (!run_round())
+		return false;
+
+	// pairwise, the shape only depends on the number of leaves
+	for (unsigned stride = 1; stride < num_leaves; stride *= 2) {
+		for (unsigned leaf = 0; leaf + stride < num_leaves; leaf += 2 * stride) {
+			vector<float>& sum = m_leaf_gradients[leaf];
+			const vector<float>& other = m_leaf_gradients[leaf + stride];
+			for (size_t p = 0; p < sum.size(); p++) {
+				sum[p] += other[p];
+			}
+		}
+	}
+	return true;
+}
+
+float Trainer::lbfgs_iteration() {
+	const size_t num_parameters = m_plan.parameters.size();
+	m_lbfgs_parameters.resize(num_parameters);
+	for (size_t p = 0; p < num_parameters; p++) {
+		m_lbfgs_parameters[p] = m_plan.values[m_plan.parameter_registers[p]];
+	}
+
+	const int num_points = (int)m_data.size();
+	float loss = m_lbfgs.step(m_lbfgs_parameters, [this, num_points](const vector<float>& parameters, vector<float>& gradient) {
+		for (size_t p = 0; p < parameters.size(); p++) {
+			m_plan.values[m_plan.parameter_registers[p]] = parameters[p];
+		}
+		// stopped, a NaN gets the step rejected and the iteration is thrown away anyway
+		if (!sum_leaves(num_points))
+			return std::numeric_limits<float>::quiet_NaN();
+		m_steps += num_points;
+
+		float error = 0.f;
+		for (float leaf_error : m_leaf_errors) {
+			error += leaf_error;
+		}
+		gradient.resize(parameters.size());
+		for (size_t p = 0; p < parameters.size(); p++) {
+			gradient[p] = m_leaf_gradients[0][p] / (float)num_points;
+		}
+		return error / (float)num_points;
+	});
+
+	// the line search leaves the plan at whichever point it tried last
+	for (size_t p = 0; p < num_parameters; p++) {
+		m_plan.values[m_plan.parameter_registers[p]] = m_lbfgs_parameters[p];
+	}
+	return loss;
+}
+
+float Trainer::evolution_generation(int batch_size) {
+	const size_t num_parameters = m_plan.parameters.size();
+	if (m_evolution.size() != num_parameters) {
+		vector<float> mean(num_parameters);
+		for (size_t p = 0; p < num_parameters; p++) {
+			mean[p] = m_plan.values[m_plan.parameter_registers[p]];
+		}
+		m_evolution.m_seed = m_seed;
+		m_evolution.reset(mean);
+	}
+
+	sync_helper_plans();
+	m_candidate_losses.assign(m_evolution.population_size(), 0.f);
+	m_round_batch_size = batch_size;
+	if (!run_round())
+		return 0.f;
+
+	m_evolution.update(m_candidate_losses);
+	m_sample_counter += batch_size;
+
+	const vector<float>& mean = m_evolution.mean();
+	for (size_t p = 0; p < num_parameters; p++) {
+		m_plan.values[m_plan.parameter_registers[p]] = mean[p];
+	}
+	return *std::min_element(m_candidate_losses.begin(), m_candidate_losses.end());
+}
+
+void Trainer::evolution_candidates(unsigned worker, ExecutionPlan& plan) {
+	unsigned num_workers = m_helpers.size() + 1;
+	int batch_size = m_round_batch_size;
+
+	for (unsigned k = worker; k < m_evolution.population_size(); k += num_workers) {
+		for (size_t p = 0; p < plan.parameters.size(); p++) {
+			plan.values[plan.parameter_registers[p]] = m_evolution.candidate_parameter(k, p);
+		}
+		// the same points for every candidate, so they're ranked on the parameters alone
+		float loss = 0.f;
+		for (int sample = 0; sample < batch_size; sample++) {
+			size_t point = counter_random(m_seed, m_sample_counter + sample) % m_data.size();
+			plan.forwards(&m_data[point].x);
+			loss += plan.loss();
+		}
+		m_candidate_losses[k] = loss / (float)batch_size;
+	}
+}
+
+void Trainer::deterministic_leaves(unsigned worker, ExecutionPlan& plan) {
+	unsigned num_workers = m_helpers.size() + 1;
+	unsigned num_leaves = m_leaf_gradients.size();
+	int batch_size = m_round_batch_size;
+	bool full_batch = m_mode == TrainingMode::LBFGS;
+
+	for (unsigned leaf = worker; leaf < num_leaves; leaf += num_workers) {
+		vector<float>& gradients = m_leaf_gradients[leaf];
+		gradients.assign(plan.parameters.size(), 0.f);
+		int end = ImMin(batch_size, (int)(leaf + 1) * DETERMINISTIC_LEAF_SIZE);
+		// full batch leaves cover the data in order and sum their losses, sampled ones keep the last
+		float error = 0.f;
+		for (int sample = leaf * DETERMINISTIC_LEAF_SIZE; sample < end; sample++) {
+			size_t point = full_batch ? sample : counter_random(m_seed, m_sample_counter + sample) % m_data.size();
+			plan.accumulate_gradients(&m_data[point].x, gradients);
+			float loss = plan.loss();
+			error = full_batch ? error + loss : loss;
+		}
+		m_leaf_errors[leaf] = error;
+	}
+}
+
+void Trainer::run_helper(unsigned helper) {
+	unsigned round = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(m_round_mutex);
+			m_round_wake.wait(lock, [&]() {
+				return m_round.load(std::memory_order_acquire) != round || !m_running.load(std::memory_order_relaxed);
+			});
+			// a round that's started still gets done, the trainer waits for it
+			if (m_round.load(std::memory_order_acquire) == round)
+				return;
+		}
+		round++;
+		round_work(helper + 1, m_helpers[helper].m_plan, m_helpers[helper].m_random);
+		m_finished.fetch_add(1, std::memory_order_release);
+	}
+}
+
+void Trainer::publish() {
+	// Write the slot the editor isn't looking at, then point it there
+	unsigned slot = 1 - m_latest.load(std::memory_order_relaxed);
+	unsigned sequence = m_sequence[slot].load(std::memory_order_relaxed);
+	m_sequence[slot].store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	PublishedSnapshot& snapshot = m_snapshots[slot];
+	for (size_t p = 0; p < m_plan.parameters.size(); p++) {
+		snapshot.m_parameters[p].store(m_plan.values[m_plan.parameter_registers[p]], std::memory_order_relaxed);
+	}
+	snapshot.m_num_parameters.store(m_plan.parameters.size(), std::memory_order_relaxed);
+	snapshot.m_plan_version.store(m_plan_version, std::memory_order_relaxed);
+	snapshot.m_average_error.store(m_average_error, std::memory_order_relaxed);
+	snapshot.m_steps.store(m_steps, std::memory_order_relaxed);
+
+	m_sequence[slot].store(sequence + 2, std::memory_order_release);
+	m_latest.store(slot, std::memory_order_release);
+}
+
+bool Trainer::read_snapshot(TrainingSnapshot& snapshot) const {
+	while (true) {
+		unsigned slot = m_latest.load(std::memory_order_acquire);
+		unsigned before = m_sequence[slot].load(std::memory_order_acquire);
+		if (before == 0)
+			return false;
+		if (before & 1)
+			continue;
+
+		const PublishedSnapshot& published = m_snapshots[slot];
+		// a torn count gets caught by the sequence check, it just mustn't read out of bounds
+		unsigned num_parameters = ImMin(published.m_num_parameters.load(std::memory_order_relaxed), m_snapshot_capacity);
+		snapshot.m_parameters.resize(num_parameters);
+		for (unsigned p = 0; p < num_parameters; p++) {
+			snapshot.m_parameters[p] = published.m_parameters[p].load(std::memory_order_relaxed);
+		}
+		snapshot.m_num_parameters = num_parameters;
+		snapshot.m_plan_version = published.m_plan_version.load(std::memory_order_relaxed);
+		snapshot.m_average_error = published.m_average_error.load(std::memory_order_relaxed);
+		snapshot.m_steps = published.m_steps.load(std::memory_order_relaxed);
+
+		// the thread lapped us and rewrote this slot while we were copying, try again
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_sequence[slot].load(std::memory_order_relaxed) == before)
+			return true;
+	}
+}
@@ -1,4 +1,5 @@
 #include "value.h"
+#include "plugin_ops.h"
 
 json Socket::to_json() const {
 	json j;
@@ -21,6 +22,11 @@ json Value::to_json() const {
 	j["parent"]    = m_parent;
 
 	j["variableNumConnections"] = m_variableNumConnections;
+	if (m_operation == Operation::Backwards)
+		j["weight"] = m_weight;
+	// plugin ops are numbered in the order they're loaded, files refer to them by name
+	if (is_plugin_operation(m_operation))
+		j["plugin"] = PluginRegistry::shared().op(m_operation).name;
 
 	if (m_name != nullptr) {
 		j["name"] = m_name;
@@ -39,9 +45,13 @@ void Value::from_json(json j) {
 	m_value =  j["value"];
 	m_parent = j["parent"];
 	m_operation = j["operation"];
+	if (j.contains("plugin"))
+		m_operation = plugin_operation(PluginRegistry::shared().find_or_add(j["plugin"].get<std::string>()));
 	m_variableNumConnections = j["variableNumConnections"];
 	if (j.contains("gradient") && !j["gradient"].is_null())
 		m_gradient = j["gradient"];
+	if (j.contains("weight"))
+		m_weight = j["weight"];
 	if (j.contains("name")) {
 		m_name = (char*)malloc(128);
 		std::string name;
@@ -68,6 +78,9 @@ vector<Index> Value::get_topological_sorted_descendants(Value* values) {
 vector<Index> Value::get_topological_sorted_descendants_inner(unordered_set<Index>& visited, Value* values) {
 	vector<Index> sorted_descendants;
 	visited.insert(m_index);
+	// a delay's input is from the previous step, following it would go round a recurrent loop
+	if (m_operation == Operation::Delay)
+		return { m_index };
 	for (const auto& input : m_inputs) {
 		if (input.node != NULL_INDEX && !visited.count(input.node)) {
 			vector<Index> m_parent1_descendants = values[input.node].get_topological_sorted_descendants_inner(visited, values);
@@ -95,132 +108,25 @@ inline float Value::get_value(int slot, float* data_values) {
 }
 
 void Value::single_forwards(Value* values, float* data_values) {
+	if (!is_computed_operation(m_operation))
+		return;
 
-	switch (m_operation) {
-	case Operation::Add:
-		m_value = get_input_value(values, 0, data_values) + get_input_value(values, 1, data_values);
-		break;
-	case Operation::Multiply:
-		m_value = get_input_value(values, 0, data_values) * get_input_value(values, 1, data_values);
-		break;
-	case Operation::Subtract:
-		m_value = get_input_value(values, 0, data_values) - get_input_value(values, 1, data_values);
-		break;
-	case Operation::Divide:
-		m_value = get_input_value(values, 0, data_values) / get_input_value(values, 1, data_values);
-		break;
-	case Operation::Power:
-		m_value = std::powf(get_input_value(values, 0, data_values), get_input_value(values, 1, data_values));
-		break;
-	case Operation::Tanh:
-		m_value = std::tanh(get_input_value(values, 0, data_values));
-		break;
-	case Operation::ReLU:
-		if (m_value > 0)
-			m_value = get_input_value(values, 0, data_values);
-		else
-			m_value = get_input_value(values, 0, data_values) * 0.1f;
-		break;
-	case Operation::Sin:
-		m_value = std::sin(get_input_value(values, 0, data_values));
-		break;
-	case Operation::Cos:
-		m_value = std::cos(get_input_value(values, 0, data_values));
-		break;
-	case Operation::Sqrt:
-		m_value = std::sqrt(get_input_value(values, 0, data_values));
-		break;
-	case Operation::Display:
-	case Operation::Result:
-	case Operation::Backwards:
-		m_value = get_input_value(values, 0, data_values);
-		break;
-	default:
-		//assert((false && "Unknown operation"));
-		break;
-	}
+	m_value = forward_operation(m_operation, get_input_value(values, 0, data_values), get_input_value(values, 1, data_values));
 }
 
 void Value::single_backwards(Value* values, float* data_values) {
-	switch (m_operation) {
-	case Operation::Add:
-		if (m_inputs[0].node != NULL_INDEX)
-			values[m_inputs[0].node].m_gradient += m_gradient;
-		if (m_inputs[1].node != NULL_INDEX)
-			values[m_inputs[1].node].m_gradient += m_gradient;
-		break;
-	case Operation::Multiply:
-		if (m_inputs[0].node != NULL_INDEX) {
-			values[m_inputs[0].node].m_gradient += m_gradient * get_input_value(values, 1, data_values);
-		}
-		if (m_inputs[1].node != NULL_INDEX) {
-			values[m_inputs[1].node].m_gradient += m_gradient * get_input_value(values, 0, data_values);
-		}
-		break;
-	case Operation::Subtract:
-		if (m_inputs[0].node != NULL_INDEX) {
-			values[m_inputs[0].node].m_gradient += m_gradient;
-		}
-		if (m_inputs[1].node != NULL_INDEX) {
-			values[m_inputs[1].node].m_gradient -= m_gradient;
-		}
-		break;
-	case Operation::Divide:
-		if (m_inputs[0].node != NULL_INDEX && get_input_value(values, 1, data_values) != 0) {
-			values[m_inputs[0].node].m_gradient += m_gradient / values[m_inputs[1].node].m_value;
-		}
-		if (m_inputs[1].node != NULL_INDEX) {
-			values[m_inputs[1].node].m_gradient -= m_gradient * get_input_value(values, 0, data_values) /
-				(values[m_inputs[1].node].m_value * values[m_inputs[1].node].m_value);
-		}
-		break;
-	case Operation::Power:
-		if (m_inputs[0].node != NULL_INDEX) {
-			values[m_inputs[0].node].m_gradient += m_gradient * values[m_inputs[1].node].m_value *
-				pow(values[m_inputs[0].node].m_value, values[m_inputs[1].node].m_value - 1);
-		}
-		if (m_inputs[1].node != NULL_INDEX) {
-			values[m_inputs[1].node].m_gradient += m_gradient * pow(get_input_value(values, 0, data_values), 
-				values[m_inputs[1].node].m_value) * log(get_input_value(values, 0, data_values));
-		}
-		break;
-	case Operation::Tanh:
-		if (m_inputs[0].node != NULL_INDEX) {
-			values[m_inputs[0].node].m_gradient += m_gradient * (1.0f - std::powf(m_value, 2));
-		}
-		break;
-	case Operation::ReLU:
-		if (m_inputs[0].node != NULL_INDEX) {
-			values[m_inputs[0].node].m_gradient += m_gradient * (m_value > 0 ? 1.0f : 0.1f);
-		}
-		break;
-	case Operation::Sin:
-		if (m_inputs[0].node != NULL_INDEX) {
-			values[m_inputs[0].node].m_gradient += m_gradient * std::cos(m_value);
-		}
-		break;
-	case Operation::Cos:
-		if (m_inputs[0].node != NULL_INDEX) {
-			values[m_inputs[0].node].m_gradient += m_gradient * std::sin(m_value);
-		}
-		break;
-	case Operation::Sqrt:
-		if (m_inputs[0].node != NULL_INDEX) {
-			values[m_inputs[0].node].m_gradient += m_gradient * (1.0f / (2.0f * std::sqrt(m_value)));
-		}
-		break;
-	case Operation::Display:
-	case Operation::Result:
-	case Operation::Backwards:
-		if (m_inputs[0].node != NULL_INDEX) {
-			values[m_inputs[0].node].m_gradient += m_gradient;
-		}
-		break;
-
-	default:
-		//assert((false && "Unknown operation"));
-		break;
-	}
+	if (!is_computed_operation(m_operation))
+		return;
+
+	float gradient_a = 0.f;
+	float gradient_b = 0.f;
+	backward_operation(m_operation, get_input_value(values, 0, data_values), get_input_value(values, 1, data_values),
+		m_value, m_gradient, gradient_a, gradient_b);
+
+	if (m_inputs[0].node != NULL_INDEX)
+		values[m_inputs[0].node].m_gradient += gradient_a;
+	if (m_inputs[1].node != NULL_INDEX)
+		values[m_inputs[1].node].m_gradient += gradient_b;
 }
 
 void Value::backwards(Value* values, float* data_values) {
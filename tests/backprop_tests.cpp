@@ -1,6 +1,10 @@
 #include <iostream>
 #include <assert.h>     /* assert */
-#include "value.h"
+#include <cstring>
+#include <map>
+#include "computation_graph.h"
+#include "plugin_ops.h"
+#include "trainer.h"
 
 #define CHECK(x) \
 	if (!(x)) \
@@ -9,37 +13,1144 @@
 		return 1; \
 	}
 
-int main() {
+static Index add_node(ComputationGraph& graph, Operation operation, float value = 0.f) {
+	Value node = Value::make_value();
+	node.m_operation = operation;
+	node.m_value = value;
+	EditOperation op = EditOperation::add_node(node);
+	graph.apply_operation(op);
+	return graph.edit_operations.back().m_index;
+}
+
+static void connect(ComputationGraph& graph, Index start, Index end, unsigned short end_slot, unsigned short start_slot = 0) {
+	Connection connection(start, start_slot, end, end_slot);
+	EditOperation op = EditOperation::add_connection(connection);
+	graph.apply_operation(op);
+}
+
+static bool approximately(float a, float b, float tolerance) {
+	return std::fabs(a - b) <= tolerance * std::max(1.f, std::max(std::fabs(a), std::fabs(b)));
+}
+
+// Runs the graph forwards and backwards on one data point, the gradients end up in the nodes
+static void evaluate(ComputationGraph& graph, float* data_values) {
+	graph.forwards(data_values);
+	graph.zero_gradients();
+	graph.backwards(data_values);
+}
+
+// Central difference of node's value with respect to parameter
+static float finite_difference(ComputationGraph& graph, Index parameter, Index node, float* data_values) {
+	const float step = 1e-3f;
+	float value = graph.values[parameter].m_value;
+	graph.values[parameter].m_value = value + step;
+	graph.forwards(data_values);
+	float above = graph.values[node].m_value;
+	graph.values[parameter].m_value = value - step;
+	graph.forwards(data_values);
+	float below = graph.values[node].m_value;
+	graph.values[parameter].m_value = value;
+	graph.forwards(data_values);
+	return (above - below) / (2.f * step);
+}
+
+static int test_backprop() {
+	ComputationGraph graph;
+	float data[3] = { 0.f, 0.f, 0.f };
+
+	Index a = add_node(graph, Operation::Parameter, 2.0f);
+	Index b = add_node(graph, Operation::Parameter, -3.0f);
+	Index c = add_node(graph, Operation::Parameter, 10.f);
+	Index f = add_node(graph, Operation::Parameter, -2.f);
+	Index e = add_node(graph, Operation::Multiply);
+	Index d = add_node(graph, Operation::Add);
+	Index L = add_node(graph, Operation::Multiply);
+	Index backwards = add_node(graph, Operation::Backwards);
+	connect(graph, a, e, 0);
+	connect(graph, b, e, 1);
+	connect(graph, e, d, 0);
+	connect(graph, c, d, 1);
+	connect(graph, d, L, 0);
+	connect(graph, f, L, 1);
+	connect(graph, L, backwards, 0);
+
+	evaluate(graph, data);
+	CHECK(graph.values[a].m_value	 == 2.0f);
+	CHECK(graph.values[a].m_gradient == 6.f);
+
+	CHECK(graph.values[b].m_value	 == -3.f);
+	CHECK(graph.values[b].m_gradient == -4.f);
+
+	CHECK(graph.values[c].m_value	 == 10.f);
+	CHECK(graph.values[c].m_gradient == -2.f);
+
+	CHECK(graph.values[e].m_value	 == -6.f);
+	CHECK(graph.values[e].m_gradient == -2.f);
+
+	CHECK(graph.values[d].m_value	 == 4.f);
+	CHECK(graph.values[d].m_gradient == -2.f);
+
+	CHECK(graph.values[f].m_value	 == -2.f);
+	CHECK(graph.values[f].m_gradient == 4.f);
+
+	CHECK(graph.values[L].m_value	 == -8.f);
+	CHECK(graph.values[L].m_gradient == 1.f);
+	return 0;
+}
+
+// Every unary node's gradient against a finite difference, on both sides of ReLU's kink
+static int test_derivatives() {
+	const Operation operations[] = { Operation::Tanh, Operation::ReLU, Operation::Sin, Operation::Cos, Operation::Sqrt, Operation::Log };
+	const float inputs[] = { -1.3f, -0.4f, 0.25f, 0.7f, 1.9f };
+	float data[3] = { 0.f, 0.f, 0.f };
+
+	for (Operation operation : operations) {
+		for (float input : inputs) {
+			if ((operation == Operation::Sqrt || operation == Operation::Log) && input <= 0.f)
+				continue;
+			ComputationGraph graph;
+			Index x = add_node(graph, Operation::Parameter, input);
+			Index node = add_node(graph, operation);
+			Index backwards = add_node(graph, Operation::Backwards);
+			connect(graph, x, node, 0);
+			connect(graph, node, backwards, 0);
+
+			evaluate(graph, data);
+			float gradient = graph.values[x].m_gradient;
+			CHECK(approximately(gradient, finite_difference(graph, x, node, data), 1e-2f));
+		}
+	}
+	return 0;
+}
+
+// Trains and keeps the parameters of every snapshot it sees, by step
+static std::map<int, vector<float>> train_and_record(ComputationGraph& graph, TrainingMode mode, int num_workers) {
+	std::map<int, vector<float>> parameters;
+	Trainer trainer;
+	trainer.m_mode = mode;
+	trainer.m_num_workers = num_workers;
+	trainer.m_seed = 7;
+	trainer.m_batch_size = 40;
+	trainer.m_learning_rate = 0.05f;
+	// sleeping between batches gives this thread time to see most of the snapshots
+	trainer.m_duty_cycle = 0.1f;
+	trainer.start(graph, 0, 0.f);
+
+	auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+	TrainingSnapshot snapshot;
+	while (std::chrono::steady_clock::now() < give_up) {
+		if (trainer.read_snapshot(snapshot)) {
+			parameters[snapshot.m_steps] = snapshot.m_parameters;
+			if (snapshot.m_steps >= 4000)
+				break;
+		}
+		std::this_thread::yield();
+	}
+	trainer.stop();
+	return parameters;
+}
+
+// Fits w2 * tanh(w * x) to 0.7 * tanh(2 * x)
+static void build_training_graph(ComputationGraph& graph) {
+	Index x = add_node(graph, Operation::DataSource);
+	Index w = add_node(graph, Operation::Parameter, 0.1f);
+	Index w2 = add_node(graph, Operation::Parameter, 0.3f);
+	Index m = add_node(graph, Operation::Multiply);
+	Index t = add_node(graph, Operation::Tanh);
+	Index m2 = add_node(graph, Operation::Multiply);
+	Index loss = add_node(graph, Operation::MeanSquaredError);
+	Index backwards = add_node(graph, Operation::Backwards);
+	connect(graph, x, m, 0, 0);
+	connect(graph, w, m, 1);
+	connect(graph, m, t, 0);
+	connect(graph, t, m2, 0);
+	connect(graph, w2, m2, 1);
+	connect(graph, m2, loss, 0);
+	connect(graph, x, loss, 1, 1);
+	connect(graph, loss, backwards, 0);
+	for (int i = 0; i < 100; i++) {
+		DataPoint point;
+		point.x = i / 50.f - 1.f;
+		point.y = 0.7f * std::tanh(2.f * point.x);
+		point.label = 0.f;
+		graph.data_source.data.push_back(point);
+	}
+}
+
+static int test_deterministic_training() {
+	ComputationGraph graph;
+	build_training_graph(graph);
+
+	std::map<int, vector<float>> one = train_and_record(graph, TrainingMode::Deterministic, 1);
+	std::map<int, vector<float>> many = train_and_record(graph, TrainingMode::Deterministic, 5);
+	CHECK(!one.empty() && one.rbegin()->first >= 4000);
+	CHECK(!many.empty() && many.rbegin()->first >= 4000);
+
+	// every step both runs published has the same parameters, bit for bit
+	int num_compared = 0;
+	for (const auto& it : one) {
+		auto other = many.find(it.first);
+		if (other == many.end())
+			continue;
+		CHECK(other->second.size() == it.second.size());
+		CHECK(memcmp(other->second.data(), it.second.data(), it.second.size() * sizeof(float)) == 0);
+		num_compared++;
+	}
+	CHECK(num_compared > 0);
+	return 0;
+}
+
+// The nodes emit_gradient_graph adds compute what the backwards pass does, and can be
+// differentiated again
+static int test_emitted_gradients() {
+	ComputationGraph graph;
+	float data[3] = { 0.9f, 0.f, 0.f };
+	Index x = add_node(graph, Operation::DataSource);
+	Index w = add_node(graph, Operation::Parameter, 0.7f);
+	Index c = add_node(graph, Operation::Parameter, 0.3f);
+	Index m = add_node(graph, Operation::Multiply);
+	Index t = add_node(graph, Operation::Tanh);
+	Index p = add_node(graph, Operation::Power);
+	Index s = add_node(graph, Operation::Sin);
+	Index r = add_node(graph, Operation::ReLU);
+	Index d = add_node(graph, Operation::Divide);
+	Index q = add_node(graph, Operation::Sqrt);
+	Index backwards = add_node(graph, Operation::Backwards);
+	connect(graph, x, m, 0, 0);
+	connect(graph, w, m, 1);
+	connect(graph, m, t, 0);
+	connect(graph, t, p, 0);
+	connect(graph, c, p, 1);
+	connect(graph, p, s, 0);
+	connect(graph, s, r, 0);
+	connect(graph, r, d, 0);
+	connect(graph, w, d, 1);
+	connect(graph, d, q, 0);
+	connect(graph, q, backwards, 0);
+
+	evaluate(graph, data);
+	float gradient_w = graph.values[w].m_gradient;
+	float gradient_c = graph.values[c].m_gradient;
+
+	vector<Index> emitted = graph.emit_gradient_graph(backwards, { w, c });
+	CHECK(emitted.size() == 2);
+	graph.forwards(data);
+	CHECK(approximately(graph.values[emitted[0]].m_value, gradient_w, 1e-5f));
+	CHECK(approximately(graph.values[emitted[1]].m_value, gradient_c, 1e-5f));
+
+	vector<Index> second = graph.emit_gradient_graph(emitted[0], { w });
+	graph.forwards(data);
+	CHECK(approximately(graph.values[second[0]].m_value, finite_difference(graph, w, emitted[0], data), 1e-2f));
+
+	// each emit is one edit
+	graph.undo();
+	graph.undo();
+	CHECK(!graph.used[emitted[0]]);
+	CHECK(graph.used[backwards]);
+	return 0;
+}
+
+// Each fused loss against its formula, and its gradient for every input against a finite
+// difference. Softmax cross entropy takes the label first, then the logits.
+static int test_fused_losses() {
+	struct LossCase {
+		Operation	  operation;
+		vector<float> inputs;
+		float		  loss;
+	};
+	const LossCase cases[] = {
+		{ Operation::MeanSquaredError, { 0.4f, -0.3f }, 0.49f },
+		{ Operation::Hinge, { 0.3f, 1.f }, 0.7f },
+		{ Operation::Hinge, { 0.3f, 0.f }, 1.3f },
+		{ Operation::Hinge, { 1.6f, 1.f }, 0.f },
+		{ Operation::Logistic, { 0.6f, 1.f }, std::log(1.f + std::exp(0.6f)) - 0.6f },
+		{ Operation::Logistic, { -30.f, 0.f }, 0.f },
+		{ Operation::SoftmaxCrossEntropy, { 1.f, 0.63f, 0.12f, 1.17f },
+			std::log(std::exp(0.63f) + std::exp(0.12f) + std::exp(1.17f)) - 0.12f },
+	};
+	float data[3] = { 0.f, 0.f, 0.f };
+
+	for (const LossCase& loss_case : cases) {
+		ComputationGraph graph;
+		Index loss = add_node(graph, loss_case.operation);
+		Index backwards = add_node(graph, Operation::Backwards);
+		vector<Index> inputs;
+		for (unsigned short k = 0; k < loss_case.inputs.size(); k++) {
+			inputs.push_back(add_node(graph, Operation::Parameter, loss_case.inputs[k]));
+			connect(graph, inputs.back(), loss, k);
+		}
+		connect(graph, loss, backwards, 0);
+
+		evaluate(graph, data);
+		CHECK(approximately(graph.values[loss].m_value, loss_case.loss, 1e-5f));
+		// the label of softmax cross entropy picks a class, it has no gradient
+		size_t first = loss_case.operation == Operation::SoftmaxCrossEntropy ? 1 : 0;
+		for (size_t k = first; k < inputs.size(); k++) {
+			float gradient = graph.values[inputs[k]].m_gradient;
+			CHECK(approximately(gradient, finite_difference(graph, inputs[k], loss, data), 1e-2f));
+		}
+	}
+	return 0;
+}
+
+// A few layers of tanh units, deep and wide enough that memory planning has registers to reuse
+static void build_deep_graph(ComputationGraph& graph) {
+	Index x = add_node(graph, Operation::DataSource);
+	Index layer = x;
+	for (int i = 0; i < 8; i++) {
+		Index node = add_node(graph, i % 2 ? Operation::Sin : Operation::Cos);
+		connect(graph, layer, node, 0);
+		layer = node;
+	}
+	for (int depth = 0; depth < 6; depth++) {
+		Index sum = NULL_INDEX;
+		for (int unit = 0; unit < 10; unit++) {
+			Index w = add_node(graph, Operation::Parameter, 0.05f * unit - 0.2f + 0.01f * depth);
+			Index m = add_node(graph, Operation::Multiply);
+			Index t = add_node(graph, Operation::Tanh);
+			connect(graph, layer, m, 0);
+			connect(graph, w, m, 1);
+			connect(graph, m, t, 0);
+			if (sum == NULL_INDEX) {
+				sum = t;
+			}
+			else {
+				Index a = add_node(graph, Operation::Add);
+				connect(graph, sum, a, 0);
+				connect(graph, t, a, 1);
+				sum = a;
+			}
+		}
+		layer = sum;
+	}
+	Index loss = add_node(graph, Operation::MeanSquaredError);
+	Index backwards = add_node(graph, Operation::Backwards);
+	connect(graph, layer, loss, 0);
+	connect(graph, x, loss, 1, 1);
+	connect(graph, loss, backwards, 0);
+	graph.current_result_node = layer;
+}
+
+// Stopping at any point of a step, mostly while new plans are being copied over between the
+// thread's check of m_running and the round going out, mustn't leave the trainer waiting on
+// helpers that already quit
+static int test_trainer_stop() {
+	ComputationGraph graph;
+	build_deep_graph(graph);
+	for (int i = 0; i < 100; i++) {
+		DataPoint point;
+		point.x = i / 50.f - 1.f;
+		point.y = std::sin(3.f * point.x);
+		point.label = 0.f;
+		graph.data_source.data.push_back(point);
+	}
+
+	for (int i = 0; i < 400; i++) {
+		Trainer trainer;
+		trainer.m_mode = i % 2 ? TrainingMode::Hogwild : TrainingMode::Deterministic;
+		trainer.m_num_workers = 2 + (i / 2) % 4;
+		trainer.m_batch_size = 1;
+		trainer.start(graph, 0, 0.f);
+		for (int plan = 0; plan < i % 8; plan++) {
+			CHECK(trainer.submit_plan(graph));
+			std::this_thread::sleep_for(std::chrono::microseconds(i * 53 % 200));
+		}
+		trainer.stop();
+		CHECK(!trainer.is_running());
+	}
+	return 0;
+}
+
+// Runs points through a copy of plan and checks its loss and gradients match reference's
+static int compare_plans(const ExecutionPlan& reference, const ExecutionPlan& plan) {
+	const float points[3][3] = { { 0.3f, 0.1f, 1.f }, { -0.8f, 0.5f, 0.f }, { 1.4f, -0.6f, 1.f } };
+	ExecutionPlan a = reference;
+	ExecutionPlan b = plan;
+	for (const auto& point : points) {
+		vector<float> gradients_a(a.parameters.size(), 0.f);
+		vector<float> gradients_b(b.parameters.size(), 0.f);
+		a.accumulate_gradients(point, gradients_a);
+		b.accumulate_gradients(point, gradients_b);
+		CHECK(approximately(a.loss(), b.loss(), 1e-6f));
+		CHECK(gradients_a.size() == gradients_b.size());
+		for (size_t k = 0; k < gradients_a.size(); k++) {
+			CHECK(approximately(gradients_a[k], gradients_b[k], 1e-5f));
+		}
+	}
+	return 0;
+}
+
+static int test_memory_planning() {
+	ComputationGraph graph;
+	build_deep_graph(graph);
+	graph.compile_plan();
+	ExecutionPlan unplanned = graph.plan;
+	unplanned.load_parameters(graph);
+
+	ExecutionPlan planned = unplanned;
+	planned.plan_memory();
+	CHECK(planned.num_registers() < unplanned.num_registers());
+	CHECK(compare_plans(unplanned, planned) == 0);
+
+	// forwards only plans reuse more, and still get the same result
+	ExecutionPlan forwards_only = unplanned;
+	forwards_only.plan_memory(true);
+	CHECK(forwards_only.num_registers() <= planned.num_registers());
+	const float point[3] = { 0.3f, 0.1f, 1.f };
+	unplanned.forwards(point);
+	forwards_only.forwards(point);
+	CHECK(approximately(unplanned.values[unplanned.result_register], forwards_only.values[forwards_only.result_register], 1e-6f));
+	return 0;
+}
+
+static int test_checkpointing() {
+	ComputationGraph graph;
+	build_deep_graph(graph);
+	graph.compile_plan();
+	ExecutionPlan unplanned = graph.plan;
+	unplanned.load_parameters(graph);
+
+	ExecutionPlan planned = unplanned;
+	planned.plan_memory();
+	ExecutionPlan checkpointed = unplanned;
+	checkpointed.plan_memory(false, true);
+	CHECK(!checkpointed.checkpoint_levels.empty());
+	CHECK(checkpointed.num_registers() <= planned.num_registers());
+	CHECK(compare_plans(unplanned, checkpointed) == 0);
+	return 0;
+}
+
+// A one unit recurrent net, h = tanh(w * h_prev + u * x). Backpropagating through a window
+// has to give the derivative of the window's summed loss, starting from the same state.
+static int test_sequence_gradients() {
+	ComputationGraph graph;
+	Index x = add_node(graph, Operation::DataSource);
+	Index w = add_node(graph, Operation::Parameter, 0.8f);
+	Index u = add_node(graph, Operation::Parameter, 0.5f);
+	Index delay = add_node(graph, Operation::Delay);
+	Index recurrent = add_node(graph, Operation::Multiply);
+	Index input = add_node(graph, Operation::Multiply);
+	Index sum = add_node(graph, Operation::Add);
+	Index h = add_node(graph, Operation::Tanh);
+	Index loss = add_node(graph, Operation::MeanSquaredError);
+	Index backwards = add_node(graph, Operation::Backwards);
+	connect(graph, delay, recurrent, 0);
+	connect(graph, w, recurrent, 1);
+	connect(graph, x, input, 0, 0);
+	connect(graph, u, input, 1);
+	connect(graph, recurrent, sum, 0);
+	connect(graph, input, sum, 1);
+	connect(graph, sum, h, 0);
+	connect(graph, h, delay, 0);
+	connect(graph, h, loss, 0);
+	connect(graph, x, loss, 1, 1);
+	connect(graph, loss, backwards, 0);
+
+	vector<DataPoint> points;
+	for (int i = 0; i < 12; i++) {
+		DataPoint point;
+		point.x = std::sin(i * 0.7f);
+		point.y = 0.3f * std::cos(i * 0.5f);
+		point.label = 0.f;
+		points.push_back(point);
+	}
+
+	graph.compile_plan();
+	ExecutionPlan plan = graph.plan;
+	plan.load_parameters(graph);
+	CHECK(plan.has_state());
+
+	// warm the state up, then backpropagate through a window of 8
+	GradientSum warm_up;
+	warm_up.reset(plan.parameters.size());
+	plan.accumulate_sequence_gradients(&points[0].x, 3, warm_up);
+	const ExecutionPlan start = plan;
+	GradientSum gradients;
+	gradients.reset(plan.parameters.size());
+	plan.accumulate_sequence_gradients(&points[3].x, 8, gradients);
+
+	for (size_t k = 0; k < plan.parameters.size(); k++) {
+		const float step = 1e-3f;
+		GradientSum unused;
+		unused.reset(plan.parameters.size());
+		ExecutionPlan above = start;
+		above.values[above.parameter_registers[k]] += step;
+		float loss_above = above.accumulate_sequence_gradients(&points[3].x, 8, unused);
+		ExecutionPlan below = start;
+		below.values[below.parameter_registers[k]] -= step;
+		float loss_below = below.accumulate_sequence_gradients(&points[3].x, 8, unused);
+		CHECK(approximately(gradients.result()[k], (loss_above - loss_below) / (2.f * step), 1e-2f));
+	}
+	return 0;
+}
+
+// tanh(a*x + b*y + c) as one expression node and as plain nodes, fed the same way
+static int test_expressions() {
+	const char* formula = "tanh(a*x + b*y + c)";
+	ComputationGraph expression_graph;
+	ComputationGraph plain_graph;
+	vector<Index> expression_parameters;
+	vector<Index> plain_parameters;
+	const float initial[3] = { 0.7f, -0.4f, 0.2f };
+
+	{
+		ComputationGraph& graph = expression_graph;
+		Index x = add_node(graph, Operation::DataSource);
+		for (float value : initial) {
+			expression_parameters.push_back(add_node(graph, Operation::Parameter, value));
+		}
+		Value node = Value::make_value();
+		node.m_operation = Operation::Expression;
+		node.m_name = (char*)malloc(128);
+		snprintf(node.m_name, 128, "%s", formula);
+		EditOperation op = EditOperation::add_node(node);
+		graph.apply_operation(op);
+		Index expression = graph.edit_operations.back().m_index;
+		Index loss = add_node(graph, Operation::MeanSquaredError);
+		Index backwards = add_node(graph, Operation::Backwards);
+		// inputs in order of first appearance, a x b y c
+		connect(graph, expression_parameters[0], expression, 0);
+		connect(graph, x, expression, 1, 0);
+		connect(graph, expression_parameters[1], expression, 2);
+		connect(graph, x, expression, 3, 1);
+		connect(graph, expression_parameters[2], expression, 4);
+		connect(graph, expression, loss, 0);
+		connect(graph, x, loss, 1, 2);
+		connect(graph, loss, backwards, 0);
+		graph.current_result_node = expression;
+	}
+	{
+		ComputationGraph& graph = plain_graph;
+		Index x = add_node(graph, Operation::DataSource);
+		for (float value : initial) {
+			plain_parameters.push_back(add_node(graph, Operation::Parameter, value));
+		}
+		Index ax = add_node(graph, Operation::Multiply);
+		Index by = add_node(graph, Operation::Multiply);
+		Index sum = add_node(graph, Operation::Add);
+		Index biased = add_node(graph, Operation::Add);
+		Index t = add_node(graph, Operation::Tanh);
+		Index loss = add_node(graph, Operation::MeanSquaredError);
+		Index backwards = add_node(graph, Operation::Backwards);
+		connect(graph, plain_parameters[0], ax, 0);
+		connect(graph, x, ax, 1, 0);
+		connect(graph, plain_parameters[1], by, 0);
+		connect(graph, x, by, 1, 1);
+		connect(graph, ax, sum, 0);
+		connect(graph, by, sum, 1);
+		connect(graph, sum, biased, 0);
+		connect(graph, plain_parameters[2], biased, 1);
+		connect(graph, biased, t, 0);
+		connect(graph, t, loss, 0);
+		connect(graph, x, loss, 1, 2);
+		connect(graph, loss, backwards, 0);
+		graph.current_result_node = t;
+	}
+
+	float points[3][3] = { { 0.4f, -0.7f, 0.9f }, { -1.2f, 0.3f, -0.5f }, { 0.f, 2.f, 1.f } };
+	for (float* point : points) {
+		evaluate(expression_graph, point);
+		evaluate(plain_graph, point);
+		CHECK(approximately(expression_graph.values[expression_graph.current_result_node].m_value,
+			plain_graph.values[plain_graph.current_result_node].m_value, 1e-6f));
+		for (size_t k = 0; k < expression_parameters.size(); k++) {
+			CHECK(approximately(expression_graph.values[expression_parameters[k]].m_gradient,
+				plain_graph.values[plain_parameters[k]].m_gradient, 1e-5f));
+		}
+	}
+
+	Expression broken;
+	CHECK(!broken.compile("a +"));
+	CHECK(!broken.m_error.empty());
+	return 0;
+}
+
+// The plan of (w - 3)^2, with w starting from 0
+static ExecutionPlan build_quadratic_plan() {
+	ComputationGraph graph;
+	Index w = add_node(graph, Operation::Parameter, 0.f);
+	Index target = add_node(graph, Operation::Constant, 3.f);
+	Index loss = add_node(graph, Operation::MeanSquaredError);
+	Index backwards = add_node(graph, Operation::Backwards);
+	connect(graph, w, loss, 0);
+	connect(graph, target, loss, 1);
+	connect(graph, loss, backwards, 0);
+	graph.compile_plan();
+	ExecutionPlan plan = graph.plan;
+	plan.load_parameters(graph);
+	return plan;
+}
+
+// Every optimizer gets to the minimum of a quadratic, and Adam's first steps match the update
+// written out with its bias corrections
+static int test_optimizers() {
+	float data[3] = { 0.f, 0.f, 0.f };
+	const OptimizerType types[] = { OptimizerType::SGD, OptimizerType::Momentum, OptimizerType::RMSProp, OptimizerType::Adam };
+	const float learning_rates[] = { 0.1f, 0.05f, 0.01f, 0.05f };
+	for (int i = 0; i < 4; i++) {
+		ExecutionPlan plan = build_quadratic_plan();
+		CHECK(plan.parameters.size() == 1);
+		Optimizer optimizer;
+		optimizer.m_type = types[i];
+		optimizer.reset(1);
+		vector<float> gradient_acc(1);
+		for (int step = 0; step < 2000; step++) {
+			gradient_acc[0] = 0.f;
+			plan.accumulate_gradients(data, gradient_acc);
+			optimizer.step(plan, gradient_acc, 1.f, learning_rates[i]);
+		}
+		// RMSProp and Adam take steps of about the learning rate until the end
+		CHECK(std::fabs(plan.values[plan.parameter_registers[0]] - 3.f) < 0.05f);
+		plan.forwards(data);
+		CHECK(plan.loss() < 0.0025f);
+	}
+
+	ExecutionPlan plan = build_quadratic_plan();
+	Optimizer adam;
+	adam.m_type = OptimizerType::Adam;
+	adam.reset(1);
+	const double learning_rate = 0.1;
+	const double gradients[2] = { 2.0, -1.0 };
+	double expected = plan.values[plan.parameter_registers[0]];
+	double first = 0.0;
+	double second = 0.0;
+	for (int step = 1; step <= 2; step++) {
+		// summed over a batch of two
+		vector<float> gradient_acc(1, (float)(2.0 * gradients[step - 1]));
+		adam.step(plan, gradient_acc, 0.5f, (float)learning_rate);
+
+		first = 0.9 * first + 0.1 * gradients[step - 1];
+		second = 0.999 * second + 0.001 * gradients[step - 1] * gradients[step - 1];
+		double first_corrected = first / (1.0 - std::pow(0.9, step));
+		double second_corrected = second / (1.0 - std::pow(0.999, step));
+		expected -= learning_rate * first_corrected / (std::sqrt(second_corrected) + 1e-8);
+		CHECK(approximately(plan.values[plan.parameter_registers[0]], (float)expected, 1e-5f));
+	}
+	return 0;
+}
+
+// L-BFGS gets to the bottom of Rosenbrock's valley, (1 - x)^2 + 100 (y - x^2)^2. Its first
+// steps overshoot the curved valley, the backtracking has to cut them down until the loss drops.
+static int test_lbfgs() {
+	int evaluations = 0;
+	LbfgsOptimizer::Evaluate rosenbrock = [&evaluations](const vector<float>& parameters, vector<float>& gradient) {
+		evaluations++;
+		double x = parameters[0];
+		double y = parameters[1];
+		gradient.resize(2);
+		gradient[0] = (float)(-2.0 * (1.0 - x) - 400.0 * x * (y - x * x));
+		gradient[1] = (float)(200.0 * (y - x * x));
+		return (float)((1.0 - x) * (1.0 - x) + 100.0 * (y - x * x) * (y - x * x));
+	};
+
+	LbfgsOptimizer lbfgs;
+	vector<float> parameters = { -1.2f, 1.f };
+	vector<float> gradient;
+	float loss = rosenbrock(parameters, gradient);
+	evaluations = 0;
+	int backtracked = 0;
+	for (int iteration = 0; iteration < 200 && loss > 1e-8f; iteration++) {
+		int before = evaluations;
+		float next = lbfgs.step(parameters, rosenbrock);
+		// the first step also evaluates where it starts from
+		if (evaluations - before > (iteration == 0 ? 2 : 1)) {
+			backtracked++;
+		}
+		// every accepted step lowers the loss
+		CHECK(next <= loss);
+		loss = next;
+	}
+	CHECK(backtracked > 0);
+	CHECK(loss < 1e-6f);
+	CHECK(std::fabs(parameters[0] - 1.f) < 1e-2f);
+	CHECK(std::fabs(parameters[1] - 1.f) < 1e-2f);
+	return 0;
+}
+
+// Runs sep-CMA-ES on a quadratic bowl centred away from the start, returns the final mean
+static vector<float> evolve_quadratic(uint64_t seed, int generations) {
+	const float targets[5] = { 0.5f, -1.f, 0.25f, 2.f, -0.75f };
+	EvolutionStrategy evolution;
+	evolution.m_seed = seed;
+	evolution.reset(vector<float>(5, 0.f));
+	vector<float> losses(evolution.population_size());
+	for (int generation = 0; generation < generations; generation++) {
+		for (unsigned k = 0; k < evolution.population_size(); k++) {
+			losses[k] = 0.f;
+			for (size_t p = 0; p < 5; p++) {
+				float difference = evolution.candidate_parameter(k, p) - targets[p];
+				losses[k] += difference * difference;
+			}
+		}
+		evolution.update(losses);
+	}
+
+	vector<float> mean = evolution.mean();
+	for (size_t p = 0; p < 5; p++) {
+		mean[p] -= targets[p];
+	}
+	return mean;
+}
+
+// The search only sees the losses and still gets to the bottom, and a seed always gives
+// the same search
+static int test_evolution_strategy() {
+	vector<float> offset = evolve_quadratic(3, 60);
+	float loss = 0.f;
+	for (float difference : offset) {
+		loss += difference * difference;
+	}
+	// it starts from a loss of 5.875
+	CHECK(loss < 1e-3f);
+
+	vector<float> again = evolve_quadratic(3, 60);
+	CHECK(memcmp(again.data(), offset.data(), offset.size() * sizeof(float)) == 0);
+	// not so many generations that both runs land on the bottom exactly
+	vector<float> other = evolve_quadratic(4, 60);
+	CHECK(memcmp(other.data(), offset.data(), offset.size() * sizeof(float)) != 0);
+	return 0;
+}
+
+// Forward mode seeded at a parameter gives the loss's derivative with respect to it, which
+// the backwards pass gets for all of them at once
+static int test_tangents() {
+	ComputationGraph graph;
+	Index x = add_node(graph, Operation::DataSource);
+	Index parameters[4] = {
+		add_node(graph, Operation::Parameter, 0.8f),
+		add_node(graph, Operation::Parameter, -1.5f),
+		add_node(graph, Operation::Parameter, 0.4f),
+		add_node(graph, Operation::Parameter, 1.2f),
+	};
+	Index m = add_node(graph, Operation::Multiply);
+	Index s = add_node(graph, Operation::Sin);
+	Index m2 = add_node(graph, Operation::Multiply);
+	Index a = add_node(graph, Operation::Add);
+	Index t = add_node(graph, Operation::Tanh);
+	Index d = add_node(graph, Operation::Divide);
+	Index loss = add_node(graph, Operation::MeanSquaredError);
+	Index backwards = add_node(graph, Operation::Backwards);
+	connect(graph, x, m, 0);
+	connect(graph, parameters[0], m, 1);
+	connect(graph, m, s, 0);
+	connect(graph, s, m2, 0);
+	connect(graph, parameters[1], m2, 1);
+	connect(graph, m2, a, 0);
+	connect(graph, parameters[2], a, 1);
+	connect(graph, a, t, 0);
+	connect(graph, t, d, 0);
+	connect(graph, parameters[3], d, 1);
+	connect(graph, d, loss, 0);
+	connect(graph, x, loss, 1, 1);
+	connect(graph, loss, backwards, 0);
+
+	graph.compile_plan();
+	ExecutionPlan& plan = graph.plan;
+	plan.load_parameters(graph);
+	CHECK(plan.parameters.size() == 4);
+	CHECK(plan.backwards_registers.size() == 1);
+
+	float points[3][3] = { { 0.3f, 0.9f, 0.f }, { -0.8f, 0.5f, 0.f }, { 1.4f, -1.f, 0.f } };
+	for (float* point : points) {
+		plan.forwards(point);
+		plan.backwards();
+		for (Index parameter : parameters) {
+			Register r = plan.node_register[parameter];
+			float gradient = plan.gradients[r];
+			CHECK(std::fabs(gradient) > 1e-2f);
+			plan.forwards_tangents(r);
+			CHECK(approximately(plan.tangents[plan.backwards_registers[0]], gradient, 1e-5f));
+		}
+	}
+	return 0;
+}
+
+// Two losses sharing a parameter, each with a Backwards node if its weight isn't 0
+static vector<float> two_loss_gradients(float first_weight, float second_weight, float* data, float& loss) {
+	ComputationGraph graph;
+	Index x = add_node(graph, Operation::DataSource);
+	Index w = add_node(graph, Operation::Parameter, 0.6f);
+	Index w2 = add_node(graph, Operation::Parameter, -0.3f);
+	Index m = add_node(graph, Operation::Multiply);
+	Index squared_error = add_node(graph, Operation::MeanSquaredError);
+	Index a = add_node(graph, Operation::Add);
+	Index logistic = add_node(graph, Operation::Logistic);
+	connect(graph, x, m, 0);
+	connect(graph, w, m, 1);
+	connect(graph, m, squared_error, 0);
+	connect(graph, x, squared_error, 1, 1);
+	connect(graph, m, a, 0);
+	connect(graph, w2, a, 1);
+	connect(graph, a, logistic, 0);
+	connect(graph, x, logistic, 1, 2);
+	const Index losses[2] = { squared_error, logistic };
+	const float weights[2] = { first_weight, second_weight };
+	for (int i = 0; i < 2; i++) {
+		if (weights[i] != 0.f) {
+			Index backwards = add_node(graph, Operation::Backwards);
+			graph.values[backwards].m_weight = weights[i];
+			connect(graph, losses[i], backwards, 0);
+		}
+	}
+
+	graph.compile_plan();
+	ExecutionPlan& plan = graph.plan;
+	plan.load_parameters(graph);
+	plan.forwards(data);
+	plan.backwards();
+	loss = plan.loss();
+	return { plan.gradients[plan.node_register[w]], plan.gradients[plan.node_register[w2]] };
+}
+
+// With several Backwards nodes the pass starts from the weighted sum of their losses, so the
+// gradients are the weighted sum of each one's on its own
+static int test_multiple_backwards() {
+	float points[2][3] = { { 0.7f, -0.2f, 1.f }, { -1.1f, 0.4f, 0.f } };
+	for (float* point : points) {
+		float first_loss = 0.f;
+		float second_loss = 0.f;
+		float loss = 0.f;
+		vector<float> first = two_loss_gradients(1.f, 0.f, point, first_loss);
+		vector<float> second = two_loss_gradients(0.f, 1.f, point, second_loss);
+		vector<float> both = two_loss_gradients(0.7f, 2.5f, point, loss);
+		CHECK(approximately(loss, 0.7f * first_loss + 2.5f * second_loss, 1e-6f));
+		for (size_t p = 0; p < both.size(); p++) {
+			CHECK(approximately(both[p], 0.7f * first[p] + 2.5f * second[p], 1e-6f));
+		}
+		// the second parameter only reaches the logistic loss
+		CHECK(first[1] == 0.f && second[1] != 0.f);
+	}
+	return 0;
+}
 
-	Value a(2.0f);
-	Value b(-3.0f);
-	Value c(10.f);
-	Value e = a * b;
-	Value d = (e + c);
-	Value f(-2.f);
-	Value L = d * f;
+// Levels wide enough to be split into chunks and run on the pool give what running them in
+// order does. The bias feeds every unit, so its gradient gets summed over the chunks.
+static int test_parallel_levels() {
+	ComputationGraph graph;
+	Index x = add_node(graph, Operation::DataSource);
+	Index bias = add_node(graph, Operation::Parameter, 0.1f);
+	vector<Index> layer;
+	for (int unit = 0; unit < 2500; unit++) {
+		Index w = add_node(graph, Operation::Parameter, 0.001f * (unit % 7 - 3));
+		Index m = add_node(graph, Operation::Multiply);
+		Index a = add_node(graph, Operation::Add);
+		Index t = add_node(graph, Operation::Tanh);
+		connect(graph, x, m, 0);
+		connect(graph, w, m, 1);
+		connect(graph, m, a, 0);
+		connect(graph, bias, a, 1);
+		connect(graph, a, t, 0);
+		layer.push_back(t);
+	}
+	// pairwise, so the sum doesn't add thousands of levels
+	while (layer.size() > 1) {
+		vector<Index> sums;
+		for (size_t i = 0; i + 1 < layer.size(); i += 2) {
+			Index sum = add_node(graph, Operation::Add);
+			connect(graph, layer[i], sum, 0);
+			connect(graph, layer[i + 1], sum, 1);
+			sums.push_back(sum);
+		}
+		if (layer.size() % 2)
+			sums.push_back(layer.back());
+		layer.swap(sums);
+	}
+	Index loss = add_node(graph, Operation::MeanSquaredError);
+	Index backwards = add_node(graph, Operation::Backwards);
+	connect(graph, layer[0], loss, 0);
+	connect(graph, x, loss, 1, 1);
+	connect(graph, loss, backwards, 0);
+
+	graph.compile_plan();
+	ExecutionPlan parallel = graph.plan;
+	parallel.load_parameters(graph);
+	// a pool of its own, so the chunks run on other threads even on a single core
+	TaskPool pool(4);
+	parallel.pool = &pool;
+	CHECK(!parallel.forwards_chunks.empty());
+	CHECK(!parallel.backwards_chunks.empty());
+	CHECK(!parallel.reduce_targets.empty());
+
+	ExecutionPlan sequential = parallel;
+	sequential.pool = nullptr;
+	CHECK(compare_plans(sequential, parallel) == 0);
+	return 0;
+}
+
+// Every stage's schedule with num_stages stages, run by hand in whatever order the stages
+// can go. Checks a stage only goes ahead once what it depends on has run, that it never
+// needs more than one slot per stage, and that every point makes it through.
+static int check_pipeline_schedules(unsigned num_stages, unsigned num_points) {
+	vector<vector<PipelineStep>> schedules(num_stages);
+	for (unsigned stage = 0; stage < num_stages; stage++) {
+		pipeline_schedule(stage, num_stages, num_points, schedules[stage]);
+		const vector<PipelineStep>& steps = schedules[stage];
+		CHECK(steps.size() == 2 * num_points);
+		// warm up with forwards, then alternate until the forwards run out
+		unsigned warmup = std::min(num_stages - stage - 1, num_points);
+		for (unsigned i = 0; i < steps.size(); i++) {
+			bool backwards = i >= warmup && (i >= 2 * num_points - warmup || (i - warmup) % 2 == 1);
+			CHECK(steps[i].m_backwards == backwards);
+		}
+	}
+
+	vector<unsigned> position(num_stages, 0);
+	vector<unsigned> forwarded(num_stages, 0);
+	vector<unsigned> backwarded(num_stages, 0);
+	bool progress = true;
+	while (progress) {
+		progress = false;
+		for (unsigned stage = 0; stage < num_stages; stage++) {
+			if (position[stage] == schedules[stage].size())
+				continue;
+			const PipelineStep& step = schedules[stage][position[stage]];
+			if (step.m_backwards) {
+				CHECK(step.m_point == backwarded[stage] && step.m_point < forwarded[stage]);
+				if (stage + 1 < num_stages && backwarded[stage + 1] <= step.m_point)
+					continue;
+				backwarded[stage]++;
+			}
+			else {
+				CHECK(step.m_point == forwarded[stage]);
+				if (stage > 0 && forwarded[stage - 1] <= step.m_point)
+					continue;
+				// the point's slot was last used by the point num_stages before it
+				for (unsigned other = 0; other < num_stages; other++) {
+					CHECK(step.m_point < num_stages || backwarded[other] > step.m_point - num_stages);
+				}
+				forwarded[stage]++;
+				CHECK(forwarded[stage] - backwarded[stage] <= num_stages - stage);
+			}
+			position[stage]++;
+			progress = true;
+		}
+	}
+	for (unsigned stage = 0; stage < num_stages; stage++) {
+		CHECK(backwarded[stage] == num_points);
+	}
+	return 0;
+}
+
+// The levels get split into stages of about the same work, the 1F1B schedules fit together,
+// and streaming points through the stages gives what running them one at a time does
+static int test_pipeline() {
+	ComputationGraph deep_graph;
+	build_deep_graph(deep_graph);
+	deep_graph.compile_plan();
+	const ExecutionPlan& plan = deep_graph.plan;
+	unsigned total_work = 0;
+	unsigned largest_level = 0;
+	for (unsigned level = 0; level < plan.num_levels(); level++) {
+		total_work += plan.level_work(level);
+		largest_level = std::max(largest_level, plan.level_work(level));
+	}
+	for (unsigned num_stages = 1; num_stages <= 6; num_stages++) {
+		vector<unsigned> stage_levels;
+		split_pipeline_stages(plan, num_stages, stage_levels);
+		CHECK(stage_levels.size() == num_stages + 1);
+		CHECK(stage_levels.front() == 0 && stage_levels.back() == plan.num_levels());
+		for (unsigned stage = 0; stage < num_stages; stage++) {
+			CHECK(stage_levels[stage] < stage_levels[stage + 1]);
+			unsigned work = 0;
+			for (unsigned level = stage_levels[stage]; level < stage_levels[stage + 1]; level++) {
+				work += plan.level_work(level);
+			}
+			CHECK(work <= total_work / num_stages + largest_level);
+		}
+	}
+
+	for (unsigned num_stages = 1; num_stages <= 5; num_stages++) {
+		for (unsigned num_points : { 1u, 3u, 10u }) {
+			CHECK(check_pipeline_schedules(num_stages, num_points) == 0);
+		}
+	}
+
+	// the same points in the same order, summed in the same order, so bit for bit
+	ComputationGraph graph;
+	build_training_graph(graph);
+	std::map<int, vector<float>> synchronous = train_and_record(graph, TrainingMode::Synchronous, 1);
+	for (int num_stages = 2; num_stages <= 3; num_stages++) {
+		std::map<int, vector<float>> pipeline = train_and_record(graph, TrainingMode::Pipeline, num_stages);
+		CHECK(!pipeline.empty() && pipeline.rbegin()->first >= 4000);
+		int num_compared = 0;
+		for (const auto& it : synchronous) {
+			auto other = pipeline.find(it.first);
+			if (other == pipeline.end())
+				continue;
+			CHECK(other->second.size() == it.second.size());
+			CHECK(memcmp(other->second.data(), it.second.data(), it.second.size() * sizeof(float)) == 0);
+			num_compared++;
+		}
+		CHECK(num_compared > 0);
+	}
+	return 0;
+}
 
-	L.backwards();
-	CHECK(a.m_value	   == 2.0f);
-	CHECK(a.m_gradient == 6.f);
+// a * b + scale * sin(c), the op the plugin test registers. The batched kernels count their calls.
+struct SoftProduct {
+	float	 scale;
+	unsigned forward_batches;
+	unsigned backward_batches;
+};
 
-	CHECK(b.m_value	   == -3.f);
-	CHECK(b.m_gradient == -4.f);
+static float soft_product_forward(const float* inputs, void* user_data) {
+	const SoftProduct& op = *(const SoftProduct*)user_data;
+	return inputs[0] * inputs[1] + op.scale * std::sin(inputs[2]);
+}
+
+static void soft_product_backward(const float* inputs, float, float gradient, float* input_gradients, void* user_data) {
+	const SoftProduct& op = *(const SoftProduct*)user_data;
+	input_gradients[0] = gradient * inputs[1];
+	input_gradients[1] = gradient * inputs[0];
+	input_gradients[2] = gradient * op.scale * std::cos(inputs[2]);
+}
+
+static void soft_product_forward_batch(const float* inputs, float* outs, unsigned count, void* user_data) {
+	((SoftProduct*)user_data)->forward_batches++;
+	for (unsigned i = 0; i < count; i++) {
+		outs[i] = soft_product_forward(inputs + 3 * i, user_data);
+	}
+}
+
+static void soft_product_backward_batch(const float* inputs, const float* outs, const float* gradients,
+	float* input_gradients, unsigned count, void* user_data) {
+	((SoftProduct*)user_data)->backward_batches++;
+	for (unsigned i = 0; i < count; i++) {
+		soft_product_backward(inputs + 3 * i, outs[i], gradients[i], input_gradients + 3 * i, user_data);
+	}
+}
+
+// Ops registered straight into the registry, no library loaded, run like the built in ones.
+// Four nodes of the batched op share a level so they go through its batched kernels.
+static int test_plugin_ops() {
+	static SoftProduct single = { 2.f, 0, 0 };
+	static SoftProduct batched = { 0.5f, 0, 0 };
+	MlgardenOp op = {};
+	op.name = "test_soft_product";
+	op.num_inputs = 3;
+	op.forward = soft_product_forward;
+	op.backward = soft_product_backward;
+	op.user_data = &single;
+	PluginRegistry::register_op(&PluginRegistry::shared(), &op);
+	op.name = "test_soft_product_batched";
+	op.forward_batch = soft_product_forward_batch;
+	op.backward_batch = soft_product_backward_batch;
+	op.user_data = &batched;
+	PluginRegistry::register_op(&PluginRegistry::shared(), &op);
+	unsigned single_index = PluginRegistry::shared().find("test_soft_product");
+	unsigned batched_index = PluginRegistry::shared().find("test_soft_product_batched");
+	CHECK(single_index != NULL_INDEX && PluginRegistry::shared().is_loaded(single_index));
+	CHECK(batched_index != NULL_INDEX && PluginRegistry::shared().is_loaded(batched_index));
+
+	ComputationGraph graph;
+	Index x = add_node(graph, Operation::DataSource);
+	vector<Index> parameters;
+	for (int i = 0; i < 6; i++) {
+		parameters.push_back(add_node(graph, Operation::Parameter, 0.3f * i - 0.7f));
+	}
+	vector<Index> products;
+	for (int i = 0; i < 4; i++) {
+		Index product = add_node(graph, plugin_operation(batched_index));
+		connect(graph, x, product, 0);
+		connect(graph, parameters[i], product, 1);
+		connect(graph, parameters[i + 1], product, 2);
+		products.push_back(product);
+	}
+	Index product = add_node(graph, plugin_operation(single_index));
+	connect(graph, parameters[0], product, 0);
+	connect(graph, x, product, 1);
+	connect(graph, parameters[5], product, 2);
+	products.push_back(product);
+	Index sum = products[0];
+	for (size_t i = 1; i < products.size(); i++) {
+		Index a = add_node(graph, Operation::Add);
+		connect(graph, sum, a, 0);
+		connect(graph, products[i], a, 1);
+		sum = a;
+	}
+	Index loss = add_node(graph, Operation::MeanSquaredError);
+	Index backwards = add_node(graph, Operation::Backwards);
+	connect(graph, sum, loss, 0);
+	connect(graph, x, loss, 1, 1);
+	connect(graph, loss, backwards, 0);
 
-	CHECK(c.m_value	   == 10.f);
-	CHECK(c.m_gradient == -2.f);
+	float points[2][3] = { { 0.6f, -0.4f, 0.f }, { -1.3f, 0.8f, 0.f } };
+	for (float* point : points) {
+		evaluate(graph, point);
+		for (int i = 0; i < 4; i++) {
+			float inputs[3] = { point[0], graph.values[parameters[i]].m_value, graph.values[parameters[i + 1]].m_value };
+			CHECK(approximately(graph.values[products[i]].m_value, soft_product_forward(inputs, &batched), 1e-6f));
+		}
+		float inputs[3] = { graph.values[parameters[0]].m_value, point[0], graph.values[parameters[5]].m_value };
+		CHECK(approximately(graph.values[products[4]].m_value, soft_product_forward(inputs, &single), 1e-6f));
 
-	CHECK(e.m_value	   == -6.f);	
-	CHECK(e.m_gradient == -2.f);
+		for (Index parameter : parameters) {
+			float gradient = graph.values[parameter].m_gradient;
+			CHECK(gradient != 0.f);
+			CHECK(approximately(gradient, finite_difference(graph, parameter, loss, point), 1e-2f));
+		}
+	}
+	CHECK(batched.forward_batches > 0);
+	CHECK(batched.backward_batches > 0);
+	return 0;
+}
 
-	CHECK(d.m_value	   == 4.f);
-	CHECK(d.m_gradient == -2.f);
+// A big gradient, a thousand small ones and the big one taken back out. In float every small
+// one is lost under the big one, the other two precisions keep them.
+static int test_gradient_sum_precision() {
+	ExecutionPlan plan;
+	plan.parameters.push_back(0);
+	plan.parameter_registers.push_back(0);
+	plan.gradients.push_back(0.f);
 
-	CHECK(f.m_value	   == -2.f);
-	CHECK(f.m_gradient == 4.f);
+	const Precision precisions[] = { Precision::Float, Precision::Compensated, Precision::Double };
+	float sums[3];
+	for (int i = 0; i < 3; i++) {
+		GradientSum gradient_sum;
+		gradient_sum.m_precision = precisions[i];
+		gradient_sum.reset(1);
+		plan.gradients[0] = 1e8f;
+		gradient_sum.add(plan);
+		plan.gradients[0] = 1.f;
+		for (int point = 0; point < 1000; point++) {
+			gradient_sum.add(plan);
+		}
+		plan.gradients[0] = -1e8f;
+		gradient_sum.add(plan);
+		sums[i] = gradient_sum.result()[0];
 
-	CHECK(L.m_value	   == -8.f);
-	CHECK(L.m_gradient == 1.f);
+		// cleared sums start over
+		gradient_sum.clear();
+		plan.gradients[0] = 0.25f;
+		gradient_sum.add(plan);
+		CHECK(gradient_sum.result()[0] == 0.25f);
+	}
+	CHECK(std::fabs(sums[0] - 1000.f) > 100.f);
+	CHECK(std::fabs(sums[1] - 1000.f) < 1.f);
+	CHECK(sums[2] == 1000.f);
+	return 0;
+}
+
+int main() {
+	CHECK(test_backprop() == 0);
+	CHECK(test_derivatives() == 0);
+	CHECK(test_deterministic_training() == 0);
+	CHECK(test_trainer_stop() == 0);
+	CHECK(test_emitted_gradients() == 0);
+	CHECK(test_fused_losses() == 0);
+	CHECK(test_memory_planning() == 0);
+	CHECK(test_checkpointing() == 0);
+	CHECK(test_sequence_gradients() == 0);
+	CHECK(test_expressions() == 0);
+	CHECK(test_optimizers() == 0);
+	CHECK(test_lbfgs() == 0);
+	CHECK(test_evolution_strategy() == 0);
+	CHECK(test_tangents() == 0);
+	CHECK(test_multiple_backwards() == 0);
+	CHECK(test_parallel_levels() == 0);
+	CHECK(test_pipeline() == 0);
+	CHECK(test_plugin_ops() == 0);
+	CHECK(test_gradient_sum_precision() == 0);
 
 	printf("TESTS SUCCEEDED\n");
 	return 0;